@@ -0,0 +1,208 @@
+#include "precomp.hpp"
+#include "Affinity.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "Exceptions.hpp"
+
+using namespace std;
+
+namespace {
+
+/// Parses a kernel CPU list, such as "0-3,8-11"
+vector<int> parseCpuList(const string& list)
+{
+	vector<int> cpus;
+	istringstream in(list);
+	string range;
+	while (getline(in, range, ',')) {
+		if (range.empty() || range == "\n")
+			continue;
+
+		const size_t dash = range.find('-');
+		const int first = stoi(range.substr(0, dash));
+		const int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+		for (int cpu = first; cpu <= last; ++cpu)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+/// Returns the path of the CPU list of a NUMA node in sysfs
+string nodeCpuListPath(int node)
+{
+	return "/sys/devices/system/node/node" + to_string(node) + "/cpulist";
+}
+
+/// Returns the CPU list of a NUMA node from sysfs, or nothing if it doesn't exist
+vector<int> readNodeCpus(int node)
+{
+	ifstream file(nodeCpuListPath(node));
+	string list;
+	if (!getline(file, list))
+		return vector<int>();
+	return parseCpuList(list);
+}
+
+/// Returns every online CPU
+vector<int> onlineCpus()
+{
+	vector<int> cpus;
+#ifdef __linux__
+	const long count = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long cpu = 0; cpu < count; ++cpu)
+		cpus.push_back((int)cpu);
+#endif
+	return cpus;
+}
+
+} // end anonymous namespace
+
+namespace Affinity {
+
+size_t getNodeCount()
+{
+	// Nodes are numbered consecutively. (Memory-only nodes have an empty CPU list, but still have one.)
+	size_t nodes = 0;
+	while (ifstream(nodeCpuListPath((int)nodes)).good())
+		++nodes;
+	return max<size_t>(nodes, 1);
+}
+
+vector<int> getNodeCpus(int node)
+{
+	vector<int> cpus = readNodeCpus(node);
+	// Without NUMA, node 0 is the whole machine
+	if (cpus.empty() && node == 0 && getNodeCount() == 1)
+		cpus = onlineCpus();
+	return cpus;
+}
+
+int getNodeOfCpu(int cpu)
+{
+	const int nodes = (int)getNodeCount();
+	for (int node = 0; node < nodes; ++node) {
+		const vector<int> cpus = readNodeCpus(node);
+		if (find(cpus.begin(), cpus.end(), cpu) != cpus.end())
+			return node;
+	}
+	return 0;
+}
+
+int getCurrentCpu()
+{
+#ifdef __linux__
+	return sched_getcpu();
+#else
+	return -1;
+#endif
+}
+
+int getCurrentNode()
+{
+#ifdef __linux__
+	unsigned int cpu = 0;
+	unsigned int node = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+		return (int)node;
+#endif
+	return 0;
+}
+
+vector<int> getThreadCpus()
+{
+	vector<int> cpus;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &set))
+				cpus.push_back(cpu);
+		}
+		return cpus;
+	}
+#endif
+	return onlineCpus();
+}
+
+void pinThread(const vector<int>& cpus)
+{
+	if (cpus.empty())
+		throw Exceptions::ArgumentException("A thread can't be pinned to no CPUs", __FUNCTION__);
+
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus) {
+		if (cpu < 0 || cpu >= CPU_SETSIZE)
+			throw Exceptions::ArgumentOutOfRangeException("Invalid CPU number", __FUNCTION__);
+		CPU_SET(cpu, &set);
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) != 0)
+		throw Exceptions::IOException("Could not set the thread's CPU affinity", __FUNCTION__);
+#endif
+}
+
+vector<size_t> getPagesPerNode(const void* memory, size_t bytes)
+{
+	vector<size_t> pagesPerNode;
+#if defined(__linux__) && defined(SYS_move_pages)
+	const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	const uintptr_t first = (uintptr_t)memory & ~(uintptr_t)(pageSize - 1);
+	const uintptr_t end = (uintptr_t)memory + bytes;
+	if (bytes == 0)
+		return pagesPerNode;
+
+	vector<void*> pages;
+	for (uintptr_t page = first; page < end; page += pageSize)
+		pages.push_back((void*)page);
+
+	// With no target nodes, move_pages just reports the node of each page (or a negative error for pages that
+	// aren't resident)
+	vector<int> status(pages.size());
+	if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, status.data(), 0) != 0)
+		return pagesPerNode;
+
+	pagesPerNode.resize(getNodeCount());
+	for (int node : status) {
+		if (node < 0)
+			continue;
+		if ((size_t)node >= pagesPerNode.size())
+			pagesPerNode.resize(node + 1);
+		++pagesPerNode[node];
+	}
+#else
+	(void)memory;
+	(void)bytes;
+#endif
+	return pagesPerNode;
+}
+
+ScopedPin::ScopedPin(const vector<int>& cpus)
+	: previous(getThreadCpus())
+{
+	pinThread(cpus);
+}
+
+ScopedPin::~ScopedPin()
+{
+	try {
+		pinThread(previous);
+	}
+	catch (...) {
+		// There's nothing sensible to do if we can't go back, and destructors mustn't throw
+	}
+}
+
+} // end namespace Affinity
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * \brief Pins threads to CPUs and reports which NUMA node memory and threads are on
+ *
+ * Extractor state is placed by first touch: the extractor zeroes its buffers when it's constructed,
+ * so constructing it on a thread that is already pinned to a node's CPUs keeps its state on that node.
+ * A reader/extractor pipeline (or a pool worker) should therefore pin itself before creating anything:
+ *
+ * \code
+ * Affinity::ScopedPin pin(Affinity::getNodeCpus(node));
+ * MotionExtractor extractor(width, height, fps, false);
+ * \endcode
+ *
+ * On systems without NUMA, everything reports a single node 0.
+ * Where thread affinity isn't supported at all (anything but Linux), pinning does nothing.
+ */
+namespace Affinity {
+
+	/// Returns the number of NUMA nodes (1 if the system doesn't have NUMA)
+	size_t getNodeCount();
+
+	/// Returns the CPUs of a NUMA node
+	std::vector<int> getNodeCpus(int node);
+
+	/// Returns the NUMA node of a CPU (0 if unknown)
+	int getNodeOfCpu(int cpu);
+
+	/// Returns the CPU the calling thread is currently running on (-1 if unknown)
+	int getCurrentCpu();
+
+	/// Returns the NUMA node the calling thread is currently running on (0 if unknown)
+	int getCurrentNode();
+
+	/// Returns the CPUs the calling thread is allowed to run on
+	std::vector<int> getThreadCpus();
+
+	/**
+	 * \brief Restricts the calling thread to the given CPUs
+	 * \throws Exceptions::ArgumentException if cpus is empty
+	 * \throws Exceptions::IOException if the system rejects the set (e.g. none of the CPUs are online)
+	 */
+	void pinThread(const std::vector<int>& cpus);
+
+	/**
+	 * \brief Counts the pages of a range of memory on each NUMA node
+	 * \returns The number of resident pages on each node, indexed by node.
+	 *          Pages that haven't been touched yet aren't counted.
+	 *          Empty if the system can't report placement.
+	 */
+	std::vector<size_t> getPagesPerNode(const void* memory, size_t bytes);
+
+	/// Pins the calling thread to a set of CPUs for its lifetime, then restores the thread's previous CPUs
+	class ScopedPin final {
+	public:
+		explicit ScopedPin(const std::vector<int>& cpus);
+
+		~ScopedPin();
+
+		// No copying
+		ScopedPin(const ScopedPin&) = delete;
+		ScopedPin& operator=(const ScopedPin&) = delete;
+
+	private:
+		std::vector<int> previous;
+	};
+}
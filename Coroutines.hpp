@@ -0,0 +1,337 @@
+#pragma once
+
+// Coroutine interfaces for reading frames and generating motion masks. These need C++20;
+// the rest of the library doesn't.
+#if !defined(__cpp_impl_coroutine)
+#error "Coroutines.hpp requires C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "Executor.hpp"
+#include "MotionEvent.hpp"
+#include "MotionEventGenerator.hpp"
+#include "MotionExtractor.hpp"
+#include "StreamVideoFrame.hpp"
+#include "VideoReader.hpp"
+
+/**
+ * \brief A synchronous generator: a coroutine that co_yields values to a range-for loop
+ *
+ * Each yielded value is only valid until the loop advances.
+ */
+template <typename T>
+class Generator final {
+public:
+	struct promise_type {
+		const T* current = nullptr;
+		std::exception_ptr exception;
+
+		Generator get_return_object() { return Generator(Handle::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		std::suspend_always yield_value(const T& value) noexcept
+		{
+			current = std::addressof(value);
+			return {};
+		}
+		void return_void() noexcept { }
+		void unhandled_exception() { exception = std::current_exception(); }
+	};
+
+	using Handle = std::coroutine_handle<promise_type>;
+
+	class iterator {
+	public:
+		explicit iterator(Handle h) : coro(h) { }
+
+		const T& operator*() const { return *coro.promise().current; }
+
+		iterator& operator++()
+		{
+			coro.resume();
+			rethrowIfFailed(coro);
+			return *this;
+		}
+
+		bool operator==(std::default_sentinel_t) const { return coro.done(); }
+
+	private:
+		Handle coro;
+	};
+
+	Generator(Generator&& other) noexcept : coro(std::exchange(other.coro, nullptr)) { }
+
+	~Generator()
+	{
+		if (coro)
+			coro.destroy();
+	}
+
+	/// Runs the coroutine to its first co_yield
+	iterator begin()
+	{
+		coro.resume();
+		rethrowIfFailed(coro);
+		return iterator(coro);
+	}
+
+	std::default_sentinel_t end() { return {}; }
+
+	// No copying
+	Generator(const Generator&) = delete;
+	Generator& operator=(const Generator&) = delete;
+
+private:
+	explicit Generator(Handle h) : coro(h) { }
+
+	static void rethrowIfFailed(Handle h)
+	{
+		if (h.promise().exception != nullptr)
+			std::rethrow_exception(h.promise().exception);
+	}
+
+	Handle coro;
+};
+
+/**
+ * \brief An asynchronous generator: a coroutine that can co_await between the values it co_yields
+ *
+ * Consumers co_await next(), which resumes the generator until it yields a value (returned as a pointer,
+ * valid until the next call) or finishes (nullptr). Don't call next() again after it returns nullptr.
+ */
+template <typename T>
+class AsyncGenerator final {
+public:
+	struct promise_type;
+	using Handle = std::coroutine_handle<promise_type>;
+
+	/// Hands control back to whoever is waiting on next()
+	struct YieldAwaiter {
+		bool await_ready() noexcept { return false; }
+		std::coroutine_handle<> await_suspend(Handle h) noexcept
+		{
+			if (h.promise().consumer)
+				return h.promise().consumer;
+			return std::noop_coroutine();
+		}
+		void await_resume() noexcept { }
+	};
+
+	struct promise_type {
+		const T* current = nullptr;
+		std::coroutine_handle<> consumer;
+		std::exception_ptr exception;
+
+		AsyncGenerator get_return_object() { return AsyncGenerator(Handle::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		YieldAwaiter final_suspend() noexcept
+		{
+			current = nullptr;
+			return {};
+		}
+		YieldAwaiter yield_value(const T& value) noexcept
+		{
+			current = std::addressof(value);
+			return {};
+		}
+		void return_void() noexcept { }
+		void unhandled_exception() { exception = std::current_exception(); }
+	};
+
+	/// Resumes the generator until it yields or finishes
+	struct NextAwaiter {
+		Handle coro;
+
+		bool await_ready() noexcept { return false; }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiting) noexcept
+		{
+			coro.promise().consumer = waiting;
+			return coro;
+		}
+		const T* await_resume()
+		{
+			if (coro.promise().exception != nullptr)
+				std::rethrow_exception(coro.promise().exception);
+			return coro.promise().current;
+		}
+	};
+
+	AsyncGenerator(AsyncGenerator&& other) noexcept : coro(std::exchange(other.coro, nullptr)) { }
+
+	~AsyncGenerator()
+	{
+		if (coro)
+			coro.destroy();
+	}
+
+	NextAwaiter next() { return NextAwaiter{ coro }; }
+
+	// No copying
+	AsyncGenerator(const AsyncGenerator&) = delete;
+	AsyncGenerator& operator=(const AsyncGenerator&) = delete;
+
+private:
+	explicit AsyncGenerator(Handle h) : coro(h) { }
+
+	Handle coro;
+};
+
+/**
+ * \brief A coroutine that runs on a RunLoop until it finishes, such as one consuming an AsyncGenerator
+ *
+ * A task doesn't run until it's started, and then belongs to the loop.
+ * If it throws, RunLoop::run rethrows the exception once every other task has finished.
+ */
+class Task final {
+public:
+	struct promise_type {
+		RunLoop* loop = nullptr;
+
+		Task get_return_object() { return Task(Handle::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() { loop->endTask(); }
+		void unhandled_exception() { loop->endTask(std::current_exception()); }
+	};
+
+	using Handle = std::coroutine_handle<promise_type>;
+
+	Task(Task&& other) noexcept : coro(std::exchange(other.coro, nullptr)) { }
+
+	~Task()
+	{
+		if (coro)
+			coro.destroy();
+	}
+
+	/// Schedules the task to start on the loop, which takes ownership of it
+	void start(RunLoop& loop) &&
+	{
+		Handle h = std::exchange(coro, nullptr);
+		h.promise().loop = &loop;
+		loop.beginTask();
+		loop.post([h] { h.resume(); });
+	}
+
+	// No copying
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+private:
+	explicit Task(Handle h) : coro(h) { }
+
+	Handle coro;
+};
+
+/**
+ * \brief Awaits the reader's next frame, decoded on one executor and resumed on another
+ *
+ * While the decode (including any blocking reads of the input) runs on the worker executor,
+ * the home executor's thread is free to run other coroutines.
+ * A reader must only have one decode in flight at a time.
+ */
+class NextFrameAwaiter final {
+public:
+	NextFrameAwaiter(VideoReader& r, Executor& w, Executor& h)
+		: reader(r), worker(w), home(h), frame(), error()
+	{ }
+
+	bool await_ready() noexcept { return false; }
+
+	void await_suspend(std::coroutine_handle<> waiting)
+	{
+		worker.post([this, waiting] {
+			try {
+				frame = reader.getNextFrame();
+			}
+			catch (...) {
+				error = std::current_exception();
+			}
+			home.post([waiting] { waiting.resume(); });
+		});
+	}
+
+	/// Returns the frame, or null at the end of the video
+	std::shared_ptr<StreamVideoFrame> await_resume()
+	{
+		if (error != nullptr)
+			std::rethrow_exception(error);
+		return std::move(frame);
+	}
+
+private:
+	VideoReader& reader;
+	Executor& worker;
+	Executor& home;
+	std::shared_ptr<StreamVideoFrame> frame;
+	std::exception_ptr error;
+};
+
+/// Returns an awaitable for the reader's next frame (see NextFrameAwaiter)
+inline NextFrameAwaiter nextFrame(VideoReader& reader, Executor& worker, Executor& home)
+{
+	return NextFrameAwaiter(reader, worker, home);
+}
+
+/// Yields every remaining frame of the reader, decoding on the calling thread
+inline Generator<std::shared_ptr<StreamVideoFrame>> readFrames(VideoReader& reader)
+{
+	while (true) {
+		const std::shared_ptr<StreamVideoFrame>& frame = reader.getNextFrame();
+		if (frame == nullptr)
+			co_return;
+		co_yield frame;
+	}
+}
+
+/// What motionResults yields for each frame
+struct MotionResult {
+	std::shared_ptr<StreamVideoFrame> frame; ///< The frame
+	const VideoFrame* mask; ///< The extractor's motion mask for the frame (overwritten by the next frame)
+	std::vector<MotionEvent> events; ///< The events the frame generated
+};
+
+/**
+ * \brief Decodes frames on a worker executor and yields each one's motion mask and events
+ * \param reader Where frames come from
+ * \param extractor Generates each frame's motion mask (on the home executor)
+ * \param events Generates each frame's events (on the home executor). Its queue is drained into each result.
+ * \param worker Where frames are decoded
+ * \param home Where the generator runs between decodes, normally the RunLoop running its consumer
+ *
+ * For example, one thread can drive a pipeline per camera, with decoding spread over a pool:
+ * \code
+ * Task watch(AsyncGenerator<MotionResult> results)
+ * {
+ *     while (const MotionResult* r = co_await results.next()) {
+ *         // Handle r->events, look at *r->mask...
+ *     }
+ * }
+ *
+ * watch(motionResults(reader, extractor, events, pool, loop)).start(loop); // For each camera
+ * loop.run();
+ * \endcode
+ */
+inline AsyncGenerator<MotionResult> motionResults(VideoReader& reader, MotionExtractor& extractor,
+                                                  MotionEventGenerator& events, Executor& worker, Executor& home)
+{
+	MotionResult result{ nullptr, nullptr, {} };
+	while (true) {
+		result.frame = co_await nextFrame(reader, worker, home);
+		if (result.frame == nullptr)
+			co_return;
+
+		result.mask = &extractor.generateMotionMask(*result.frame);
+		events.update(extractor, result.frame->getPTS());
+		result.events.clear();
+		MotionEvent e;
+		while (events.nextEvent(e))
+			result.events.push_back(e);
+		co_yield result;
+	}
+}
@@ -0,0 +1,110 @@
+#include "precomp.hpp"
+#include "Executor.hpp"
+
+#include "Exceptions.hpp"
+
+using namespace std;
+
+ThreadPoolExecutor::ThreadPoolExecutor(size_t threadCount)
+	: lock(),
+	  wake(),
+	  queue(),
+	  stopping(false),
+	  threads()
+{
+	if (threadCount == 0)
+		throw Exceptions::ArgumentOutOfRangeException("A thread pool needs at least one thread", __FUNCTION__);
+
+	threads.reserve(threadCount);
+	for (size_t i = 0; i < threadCount; ++i)
+		threads.emplace_back(&ThreadPoolExecutor::workerLoop, this);
+}
+
+ThreadPoolExecutor::~ThreadPoolExecutor()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (thread& t : threads)
+		t.join();
+}
+
+void ThreadPoolExecutor::post(function<void()> work)
+{
+	{
+		lock_guard<mutex> guard(lock);
+		queue.push_back(move(work));
+	}
+	wake.notify_one();
+}
+
+void ThreadPoolExecutor::workerLoop()
+{
+	while (true) {
+		function<void()> work;
+		{
+			unique_lock<mutex> guard(lock);
+			wake.wait(guard, [this] { return stopping || !queue.empty(); });
+			if (queue.empty())
+				return;
+			work = move(queue.front());
+			queue.pop_front();
+		}
+		work();
+	}
+}
+
+RunLoop::RunLoop()
+	: lock(),
+	  wake(),
+	  queue(),
+	  tasks(0),
+	  firstError()
+{ }
+
+void RunLoop::post(function<void()> work)
+{
+	// Signal while holding the lock, so run() can't return and let the loop be destroyed first
+	lock_guard<mutex> guard(lock);
+	queue.push_back(move(work));
+	wake.notify_one();
+}
+
+void RunLoop::beginTask()
+{
+	lock_guard<mutex> guard(lock);
+	++tasks;
+}
+
+void RunLoop::endTask(exception_ptr error)
+{
+	lock_guard<mutex> guard(lock);
+	--tasks;
+	if (error != nullptr && firstError == nullptr)
+		firstError = error;
+	wake.notify_one();
+}
+
+void RunLoop::run()
+{
+	while (true) {
+		function<void()> work;
+		{
+			unique_lock<mutex> guard(lock);
+			// While tasks are waiting on other executors, wait for them to post their continuations
+			wake.wait(guard, [this] { return !queue.empty() || tasks == 0; });
+			if (queue.empty()) {
+				exception_ptr error = firstError;
+				firstError = nullptr;
+				if (error != nullptr)
+					rethrow_exception(error);
+				return;
+			}
+			work = move(queue.front());
+			queue.pop_front();
+		}
+		work();
+	}
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Something that runs work, somewhere
+class Executor {
+public:
+	virtual ~Executor() = default;
+
+	/// Queues work to run. May be called from any thread.
+	virtual void post(std::function<void()> work) = 0;
+};
+
+/**
+ * \brief Runs work on a fixed set of threads
+ *
+ * Useful for blocking work, such as decoding video (see Coroutines.hpp).
+ * Work still queued when the executor is destroyed is run before the threads exit.
+ */
+class ThreadPoolExecutor final : public Executor {
+public:
+	/// \param threads The number of threads (at least one)
+	explicit ThreadPoolExecutor(size_t threads);
+
+	~ThreadPoolExecutor();
+
+	void post(std::function<void()> work) override;
+
+	// No copying
+	ThreadPoolExecutor(const ThreadPoolExecutor&) = delete;
+	ThreadPoolExecutor& operator=(const ThreadPoolExecutor&) = delete;
+
+private:
+	/// Runs queued work until stopping
+	void workerLoop();
+
+	std::mutex lock;
+	std::condition_variable wake; ///< Signaled when work is queued or the pool is stopping
+	std::deque<std::function<void()>> queue;
+	bool stopping;
+	std::vector<std::thread> threads;
+};
+
+/**
+ * \brief Runs work on the thread that calls run(), one piece at a time
+ *
+ * Coroutine pipelines (see Coroutines.hpp) are started on a run loop, and resumed on it whenever work
+ * they handed off to another executor finishes, so one thread can drive many streams without blocking.
+ * The loop counts its tasks, and run() returns once they've all finished.
+ */
+class RunLoop final : public Executor {
+public:
+	RunLoop();
+
+	void post(std::function<void()> work) override;
+
+	/**
+	 * \brief Runs posted work until every task has finished and nothing is left to run
+	 * \throws The first exception a task didn't handle, once the others have finished
+	 */
+	void run();
+
+	/// Notes that a task has started. run() won't return until it has ended.
+	void beginTask();
+
+	/// Notes that a task has ended, possibly with an exception it didn't handle
+	void endTask(std::exception_ptr error = nullptr);
+
+	// No copying
+	RunLoop(const RunLoop&) = delete;
+	RunLoop& operator=(const RunLoop&) = delete;
+
+private:
+	std::mutex lock;
+	std::condition_variable wake; ///< Signaled when work is posted or a task ends
+	std::deque<std::function<void()>> queue;
+	size_t tasks; ///< Tasks begun and not yet ended
+	std::exception_ptr firstError; ///< The first exception a task didn't handle
+};
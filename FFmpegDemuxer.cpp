@@ -0,0 +1,139 @@
+#include "precomp.hpp"
+#include "FFmpegDemuxer.hpp"
+
+#include "Exceptions.hpp"
+
+using namespace std;
+
+FFmpegDemuxer::FFmpegDemuxer(const string& file)
+	: filename(file),
+	  ctxt(nullptr),
+	  videoStreams(),
+	  slots(),
+	  readers(),
+	  queues()
+{
+	if (avformat_open_input(&ctxt, filename.c_str(), nullptr, nullptr) != 0)
+		throw Exceptions::IOException("Cannot open video file", __FUNCTION__);
+
+	if (avformat_find_stream_info(ctxt, nullptr) < 0) {
+		close();
+		throw Exceptions::IOException("Could not find stream info for video file", __FUNCTION__);
+	}
+
+	slots.assign(ctxt->nb_streams, -1);
+	for (unsigned int i = 0; i < ctxt->nb_streams; ++i) {
+		if (ctxt->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+			slots[i] = (int)videoStreams.size();
+			videoStreams.push_back(i);
+		}
+	}
+	if (videoStreams.empty()) {
+		close();
+		throw Exceptions::IOException("No video stream could be found in the file.", __FUNCTION__);
+	}
+
+	readers.resize(videoStreams.size());
+	queues.resize(videoStreams.size());
+}
+
+FFmpegDemuxer::~FFmpegDemuxer()
+{
+	close();
+}
+
+void FFmpegDemuxer::close()
+{
+	clearQueues();
+	// The readers use the format context, so they go first
+	readers.clear();
+	avformat_close_input(&ctxt);
+}
+
+FFmpegVideoReader& FFmpegDemuxer::getVideoStream(size_t i)
+{
+	if (i >= videoStreams.size())
+		throw Exceptions::ArgumentOutOfRangeException("There is no video stream with that number", __FUNCTION__);
+
+	if (readers[i] == nullptr) {
+		const int stream = videoStreams[i];
+		readers[i].reset(new FFmpegVideoReader(*this, stream, filename + "." + to_string(stream) + ".kfidx"));
+	}
+	return *readers[i];
+}
+
+size_t FFmpegDemuxer::getQueuedPackets(size_t i) const
+{
+	if (i >= videoStreams.size())
+		throw Exceptions::ArgumentOutOfRangeException("There is no video stream with that number", __FUNCTION__);
+
+	return queues[i].size();
+}
+
+size_t FFmpegDemuxer::memoryUsage() const
+{
+	size_t total = sizeof(*this);
+	for (const auto& reader : readers) {
+		if (reader != nullptr)
+			total += reader->memoryUsage();
+	}
+	for (const auto& queue : queues) {
+		for (const AVPacket* queued : queue)
+			total += sizeof(AVPacket) + queued->size;
+	}
+	return total;
+}
+
+bool FFmpegDemuxer::readPacket(int stream, AVPacket* packet)
+{
+	// Take a packet another stream's read already found for us
+	deque<AVPacket*>& queue = queues[slots[stream]];
+	if (!queue.empty()) {
+		AVPacket* queued = queue.front();
+		queue.pop_front();
+		av_packet_move_ref(packet, queued);
+		av_packet_free(&queued);
+		return true;
+	}
+
+	while (av_read_frame(ctxt, packet) >= 0) {
+		if (packet->stream_index == stream)
+			return true;
+
+		// Hang onto packets for the other streams we're reading and drop the rest,
+		// including those of streams that appeared after the file was opened (such as in MPEG-TS)
+		const int slot = packet->stream_index >= 0 && (size_t)packet->stream_index < slots.size()
+			? slots[packet->stream_index] : -1;
+		if (slot >= 0 && readers[slot] != nullptr) {
+			AVPacket* queued = av_packet_alloc();
+			if (queued == nullptr) {
+				av_packet_unref(packet);
+				throw Exceptions::IOException("Could not allocate a packet", __FUNCTION__);
+			}
+			av_packet_move_ref(queued, packet);
+			queues[slot].push_back(queued);
+		}
+		else {
+			av_packet_unref(packet);
+		}
+	}
+	return false;
+}
+
+void FFmpegDemuxer::flush()
+{
+	clearQueues();
+	for (auto& reader : readers) {
+		if (reader != nullptr)
+			reader->flushDecoder();
+	}
+}
+
+void FFmpegDemuxer::clearQueues()
+{
+	for (auto& queue : queues) {
+		for (AVPacket* queued : queue)
+			av_packet_free(&queued);
+		queue.clear();
+	}
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "FFmpegVideoReader.hpp"
+
+/**
+ * \brief Demuxes a file once and decodes each of its video streams with its own FFmpegVideoReader
+ *
+ * Recorders that mux several cameras into one file can be read this way without opening
+ * (and demuxing) the file once per camera. When a stream's reader needs a packet, the demuxer reads
+ * packets until it finds one for that stream, queueing the ones it finds for the other streams' readers.
+ * Packets are only queued for streams whose readers have been created with getVideoStream,
+ * so create every reader you need before reading any frames.
+ *
+ * Read the streams at roughly the same pace (e.g. a frame from each in turn),
+ * since the packets of a stream that falls behind pile up in its queue.
+ * The demuxer and its readers must be used from one thread.
+ */
+class FFmpegDemuxer {
+
+public:
+
+	/// Constructor
+	/// \param filename Path of the video file to open
+	explicit FFmpegDemuxer(const std::string& filename);
+
+	~FFmpegDemuxer();
+
+	/// Gets the number of video streams in the file
+	size_t getVideoStreamCount() const { return videoStreams.size(); }
+
+	/**
+	 * \brief Gets the reader for a video stream, creating it the first time
+	 * \param i The video stream, from 0 to getVideoStreamCount() - 1 (in the order they appear in the file)
+	 *
+	 * The reader stays owned by the demuxer, and its keyframe index is saved to <filename>.<stream>.kfidx.
+	 */
+	FFmpegVideoReader& getVideoStream(size_t i);
+
+	/// Gets the number of packets waiting in the queue of a video stream's reader
+	size_t getQueuedPackets(size_t i) const;
+
+	/// Returns the number of bytes of memory held by the demuxer's readers and packet queues
+	size_t memoryUsage() const;
+
+	// No copying
+	FFmpegDemuxer(const FFmpegDemuxer&) = delete;
+	FFmpegDemuxer& operator=(const FFmpegDemuxer&) = delete;
+
+private:
+
+	friend class FFmpegVideoReader;
+
+	/// Moves the next packet for the given stream (by its index in the file) into packet.
+	/// Returns false at EOF.
+	bool readPacket(int stream, AVPacket* packet);
+
+	/// Drops all queued packets and flushes every reader's decoder (e.g. when a reader seeks)
+	void flush();
+
+	/// Frees all queued packets
+	void clearQueues();
+
+	/// Closes the file
+	void close();
+
+	std::string filename;
+
+	AVFormatContext* ctxt;
+
+	/// The file's stream index of each video stream
+	std::vector<int> videoStreams;
+
+	/// For each stream in the file, its position in videoStreams (-1 if it isn't a video stream)
+	std::vector<int> slots;
+
+	/// The reader of each video stream (null until requested)
+	std::vector<std::unique_ptr<FFmpegVideoReader>> readers;
+
+	/// Packets read for each video stream that its reader hasn't asked for yet
+	std::vector<std::deque<AVPacket*>> queues;
+};
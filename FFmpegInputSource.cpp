@@ -0,0 +1,135 @@
+#include "precomp.hpp"
+#include "FFmpegInputSource.hpp"
+
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Exceptions.hpp"
+
+using namespace std;
+
+MemoryInputSource::MemoryInputSource(const uint8_t* buffer, size_t size)
+	: data(buffer), dataSize(size), position(0), owned()
+{
+	if (buffer == nullptr && size > 0)
+		throw Exceptions::ArgumentNullException("Input data cannot be null", __FUNCTION__);
+}
+
+MemoryInputSource::MemoryInputSource(vector<uint8_t>&& buffer)
+	: data(nullptr), dataSize(0), position(0), owned(move(buffer))
+{
+	data = owned.data();
+	dataSize = owned.size();
+}
+
+MemoryInputSource::MemoryInputSource()
+	: data(nullptr), dataSize(0), position(0), owned()
+{ }
+
+int MemoryInputSource::read(uint8_t* buf, int size)
+{
+	const size_t toRead = min((size_t)size, dataSize - position);
+	memcpy(buf, data + position, toRead);
+	position += toRead;
+	return (int)toRead;
+}
+
+int64_t MemoryInputSource::seek(int64_t offset, int whence)
+{
+	int64_t target;
+	switch (whence) {
+		case SEEK_SET: target = offset; break;
+		case SEEK_CUR: target = (int64_t)position + offset; break;
+		case SEEK_END: target = (int64_t)dataSize + offset; break;
+		default: return -1;
+	}
+	if (target < 0 || target > (int64_t)dataSize)
+		return -1;
+
+	position = (size_t)target;
+	return target;
+}
+
+MappedFileInputSource::MappedFileInputSource(const string& filename)
+	: MemoryInputSource()
+{
+	const int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw Exceptions::FileException("Cannot open video file", __FUNCTION__);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		throw Exceptions::FileException("Cannot get the size of the video file", __FUNCTION__);
+	}
+	dataSize = (size_t)st.st_size;
+
+	if (dataSize > 0) {
+		void* mapping = mmap(nullptr, dataSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping == MAP_FAILED) {
+			close(fd);
+			throw Exceptions::FileException("Cannot map the video file", __FUNCTION__);
+		}
+		// Videos are mostly read front to back
+		madvise(mapping, dataSize, MADV_SEQUENTIAL);
+		data = (const uint8_t*)mapping;
+	}
+	close(fd); // The mapping keeps the file open
+}
+
+MappedFileInputSource::~MappedFileInputSource()
+{
+	if (data != nullptr)
+		munmap((void*)data, dataSize);
+}
+
+FileDescriptorInputSource::FileDescriptorInputSource(int fileDescriptor, bool closeOnDestroy)
+	: fd(fileDescriptor), closeWhenDone(closeOnDestroy), seekable(false)
+{
+	if (fd < 0)
+		throw Exceptions::ArgumentException("Invalid file descriptor", __FUNCTION__);
+
+	seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+}
+
+FileDescriptorInputSource::~FileDescriptorInputSource()
+{
+	if (closeWhenDone)
+		close(fd);
+}
+
+int FileDescriptorInputSource::read(uint8_t* buf, int size)
+{
+	ssize_t ret;
+	do {
+		ret = ::read(fd, buf, (size_t)size);
+	} while (ret < 0 && errno == EINTR);
+	return (int)ret;
+}
+
+int64_t FileDescriptorInputSource::seek(int64_t offset, int whence)
+{
+	if (!seekable)
+		return -1;
+	return (int64_t)lseek(fd, (off_t)offset, whence);
+}
+
+int64_t FileDescriptorInputSource::size() const
+{
+	struct stat st;
+	if (!seekable || fstat(fd, &st) != 0)
+		return -1;
+	return (int64_t)st.st_size;
+}
+
+CallbackInputSource::CallbackInputSource(ReadFunction readFn, SeekFunction seekFn, int64_t sz)
+	: reader(move(readFn)), seeker(move(seekFn)), streamSize(sz)
+{
+	if (!reader)
+		throw Exceptions::ArgumentNullException("A read callback is required", __FUNCTION__);
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * \brief A source of encoded video bytes for FFmpegVideoReader, read through a custom AVIOContext
+ *
+ * This lets videos be read from places other than a file path, such as memory or pipes.
+ */
+class FFmpegInputSource {
+public:
+	virtual ~FFmpegInputSource() { }
+
+	/**
+	 * \brief Reads the next bytes of the stream
+	 * \param buf The buffer to read into
+	 * \param size The maximum number of bytes to read
+	 * \returns The number of bytes read, 0 at the end of the stream, or a negative value on error
+	 */
+	virtual int read(uint8_t* buf, int size) = 0;
+
+	/// Returns true if seek() is supported. Some formats can't be read without seeking.
+	virtual bool isSeekable() const = 0;
+
+	/**
+	 * \brief Seeks to a position in the stream
+	 * \param offset The offset to seek to, relative to whence
+	 * \param whence SEEK_SET, SEEK_CUR, or SEEK_END
+	 * \returns The new position, or a negative value on error
+	 */
+	virtual int64_t seek(int64_t offset, int whence) = 0;
+
+	/// Returns the size of the stream in bytes, or a negative value if it is unknown
+	virtual int64_t size() const = 0;
+};
+
+/// Reads a video from a buffer in memory
+class MemoryInputSource : public FFmpegInputSource {
+public:
+	/**
+	 * \brief Reads from memory owned by someone else
+	 * \warning The memory must outlive the reader
+	 */
+	MemoryInputSource(const uint8_t* data, size_t size);
+
+	/// Takes ownership of a buffer and reads from it
+	explicit MemoryInputSource(std::vector<uint8_t>&& buffer);
+
+	int read(uint8_t* buf, int size) override;
+
+	bool isSeekable() const override { return true; }
+
+	int64_t seek(int64_t offset, int whence) override;
+
+	int64_t size() const override { return (int64_t)dataSize; }
+
+protected:
+	/// For derived classes that set data and dataSize themselves
+	MemoryInputSource();
+
+	const uint8_t* data;
+	size_t dataSize;
+	size_t position;
+
+private:
+	std::vector<uint8_t> owned; ///< The buffer, if we own it
+};
+
+/**
+ * \brief Reads a video from a memory-mapped file, which avoids a system call per read
+ *
+ * Each read still copies from the mapping into the AVIOContext's buffer. libavformat owns that buffer
+ * (it reallocates and frees it), so it can't point into the mapping, and its demuxers copy each packet's
+ * payload out of it into the packet's own buffer regardless.
+ */
+class MappedFileInputSource final : public MemoryInputSource {
+public:
+	/// Maps the file at the given path
+	explicit MappedFileInputSource(const std::string& filename);
+
+	~MappedFileInputSource();
+};
+
+/// Reads a video from a file descriptor, such as a pipe or socket
+class FileDescriptorInputSource final : public FFmpegInputSource {
+public:
+	/**
+	 * \param fd The file descriptor to read from
+	 * \param closeWhenDone true to close the descriptor when the source is destroyed
+	 */
+	FileDescriptorInputSource(int fd, bool closeWhenDone);
+
+	~FileDescriptorInputSource();
+
+	int read(uint8_t* buf, int size) override;
+
+	/// Pipes and sockets are not seekable, but regular files are
+	bool isSeekable() const override { return seekable; }
+
+	int64_t seek(int64_t offset, int whence) override;
+
+	int64_t size() const override;
+
+private:
+	int fd;
+	bool closeWhenDone;
+	bool seekable;
+};
+
+/// Reads a video through user-provided callbacks
+class CallbackInputSource final : public FFmpegInputSource {
+public:
+	/// Same semantics as FFmpegInputSource::read
+	typedef std::function<int(uint8_t* buf, int size)> ReadFunction;
+
+	/// Same semantics as FFmpegInputSource::seek
+	typedef std::function<int64_t(int64_t offset, int whence)> SeekFunction;
+
+	/**
+	 * \param reader Called to read bytes
+	 * \param seeker Called to seek, or empty if the stream is not seekable
+	 * \param streamSize The size of the stream, or -1 if it is unknown
+	 */
+	explicit CallbackInputSource(ReadFunction reader, SeekFunction seeker = SeekFunction(), int64_t streamSize = -1);
+
+	int read(uint8_t* buf, int size) override { return reader(buf, size); }
+
+	bool isSeekable() const override { return (bool)seeker; }
+
+	int64_t seek(int64_t offset, int whence) override { return seeker ? seeker(offset, whence) : -1; }
+
+	int64_t size() const override { return streamSize; }
+
+private:
+	ReadFunction reader;
+	SeekFunction seeker;
+	int64_t streamSize;
+};
@@ -1,29 +1,83 @@
 #include "precomp.hpp"
 #include "FFmpegVideoReader.hpp"
 
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <thread>
+
+#include <sys/stat.h>
+
 #include "Exceptions.hpp"
+#include "FFmpegDemuxer.hpp"
+#include "FFmpegInputSource.hpp"
 
 using namespace std;
 
+// avcodec_send_packet and avcodec_receive_frame (libavcodec 58) are the oldest API this reader is written against
+#if LIBAVCODEC_VERSION_MAJOR < 58
+#error "FFmpegVideoReader needs FFmpeg 4.0 or newer"
+#endif
+
 namespace {
 
-// True if libavformat hasn't been initialized yet
-bool needsInit = true;
+// Keyframe index sidecar files: the magic, the version, the video stream index, the size of the video file,
+// its modification time, the keyframe count, then the keyframe timestamps. Everything is little-endian.
+const char kIndexMagic[8] = {'V', 'M', 'O', 'X', 'K', 'F', 'I', 'X'};
+const uint32_t kIndexVersion = 2;
+const size_t kIndexHeaderSize = 40;
+
+/// The most packets whose arrival times are remembered while waiting for their frames
+const size_t kMaxArrivals = 64;
+
+/// Live mode restarts its clock instead of waiting longer than this for a frame
+/// (its time stamp probably jumped)
+const chrono::seconds kMaxPaceWait(1);
+
+void putLE(uint64_t v, size_t bytes, uint8_t* out)
+{
+	for (size_t i = 0; i < bytes; ++i, v >>= 8)
+		out[i] = (uint8_t)v;
+}
+
+uint64_t getLE(const uint8_t* in, size_t bytes)
+{
+	uint64_t v = 0;
+	for (size_t i = 0; i < bytes; ++i)
+		v |= (uint64_t)in[i] << (8 * i);
+	return v;
+}
+
+// AVIOContext callbacks for FFmpegInputSources
+
+int readInput(void* opaque, uint8_t* buf, int size)
+{
+	const int ret = static_cast<FFmpegInputSource*>(opaque)->read(buf, size);
+	if (ret == 0)
+		return AVERROR_EOF;
+	return ret < 0 ? AVERROR(EIO) : ret;
+}
 
-inline void init()
+int64_t seekInput(void* opaque, int64_t offset, int whence)
 {
-	av_register_all();
-	needsInit = false;
+	FFmpegInputSource* source = static_cast<FFmpegInputSource*>(opaque);
+	if (whence & AVSEEK_SIZE)
+		return source->size();
+	return source->seek(offset, whence & ~AVSEEK_FORCE);
+}
+
+/// Gets a file's modification time (0 if it can't be found)
+int64_t modificationTime(const string& path)
+{
+	struct stat st;
+	return stat(path.c_str(), &st) == 0 ? (int64_t)st.st_mtime : 0;
 }
 
 } // end anonymous namespace
 
 bool FFmpegVideoReader::canReadFile(const string& filename)
 {
-	// If needed, do global initialization
-	if (needsInit)
-		init();
-
 	AVFormatContext* ctxt = nullptr;
 	const int ret = avformat_open_input(&ctxt, filename.c_str(), nullptr, nullptr);
 	if (ret == 0)
@@ -37,165 +91,723 @@ FFmpegVideoReader::FFmpegVideoReader(const string& filename, bool flipBytes)
 	: ctxt(nullptr),
 	  codecCtxt(nullptr),
 	  swsCtxt(nullptr),
+	  input(),
+	  ioCtxt(nullptr),
+	  demuxer(nullptr),
 	  videoStream(-1),
 	  videoTimeBase(),
-	  currentPacket(),
-	  amountProcessed(0),
+	  packet(nullptr),
+	  decodedFrame(nullptr),
+	  draining(false),
+	  framePending(false),
+	  lastPTS(AV_NOPTS_VALUE),
+	  liveMode(false),
+	  latePolicy(LatePolicy::SkipConversion),
+	  lateTolerance(100),
+	  paceStartPTS(AV_NOPTS_VALUE),
+	  paceStart(),
+	  lateStreak(0),
+	  skippingToKeyframe(false),
+	  lateFrames(0),
+	  arrivals(),
+	  decodedArrival(),
+	  latencyFrames(0),
+	  latencyTotal(0),
+	  latencyLast(0),
+	  latencyMax(0),
+	  filename(),
+	  indexPath(),
+	  keyframes(),
+	  keyframesIndexed(false),
 	  currentFrame(),
 	  fps(-1),
-	  byteFlip(flipBytes)
+	  outputWidth(0),
+	  outputHeight(0),
+	  outputFormat(flipBytes ? AV_PIX_FMT_BGR24 : AV_PIX_FMT_RGB24),
+	  outputDepth(3),
+	  scalingFilter(SWS_FAST_BILINEAR),
+	  frameResource(pmr::get_default_resource())
 {
-	// If needed, do global initialization
-	if (needsInit)
-		init();
-
 	// Code is hobbled together from various online tutorials and ffmpeg docs.
+	open(filename.c_str());
+	this->filename = filename;
+	indexPath = filename + ".kfidx";
+}
 
-	// Open the file
-	if (avformat_open_input(&ctxt, filename.c_str(), nullptr, nullptr) != 0)
+FFmpegVideoReader::FFmpegVideoReader(unique_ptr<FFmpegInputSource> source, bool flipBytes, size_t ioBufferSize)
+	: ctxt(nullptr),
+	  codecCtxt(nullptr),
+	  swsCtxt(nullptr),
+	  input(move(source)),
+	  ioCtxt(nullptr),
+	  demuxer(nullptr),
+	  videoStream(-1),
+	  videoTimeBase(),
+	  packet(nullptr),
+	  decodedFrame(nullptr),
+	  draining(false),
+	  framePending(false),
+	  lastPTS(AV_NOPTS_VALUE),
+	  liveMode(false),
+	  latePolicy(LatePolicy::SkipConversion),
+	  lateTolerance(100),
+	  paceStartPTS(AV_NOPTS_VALUE),
+	  paceStart(),
+	  lateStreak(0),
+	  skippingToKeyframe(false),
+	  lateFrames(0),
+	  arrivals(),
+	  decodedArrival(),
+	  latencyFrames(0),
+	  latencyTotal(0),
+	  latencyLast(0),
+	  latencyMax(0),
+	  filename(),
+	  indexPath(),
+	  keyframes(),
+	  keyframesIndexed(false),
+	  currentFrame(),
+	  fps(-1),
+	  outputWidth(0),
+	  outputHeight(0),
+	  outputFormat(flipBytes ? AV_PIX_FMT_BGR24 : AV_PIX_FMT_RGB24),
+	  outputDepth(3),
+	  scalingFilter(SWS_FAST_BILINEAR),
+	  frameResource(pmr::get_default_resource())
+{
+	if (input == nullptr)
+		throw Exceptions::ArgumentNullException("The input source cannot be null", __FUNCTION__);
+	if (ioBufferSize == 0 || ioBufferSize > INT_MAX)
+		throw Exceptions::ArgumentOutOfRangeException("Invalid I/O buffer size", __FUNCTION__);
+
+	// Have libavformat read through the source instead of opening a file
+	unsigned char* ioBuffer = (unsigned char*)av_malloc(ioBufferSize);
+	if (ioBuffer == nullptr)
+		throw Exceptions::IOException("Could not allocate the I/O buffer", __FUNCTION__);
+
+	ioCtxt = avio_alloc_context(ioBuffer, (int)ioBufferSize, 0, input.get(), &readInput, nullptr,
+	                            input->isSeekable() ? &seekInput : nullptr);
+	ctxt = avformat_alloc_context();
+	if (ioCtxt == nullptr || ctxt == nullptr) {
+		avformat_free_context(ctxt);
+		freeIO();
+		throw Exceptions::IOException("Could not allocate the I/O context", __FUNCTION__);
+	}
+	ioCtxt->seekable = input->isSeekable() ? AVIO_SEEKABLE_NORMAL : 0;
+	ctxt->pb = ioCtxt;
+	ctxt->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+	open("");
+}
+
+FFmpegVideoReader::FFmpegVideoReader(FFmpegDemuxer& demux, int stream, const string& index)
+	: ctxt(demux.ctxt),
+	  codecCtxt(nullptr),
+	  swsCtxt(nullptr),
+	  input(),
+	  ioCtxt(nullptr),
+	  demuxer(&demux),
+	  videoStream(stream),
+	  videoTimeBase(),
+	  packet(nullptr),
+	  decodedFrame(nullptr),
+	  draining(false),
+	  framePending(false),
+	  lastPTS(AV_NOPTS_VALUE),
+	  liveMode(false),
+	  latePolicy(LatePolicy::SkipConversion),
+	  lateTolerance(100),
+	  paceStartPTS(AV_NOPTS_VALUE),
+	  paceStart(),
+	  lateStreak(0),
+	  skippingToKeyframe(false),
+	  lateFrames(0),
+	  arrivals(),
+	  decodedArrival(),
+	  latencyFrames(0),
+	  latencyTotal(0),
+	  latencyLast(0),
+	  latencyMax(0),
+	  filename(demux.filename),
+	  indexPath(index),
+	  keyframes(),
+	  keyframesIndexed(false),
+	  currentFrame(),
+	  fps(-1),
+	  outputWidth(0),
+	  outputHeight(0),
+	  outputFormat(AV_PIX_FMT_RGB24),
+	  outputDepth(3),
+	  scalingFilter(SWS_FAST_BILINEAR),
+	  frameResource(pmr::get_default_resource())
+{
+	openDecoder();
+}
+
+void FFmpegVideoReader::open(const char* url)
+{
+	// Open the file (avformat_open_input frees the context on failure)
+	if (avformat_open_input(&ctxt, url, nullptr, nullptr) != 0) {
+		freeIO();
 		throw Exceptions::IOException("Cannot open video file", __FUNCTION__);
+	}
 
 	// See if we have any streams (we should)
 	if (avformat_find_stream_info(ctxt, nullptr) < 0) {
-		avformat_close_input(&ctxt);
+		closeInput();
 		throw Exceptions::IOException("Could not find stream info for video file", __FUNCTION__);
 	}
 
-	// Find the first video stream in the file and get a pointer to its codec context
-	videoStream = -1;
-	for (unsigned int i = 0; i < ctxt->nb_streams; ++i) {
-		if (ctxt->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
-			videoStream = i;
-			break;
-		}
-	}
-	if (videoStream == -1) {
-		avformat_close_input(&ctxt);
+	// Find the best video stream in the file (usually the first one)
+	videoStream = av_find_best_stream(ctxt, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+	if (videoStream < 0) {
+		closeInput();
 		throw Exceptions::IOException("No video stream could be found in the file.", __FUNCTION__);
 	}
 
-	codecCtxt = ctxt->streams[videoStream]->codec;
+	openDecoder();
+}
+
+void FFmpegVideoReader::openDecoder()
+{
+	openCodec();
+
+	// The packet and frame are reused for the life of the reader so the decoder can recycle its buffers
+	packet = av_packet_alloc();
+	decodedFrame = av_frame_alloc();
+	if (packet == nullptr || decodedFrame == nullptr) {
+		closeInput();
+		throw Exceptions::IOException("Could not allocate the packet and frame", __FUNCTION__);
+	}
+
+	// Get the frame rate and time base
+	const AVStream* stream = ctxt->streams[videoStream];
+	AVRational rate = stream->r_frame_rate;
+	if (rate.num == 0 || rate.den == 0)
+		rate = stream->avg_frame_rate;
+	fps = av_q2d(rate);
+	videoTimeBase = stream->time_base;
+}
+
+void FFmpegVideoReader::openCodec()
+{
+	AVStream* stream = ctxt->streams[videoStream];
 
 	// Find the decoder for the video stream
-	AVCodec* codec = avcodec_find_decoder(codecCtxt->codec_id);
+	const AVCodec* codec = avcodec_find_decoder(stream->codecpar->codec_id);
 	if (codec == nullptr) {
-		avformat_close_input(&ctxt);
+		closeInput();
 		throw Exceptions::IOException("No decoder could be found for the video stream.", __FUNCTION__);
 	}
 
-	// Inform the codec that we can handle truncated bitstreams
-	if (codec->capabilities & CODEC_CAP_TRUNCATED)
-		codecCtxt->flags |= CODEC_FLAG_TRUNCATED;
+	// Set up our own decoder context from the stream's parameters,
+	// letting the decoder pick how many threads to use
+	codecCtxt = avcodec_alloc_context3(codec);
+	if (codecCtxt == nullptr
+	    || avcodec_parameters_to_context(codecCtxt, stream->codecpar) < 0) {
+		closeInput();
+		throw Exceptions::IOException("Could not set up the decoder for the video stream.", __FUNCTION__);
+	}
+	codecCtxt->pkt_timebase = stream->time_base;
+	codecCtxt->thread_count = 0;
+	if (liveMode) {
+		// Frame threading holds back a frame per thread, so only split frames into slices
+		codecCtxt->flags |= AV_CODEC_FLAG_LOW_DELAY;
+		codecCtxt->flags2 |= AV_CODEC_FLAG2_FAST;
+		codecCtxt->thread_type = FF_THREAD_SLICE;
+	}
 
-	if (avcodec_open2(codecCtxt, codec, 0) < 0) {
-		avformat_close_input(&ctxt);
+	if (avcodec_open2(codecCtxt, codec, nullptr) < 0) {
+		closeInput();
 		throw Exceptions::IOException("The codec for the video stream could not be opened.", __FUNCTION__);
 	}
+}
 
-	// Get the frame rate and time base
-	AVRational& rate = ctxt->streams[videoStream]->r_frame_rate;
-	fps = av_q2d(rate);
-	videoTimeBase = ctxt->streams[videoStream]->time_base;
+void FFmpegVideoReader::closeInput()
+{
+	av_frame_free(&decodedFrame);
+	av_packet_free(&packet);
+	avcodec_free_context(&codecCtxt);
+	// A demuxer's input is shared by all of its readers, so only it closes the input
+	if (demuxer == nullptr) {
+		avformat_close_input(&ctxt);
+		freeIO();
+	}
+}
 
-	// Zero out the current packet
-	memset(&currentPacket, 0, sizeof(currentPacket));
+void FFmpegVideoReader::freeIO()
+{
+	// libavformat doesn't free custom I/O contexts. It may have replaced the buffer, so free whatever it has now.
+	// (Newer versions allocate the context inside a larger private struct, so only libavformat can free it.)
+	if (ioCtxt != nullptr) {
+		av_freep(&ioCtxt->buffer);
+		avio_context_free(&ioCtxt);
+	}
 }
 
 FFmpegVideoReader::~FFmpegVideoReader()
 {
 	sws_freeContext(swsCtxt);
-	avformat_close_input(&ctxt);
-	av_free_packet(&currentPacket);
+	closeInput();
 }
 
-const shared_ptr<StreamVideoFrame>& FFmpegVideoReader::getNextFrame()
+void FFmpegVideoReader::setOutputFormat(size_t width, size_t height, AVPixelFormat format, int filter)
+{
+	size_t depth;
+	switch (format) {
+		case AV_PIX_FMT_RGB24:
+		case AV_PIX_FMT_BGR24:
+			depth = 3;
+			break;
+
+		case AV_PIX_FMT_RGBA:
+		case AV_PIX_FMT_BGRA:
+		case AV_PIX_FMT_RGB0:
+		case AV_PIX_FMT_BGR0:
+			depth = 4;
+			break;
+
+		default:
+			throw Exceptions::ArgumentException("Output format must be packed 24 or 32-bit RGB", __FUNCTION__);
+	}
+
+	outputWidth = width;
+	outputHeight = height;
+	outputFormat = format;
+	outputDepth = depth;
+	scalingFilter = filter;
+}
+
+void FFmpegVideoReader::setFrameResource(pmr::memory_resource* resource)
+{
+	if (resource == nullptr)
+		throw Exceptions::ArgumentNullException("The memory resource cannot be null", __FUNCTION__);
+
+	frameResource = resource;
+}
+
+void FFmpegVideoReader::setLiveMode(bool enable)
 {
-	std::shared_ptr<AVFrame> frame(avcodec_alloc_frame(), &av_free);
-
-	// Read packets until we can form a frame from it
-	int frameAvailable = 0;
-	do {
-		// Read a new packet if we've read everything in the current one
-		if (amountProcessed >= currentPacket.size) {
-			do {
-				amountProcessed = 0;
-				// Free the last packet
-				av_free_packet(&currentPacket);
-				if (av_read_frame(ctxt, &currentPacket) < 0) {
-					// EOF
-					currentFrame = nullptr;
-					return currentFrame;
+	if (enable == liveMode)
+		return;
+
+	// The decoder's threading can only be set when it's opened
+	liveMode = enable;
+	avcodec_free_context(&codecCtxt);
+	openCodec();
+	flushDecoder();
+}
+
+void FFmpegVideoReader::setLatePolicy(LatePolicy policy, chrono::milliseconds tolerance)
+{
+	if (tolerance.count() < 0)
+		throw Exceptions::ArgumentOutOfRangeException("The late tolerance cannot be negative", __FUNCTION__);
+
+	latePolicy = policy;
+	lateTolerance = tolerance;
+	skippingToKeyframe = false;
+}
+
+void FFmpegVideoReader::frameProcessed(const StreamVideoFrame& frame)
+{
+	if (frame.getArrivalTime() == chrono::steady_clock::time_point())
+		return;
+
+	latencyLast = chrono::steady_clock::now() - frame.getArrivalTime();
+	latencyTotal += latencyLast;
+	latencyMax = max(latencyMax, latencyLast);
+	++latencyFrames;
+}
+
+FFmpegVideoReader::LatencyStats FFmpegVideoReader::getLatencyStats() const
+{
+	LatencyStats stats;
+	stats.frames = latencyFrames;
+	stats.last = chrono::duration_cast<chrono::microseconds>(latencyLast);
+	stats.mean = chrono::duration_cast<chrono::microseconds>(
+		latencyFrames > 0 ? latencyTotal / (int64_t)latencyFrames : chrono::steady_clock::duration(0));
+	stats.max = chrono::duration_cast<chrono::microseconds>(latencyMax);
+	return stats;
+}
+
+size_t FFmpegVideoReader::memoryUsage() const
+{
+	size_t total = sizeof(*this) + keyframes.capacity() * sizeof(int64_t);
+	if (currentFrame != nullptr)
+		total += sizeof(StreamVideoFrame) + currentFrame->getTotalSize();
+	if (ioCtxt != nullptr)
+		total += ioCtxt->buffer_size;
+	if (decodedFrame != nullptr) {
+		for (const AVBufferRef* buf : decodedFrame->buf) {
+			if (buf != nullptr)
+				total += buf->size;
+		}
+	}
+	return total;
+}
+
+bool FFmpegVideoReader::sendNextPacket()
+{
+	while (true) {
+		const bool read = demuxer != nullptr ? demuxer->readPacket(videoStream, packet)
+		                                     : av_read_frame(ctxt, packet) >= 0;
+		if (!read) {
+			// EOF: an empty packet tells the decoder to flush out the frames it's still holding
+			avcodec_send_packet(codecCtxt, nullptr);
+			draining = true;
+			return false;
+		}
+
+		if (packet->stream_index != videoStream) {
+			av_packet_unref(packet);
+			continue;
+		}
+
+		// Catching up: throw away packets until one the decoder can start over from
+		if (skippingToKeyframe) {
+			if (!(packet->flags & AV_PKT_FLAG_KEY)) {
+				++lateStreak;
+				++lateFrames;
+				av_packet_unref(packet);
+				continue;
+			}
+			// Whatever the decoder still holds references frames we threw away
+			avcodec_flush_buffers(codecCtxt);
+			arrivals.clear();
+			skippingToKeyframe = false;
+		}
+
+		// Remember when the packet arrived until its frame comes out of the decoder
+		if (liveMode) {
+			arrivals.emplace_back(packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts, chrono::steady_clock::now());
+			if (arrivals.size() > kMaxArrivals)
+				arrivals.pop_front();
+		}
+
+		const int ret = avcodec_send_packet(codecCtxt, packet);
+		av_packet_unref(packet);
+		// Skip over corrupt packets the way players do instead of giving up on the whole video
+		if (ret < 0 && ret != AVERROR_INVALIDDATA)
+			throw Exceptions::IOException("Could not send packet to the decoder", __FUNCTION__);
+		return true;
+	}
+}
+
+bool FFmpegVideoReader::receiveFrame()
+{
+	// Feed the decoder packets until it gives us a frame
+	while (true) {
+		const int ret = avcodec_receive_frame(codecCtxt, decodedFrame);
+		if (ret == 0) {
+			lastPTS = decodedFrame->best_effort_timestamp;
+			if (liveMode) {
+				const int64_t pts = decodedFrame->pts != AV_NOPTS_VALUE ? decodedFrame->pts : lastPTS;
+				const auto arrival = find_if(arrivals.begin(), arrivals.end(),
+				                             [pts](const auto& a) { return a.first == pts; });
+				if (arrival != arrivals.end()) {
+					decodedArrival = arrival->second;
+					arrivals.erase(arrival);
 				}
-			} while (currentPacket.stream_index != videoStream);
+				else {
+					decodedArrival = chrono::steady_clock::now();
+				}
+			}
+			return true;
 		}
 
-		// Decode the part of the packet that hasn't been decoded yet
-		AVPacket framePacket;
-		framePacket = currentPacket;
-		framePacket.data = currentPacket.data + amountProcessed;
-		framePacket.size = currentPacket.size - amountProcessed;
+		// EOF, and the decoder has been drained
+		if (ret == AVERROR_EOF)
+			return false;
 
-		const int decode_ret = avcodec_decode_video2(codecCtxt, frame.get(), &frameAvailable, &framePacket);
-		if (decode_ret < 0)
+		if (ret != AVERROR(EAGAIN) || draining)
 			throw Exceptions::IOException("Could not decode frame", __FUNCTION__);
 
-		// Track how much of the packet we've decoded
-		amountProcessed += decode_ret;
-	} while(!frameAvailable);
+		sendNextPacket();
+	}
+}
 
-	// Convert and return frame
-	/// \todo Why do we have to flip red and blue? The answer probably has to do with endianness
-	if (swsCtxt == nullptr) {
-		swsCtxt = sws_getContext(frame->width, frame->height, (PixelFormat)frame->format,
-		                         frame->width, frame->height, byteFlip ? PIX_FMT_BGR24 : PIX_FMT_RGB24,
-		                         SWS_FAST_BILINEAR,
-		                         nullptr, nullptr, nullptr);
-		if (swsCtxt == nullptr)
-			throw Exceptions::IOException("Error while calling sws_getContext", __FUNCTION__);
+const shared_ptr<StreamVideoFrame>& FFmpegVideoReader::getNextFrame()
+{
+	// A seek may have already decoded the frame we're supposed to return
+	if (!framePending && !receiveFrame()) {
+		currentFrame = nullptr;
+		return currentFrame;
+	}
+	framePending = false;
+
+	// In live mode, skip ahead past frames that are too late
+	while (liveMode && !paceFrame()) {
+		if (!receiveFrame()) {
+			currentFrame = nullptr;
+			return currentFrame;
+		}
 	}
+	const AVFrame* frame = decodedFrame;
 
-	AVPicture pic;
-	avpicture_alloc(&pic, PIX_FMT_RGB24, frame->width, frame->height);
-	sws_scale(swsCtxt, frame->data, frame->linesize, 0, frame->height, pic.data, pic.linesize);
+	// Convert (and resize, if requested) the frame
+	/// \todo Why do we have to flip red and blue? The answer probably has to do with endianness
+	const int outWidth = outputWidth > 0 ? (int)outputWidth : frame->width;
+	const int outHeight = outputHeight > 0 ? (int)outputHeight : frame->height;
+	swsCtxt = sws_getCachedContext(swsCtxt,
+	                               frame->width, frame->height, (AVPixelFormat)frame->format,
+	                               outWidth, outHeight, outputFormat,
+	                               scalingFilter,
+	                               nullptr, nullptr, nullptr);
+	if (swsCtxt == nullptr)
+		throw Exceptions::IOException("Error while calling sws_getCachedContext", __FUNCTION__);
 
 	// Set the VideoReader frame info
-	frameWidth = frame->width;
-	frameHeight = frame->height;
-	frameDepth = 3;
+	frameWidth = outWidth;
+	frameHeight = outHeight;
+	frameDepth = outputDepth;
 	AVRational ar;
-	ar.num = frameWidth;
-	ar.den = frameHeight;
+	ar.num = frame->width;
+	ar.den = frame->height;
 	const AVRational& sar = codecCtxt->sample_aspect_ratio;
 	if (sar.num != 0 && sar.den != 0) // might not have to check den
 		ar = av_mul_q(ar, sar);
 	aspectRatio = (float)av_q2d(ar);
 
-	// \todo Should we try to pick between pts and pkt_pts here? Using pkt_pts for now
-	currentFrame = make_shared<StreamVideoFrame>(frame->width, frame->height, 3, frame->pkt_pts);
+	// The best effort timestamp falls back to packet timestamps when the frame's own PTS is missing
+	currentFrame = allocate_shared<StreamVideoFrame>(pmr::polymorphic_allocator<StreamVideoFrame>(frameResource),
+	                                                 outWidth, outHeight, outputDepth, frame->best_effort_timestamp,
+	                                                 frameResource);
+	if (liveMode)
+		currentFrame->setArrivalTime(decodedArrival);
+
+	// Our frames are tightly packed, so libswscale can write straight into them
+	uint8_t* destData[4] = { currentFrame->getPixels(), nullptr, nullptr, nullptr };
+	int destStride[4] = { (int)(outWidth * outputDepth), 0, 0, 0 };
+	sws_scale(swsCtxt, frame->data, frame->linesize, 0, frame->height, destData, destStride);
+
+	// Hand the decoded picture back to the decoder now that we're done with it
+	av_frame_unref(decodedFrame);
 
-	// If the stride is equal to the frame width * 3, we can just copy the whole thing.
-	// Otherwise we need to copy row by row
-	const int rowLen = frame->width * 3;
-	if (pic.linesize[0] == rowLen) {
-		memcpy(currentFrame->getPixels(), pic.data[0], rowLen * frame->height);
+	return currentFrame;
+}
+
+bool FFmpegVideoReader::paceFrame()
+{
+	const int64_t pts = decodedFrame->best_effort_timestamp;
+	const auto now = chrono::steady_clock::now();
+
+	// Frames without time stamps can't be paced
+	if (pts == AV_NOPTS_VALUE)
+		return true;
+
+	// Start the clock on the first frame, and restart it after a second of late frames in a row
+	// (the source probably stalled) or when a frame is due too far off (its time stamp probably jumped)
+	bool restart = paceStartPTS == AV_NOPTS_VALUE || lateStreak >= max(fps, 1.0);
+	chrono::steady_clock::time_point due;
+	if (!restart) {
+		due = paceStart + chrono::duration_cast<chrono::steady_clock::duration>(
+			chrono::duration<double>((pts - paceStartPTS) * av_q2d(videoTimeBase)));
+		restart = due - now > kMaxPaceWait;
 	}
-	else {
-		unsigned char* src = pic.data[0];
-		unsigned char* dest = currentFrame->getPixels();
-		for (int h = 0; h < frame->height; ++h, dest += rowLen, src += pic.linesize[0])
-			memcpy(dest, src, rowLen);
+	if (restart) {
+		paceStartPTS = pts;
+		paceStart = now;
+		lateStreak = 0;
+		skippingToKeyframe = false;
+		return true;
 	}
 
-	avpicture_free(&pic);
+	// A frame that arrived early only counts as having arrived when it was due
+	decodedArrival = max(decodedArrival, due);
+	if (due > now) {
+		this_thread::sleep_until(due);
+	}
+	else if (latePolicy != LatePolicy::Keep && now - due > lateTolerance) {
+		++lateStreak;
+		++lateFrames;
+		av_frame_unref(decodedFrame);
+		// The packets behind this one are even later, so skip them unread (see sendNextPacket)
+		if (latePolicy == LatePolicy::SkipToKeyframe)
+			skippingToKeyframe = true;
+		return false;
+	}
 
-	return currentFrame;
+	lateStreak = 0;
+	return true;
 }
 
 void FFmpegVideoReader::seek(int64_t ts)
 {
-	if (av_seek_frame(ctxt, videoStream, ts, 0) < 0)
-		throw Exceptions::IOException("Could not seek to the requested time stamp", __FUNCTION__);
+	// Seeking moves the input that all of a demuxer's streams share,
+	// so drop everything they had buffered from before the seek
+	if (demuxer != nullptr)
+		demuxer->flush();
+
+	// (If indexing has to read through our own input, it leaves lastPTS unknown, so we seek below)
+	indexKeyframes();
+	const vector<int64_t>& index = keyframes;
+
+	// Start from the last keyframe at or before the target (or just let libavformat find one if we have no index)
+	int64_t keyframe = ts;
+	if (!index.empty()) {
+		const auto after = upper_bound(index.begin(), index.end(), ts);
+		keyframe = after == index.begin() ? index.front() : *(after - 1);
+	}
+
+	// If we're already between that keyframe and the target, decoding forward from here beats seeking.
+	// (lastPTS is AV_NOPTS_VALUE, which is less than any keyframe, when we don't know where we are.)
+	if (draining || lastPTS < keyframe || lastPTS >= ts) {
+		if (av_seek_frame(ctxt, videoStream, keyframe, AVSEEK_FLAG_BACKWARD) < 0)
+			throw Exceptions::IOException("Could not seek to the requested time stamp", __FUNCTION__);
+		flushDecoder();
+	}
+
+	// Decode up to the first frame at or after the target, which getNextFrame will return.
+	// The frames before it are never converted to RGB, which is most of the cost of reading them.
+	// Seeking past the end of the video leaves the reader at EOF.
+	framePending = false;
+	while (receiveFrame()) {
+		const int64_t pts = decodedFrame->best_effort_timestamp;
+		if (pts == AV_NOPTS_VALUE || pts >= ts) {
+			framePending = true;
+			break;
+		}
+	}
+}
+
+void FFmpegVideoReader::flushDecoder()
+{
+	// Drop any frames buffered from before a seek (this also ends draining if we had hit EOF)
 	avcodec_flush_buffers(codecCtxt);
+	draining = false;
+	framePending = false;
+	lastPTS = AV_NOPTS_VALUE;
+	// Live mode's clock starts over from the next frame
+	paceStartPTS = AV_NOPTS_VALUE;
+	lateStreak = 0;
+	skippingToKeyframe = false;
+	arrivals.clear();
+}
+
+const vector<int64_t>& FFmpegVideoReader::getKeyframeIndex()
+{
+	const int64_t resumePTS = lastPTS;
+	const bool resumePending = framePending;
+	if (indexKeyframes()) {
+		// Indexing read through our own input, so put it back where it was
+		if (draining) {
+			// We were already at the end of the input, which is where the index left it
+			lastPTS = resumePTS;
+		}
+		else if (resumePTS == AV_NOPTS_VALUE) {
+			AVStream* stream = ctxt->streams[videoStream];
+			if (av_seek_frame(ctxt, videoStream, stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0,
+			                  AVSEEK_FLAG_BACKWARD) < 0)
+				throw Exceptions::IOException("Could not seek back to the start of the video", __FUNCTION__);
+			flushDecoder();
+		}
+		else {
+			// Return the frame a seek left pending, or else the one after the last frame returned
+			seek(resumePending ? resumePTS : resumePTS + 1);
+		}
+	}
+	return keyframes;
+}
+
+bool FFmpegVideoReader::indexKeyframes()
+{
+	if (keyframesIndexed)
+		return false;
+
+	// Only an input that can seek has any use for an index. Reading any other (such as a pipe, a network stream,
+	// or a camera, even when opened by name) to the end would lose the rest of it, or never finish.
+	const bool seekable = ctxt->pb != nullptr && (ctxt->pb->seekable & AVIO_SEEKABLE_NORMAL);
+	bool movedInput = false;
+	if (seekable && (indexPath.empty() || !loadKeyframeIndex())) {
+		if (!filename.empty()) {
+			// Index a second copy of the file, so that our input (and any demuxer's queues) stay where they are
+			AVFormatContext* indexCtxt = nullptr;
+			if (avformat_open_input(&indexCtxt, filename.c_str(), nullptr, nullptr) != 0)
+				throw Exceptions::IOException("Cannot open video file to index it", __FUNCTION__);
+			buildKeyframeIndex(indexCtxt);
+			avformat_close_input(&indexCtxt);
+			saveKeyframeIndex();
+		}
+		else {
+			// A custom input can't be opened twice, so read through it and leave our position unknown
+			AVStream* stream = ctxt->streams[videoStream];
+			if (av_seek_frame(ctxt, videoStream, stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0,
+			                  AVSEEK_FLAG_BACKWARD) < 0)
+				throw Exceptions::IOException("Could not seek to the start of the video to index it", __FUNCTION__);
+			buildKeyframeIndex(ctxt);
+			lastPTS = AV_NOPTS_VALUE;
+			movedInput = true;
+		}
+	}
+	keyframesIndexed = true;
+	return movedInput;
+}
+
+void FFmpegVideoReader::buildKeyframeIndex(AVFormatContext* source)
+{
+	// Read (but don't decode) every packet, noting the keyframes
+	keyframes.clear();
+	while (av_read_frame(source, packet) >= 0) {
+		if (packet->stream_index == videoStream && (packet->flags & AV_PKT_FLAG_KEY)) {
+			const int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+			if (pts != AV_NOPTS_VALUE)
+				keyframes.push_back(pts);
+		}
+		av_packet_unref(packet);
+	}
+	sort(keyframes.begin(), keyframes.end());
+	keyframes.erase(unique(keyframes.begin(), keyframes.end()), keyframes.end());
+}
+
+bool FFmpegVideoReader::loadKeyframeIndex()
+{
+	FILE* file = fopen(indexPath.c_str(), "rb");
+	if (file == nullptr)
+		return false;
+
+	// Only trust the index if it was built from this stream of a file the same size as this one,
+	// last modified at the same time (so a video rewritten in place at the same size isn't mistaken for it)
+	uint8_t header[kIndexHeaderSize];
+	bool valid = fread(header, 1, sizeof(header), file) == sizeof(header)
+	             && equal(begin(kIndexMagic), end(kIndexMagic), header)
+	             && getLE(header + 8, 4) == kIndexVersion
+	             && getLE(header + 12, 4) == (uint64_t)videoStream
+	             && getLE(header + 16, 8) == (uint64_t)avio_size(ctxt->pb)
+	             && getLE(header + 24, 8) == (uint64_t)modificationTime(filename);
+
+	if (valid) {
+		const uint64_t count = getLE(header + 32, 8);
+		vector<uint8_t> entries(count * 8);
+		valid = count <= (uint64_t)avio_size(ctxt->pb) && fread(entries.data(), 1, entries.size(), file) == entries.size();
+		if (valid) {
+			keyframes.resize(count);
+			for (size_t i = 0; i < count; ++i)
+				keyframes[i] = (int64_t)getLE(&entries[i * 8], 8);
+		}
+	}
+	fclose(file);
+	return valid;
+}
+
+void FFmpegVideoReader::saveKeyframeIndex() const
+{
+	vector<uint8_t> bytes(kIndexHeaderSize + keyframes.size() * 8);
+	copy(begin(kIndexMagic), end(kIndexMagic), bytes.begin());
+	putLE(kIndexVersion, 4, &bytes[8]);
+	putLE(videoStream, 4, &bytes[12]);
+	putLE(avio_size(ctxt->pb), 8, &bytes[16]);
+	putLE(modificationTime(filename), 8, &bytes[24]);
+	putLE(keyframes.size(), 8, &bytes[32]);
+	for (size_t i = 0; i < keyframes.size(); ++i)
+		putLE(keyframes[i], 8, &bytes[kIndexHeaderSize + i * 8]);
+
+	// The index is just a cache, so don't complain if we can't write it (e.g. the video is on read-only media)
+	FILE* file = fopen(indexPath.c_str(), "wb");
+	if (file == nullptr)
+		return;
+	const bool written = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+	if (fclose(file) != 0 || !written)
+		remove(indexPath.c_str());
 }
 
 int64_t FFmpegVideoReader::clocksToTimestamp(clock_t c) const
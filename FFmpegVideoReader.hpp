@@ -1,15 +1,46 @@
 #pragma once
 
 #include <chrono>
+#include <deque>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <vector>
 
 #include "StreamVideoFrame.hpp"
 #include "VideoReader.hpp"
 
+class FFmpegDemuxer;
+class FFmpegInputSource;
+
 /// An interface for a VideoReader class.
 class FFmpegVideoReader final : public VideoReader {
 
 public:
 
+	/// The default size of the buffer for custom inputs
+	static constexpr size_t kDefaultIOBufferSize = 64 * 1024;
+
+	/// What live mode does with frames that are already late when they're decoded
+	enum class LatePolicy {
+		Keep, ///< Return them anyway
+		SkipConversion, ///< Skip them without converting them to RGB, which is most of the cost of reading a frame
+		SkipToKeyframe ///< Skip them, and discard the packets after them unread up to the next keyframe
+	};
+
+	/**
+	 * \brief End-to-end latency, from a frame's arrival (see StreamVideoFrame::getArrivalTime) to frameProcessed
+	 *
+	 * A frame arrives when the reader pulls its packet from the input, so any backlog queued up before that
+	 * (in a pipe, a socket's buffer, or an FFmpegDemuxer's queue) isn't counted.
+	 */
+	struct LatencyStats {
+		uint64_t frames; ///< Frames measured
+		std::chrono::microseconds last; ///< Latency of the last frame measured
+		std::chrono::microseconds mean; ///< Mean latency
+		std::chrono::microseconds max; ///< Highest latency
+	};
+
 	/// Returns true if libav can open the video file at the provided path
 	static bool canReadFile(const std::string& filename);
 
@@ -18,8 +49,97 @@ public:
 	/// \param flipBytes true to flip from RGB to BGR (may help with endianness issues)
 	FFmpegVideoReader(const std::string& filename, bool flipBytes = false);
 
+	/**
+	 * \brief Reads a video from memory, a pipe, or anything else, through a custom AVIOContext
+	 * \param source Where to read the video from (see MemoryInputSource, MappedFileInputSource,
+	 *               FileDescriptorInputSource, and CallbackInputSource)
+	 * \param flipBytes true to flip from RGB to BGR (may help with endianness issues)
+	 * \param ioBufferSize The size of the buffer libavformat reads the source into.
+	 *                     Larger buffers mean fewer reads, at the cost of memory.
+	 */
+	explicit FFmpegVideoReader(std::unique_ptr<FFmpegInputSource> source, bool flipBytes = false,
+	                           size_t ioBufferSize = kDefaultIOBufferSize);
+
 	~FFmpegVideoReader();
 
+	/**
+	 * \brief Sets the size, pixel format, and scaling filter of the frames returned by getNextFrame
+	 * \param width Width of the returned frames, or 0 for the video's width
+	 * \param height Height of the returned frames, or 0 for the video's height
+	 * \param format A packed RGB format: AV_PIX_FMT_RGB24, AV_PIX_FMT_BGR24 (3 bytes per pixel),
+	 *               AV_PIX_FMT_RGBA, AV_PIX_FMT_BGRA, AV_PIX_FMT_RGB0, or AV_PIX_FMT_BGR0 (4 bytes per pixel)
+	 * \param scalingFilter The libswscale filter used to resize frames.
+	 *                      SWS_AREA averages the source pixels and is a good choice for downscaling.
+	 *
+	 * Decoded frames are converted and resized in a single pass, so reading frames at the resolution they'll be
+	 * analyzed at (and passing a downscale ratio of 1 to MotionExtractor) avoids ever handling full-resolution RGB.
+	 */
+	void setOutputFormat(size_t width, size_t height, AVPixelFormat format, int scalingFilter = SWS_AREA);
+
+	/**
+	 * \brief Sets where returned frames are allocated from
+	 * \param resource The memory resource (such as a per-thread pool) for the pixels and bookkeeping of each frame.
+	 *                 It must outlive every frame the reader returns.
+	 */
+	void setFrameResource(std::pmr::memory_resource* resource);
+
+	/**
+	 * \brief Enables or disables live mode, for sources that must be kept up with in real time
+	 *
+	 * In live mode, frames are paced by their time stamps against a steady clock, starting from the first frame
+	 * returned. A frame that's early (such as when "playing" a file as if it were a camera) isn't returned until
+	 * it's due. Frames that are already late by more than the late tolerance are handled by the late policy,
+	 * so that a slow consumer skips ahead instead of falling further and further behind.
+	 * If a second's worth of frames in a row are late, the clock is restarted from the next frame
+	 * (e.g. after the source stalled).
+	 *
+	 * Live mode also reopens the decoder with low-delay settings (no frame threading, which holds frames back),
+	 * so it should be set before reading any frames. Each frame's arrival time is recorded for frameProcessed.
+	 * It's stamped when the reader pulls the frame's packet from the input, so lateness (and latency) only counts
+	 * from then: a backlog that builds up in a pipe or socket before the reader gets to it goes unnoticed.
+	 */
+	void setLiveMode(bool enable);
+
+	/**
+	 * \brief Sets what live mode does with late frames, and how late a frame must be to count
+	 *
+	 * With LatePolicy::SkipToKeyframe, a late frame makes the reader discard packets without decoding them until the
+	 * next keyframe, which it can decode without the frames skipped. If that frame is late too, it skips to the
+	 * following one, and so on until it has caught up. Each packet discarded counts as a late frame.
+	 */
+	void setLatePolicy(LatePolicy policy, std::chrono::milliseconds tolerance = std::chrono::milliseconds(100));
+
+	bool getLiveMode() const { return liveMode; }
+
+	LatePolicy getLatePolicy() const { return latePolicy; }
+
+	/// Returns the number of frames skipped for being late
+	uint64_t getLateFrames() const { return lateFrames; }
+
+	/**
+	 * \brief Records that the caller is done with a frame (e.g. its motion mask is ready), for latency accounting
+	 *
+	 * Frames returned outside of live mode have no arrival time, and are ignored.
+	 */
+	void frameProcessed(const StreamVideoFrame& frame);
+
+	/// Gets the latencies recorded by frameProcessed
+	LatencyStats getLatencyStats() const;
+
+	/// Gets the width of the decoded video, before any resizing by setOutputFormat
+	size_t getVideoWidth() const { return codecCtxt->width; }
+
+	/// Gets the height of the decoded video, before any resizing by setOutputFormat
+	size_t getVideoHeight() const { return codecCtxt->height; }
+
+	/**
+	 * \brief Returns the number of bytes of memory held by the reader
+	 *
+	 * This counts the current frame, the I/O buffer of a custom input, the keyframe index, and any decoded picture
+	 * being held for the next getNextFrame call. The decoder's own state (such as reference frames) isn't included.
+	 */
+	size_t memoryUsage() const;
+
 	const std::shared_ptr<StreamVideoFrame>& getCurrentFrame() const override { return currentFrame; }
 
 	const std::shared_ptr<StreamVideoFrame>& getNextFrame() override;
@@ -28,8 +148,33 @@ public:
 
 	int64_t getVideoLength() const override { return ctxt->streams[videoStream]->duration; }
 
+	/**
+	 * \brief Seeks to the first frame at or after the given time stamp, which the next getNextFrame call returns
+	 *
+	 * Decoding resumes from the last keyframe before the time stamp (or from the current position, if that's closer),
+	 * and the frames between it and the time stamp are decoded without being converted to RGB.
+	 * The first seek builds the keyframe index (see getKeyframeIndex).
+	 * For streams read through an FFmpegDemuxer, seeking one stream flushes the others,
+	 * which continue from wherever the input lands.
+	 */
 	void seek(int64_t ts) override;
 
+	/**
+	 * \brief Gets the time stamps of the video stream's keyframes, in order
+	 *
+	 * The index is built the first time it's needed by reading (but not decoding) every packet in the video.
+	 * For videos opened by filename (or through an FFmpegDemuxer), this is done by opening the file a second time,
+	 * so the reader's position and any packets the demuxer has queued are left alone. The index is then saved
+	 * next to the video as <filename>.kfidx and loaded from there next time, as long as the video's size and
+	 * modification time haven't changed.
+	 *
+	 * A custom input can't be opened twice, so if it's seekable it's read through to the end and then the reader
+	 * seeks back to the frame after the last one it returned (which restarts live mode's clock).
+	 * An input that can't seek (a pipe, a network stream, or a camera, even when opened by name) gets an empty index
+	 * without being read, since it couldn't seek with one anyway.
+	 */
+	const std::vector<int64_t>& getKeyframeIndex();
+
 	int64_t clocksToTimestamp(clock_t c) const override;
 
 	int64_t durationToTimestamp(const std::chrono::milliseconds& d) const override;
@@ -46,6 +191,54 @@ public:
 
 private:
 
+	friend class FFmpegDemuxer;
+
+	/// Reads one stream of a demuxer's input (see FFmpegDemuxer::getVideoStream)
+	FFmpegVideoReader(FFmpegDemuxer& demux, int stream, const std::string& index);
+
+	/// Opens the input and the decoder for its best video stream. On failure, everything is cleaned up.
+	void open(const char* url);
+
+	/// Opens the decoder for videoStream. On failure, everything is cleaned up.
+	void openDecoder();
+
+	/// Sets up and opens codecCtxt for videoStream (with low-delay settings in live mode).
+	/// On failure, everything is cleaned up.
+	void openCodec();
+
+	/// Decides whether live mode returns the frame in decodedFrame, waiting until it's due.
+	/// Returns false if the frame was skipped for being late.
+	bool paceFrame();
+
+	/// Drops the frames the decoder is holding, such as after a seek
+	void flushDecoder();
+
+	/// Closes the input (including any custom I/O)
+	void closeInput();
+
+	/// Frees the custom I/O context, if there is one
+	void freeIO();
+
+	/// Reads the next video packet and sends it to the decoder.
+	/// At EOF, starts draining the decoder and returns false.
+	bool sendNextPacket();
+
+	/// Receives the next frame from the decoder into decodedFrame. Returns false at EOF.
+	bool receiveFrame();
+
+	/// Loads or builds the keyframe index, if that hasn't been done yet.
+	/// Returns true if building it moved the reader's own input (which only happens for custom inputs).
+	bool indexKeyframes();
+
+	/// Reads every packet from source to find the video stream's keyframes
+	void buildKeyframeIndex(AVFormatContext* source);
+
+	/// Loads the keyframe index from indexPath. Returns false if it's missing or doesn't match the video.
+	bool loadKeyframeIndex();
+
+	/// Saves the keyframe index to indexPath, if possible
+	void saveKeyframeIndex() const;
+
 	// FFmpeg structs and IDs
 
 	AVFormatContext* ctxt;
@@ -54,14 +247,74 @@ private:
 
 	SwsContext* swsCtxt;
 
+	/// The source of a custom input (null when reading a file by name)
+	std::unique_ptr<FFmpegInputSource> input;
+
+	/// The I/O context reading from input
+	AVIOContext* ioCtxt;
+
+	/// The demuxer that owns ctxt and hands us our packets (null if we read ctxt ourselves)
+	FFmpegDemuxer* demuxer;
+
 	int videoStream;
 
 	AVRational videoTimeBase;
 
-	AVPacket currentPacket;
+	/// Reused to read each packet from the input
+	AVPacket* packet;
+
+	/// Reused to receive each frame from the decoder
+	AVFrame* decodedFrame;
+
+	/// True once the end of the input has been reached and the decoder is being flushed
+	bool draining;
+
+	/// True if a seek left a frame in decodedFrame for getNextFrame to return
+	bool framePending;
+
+	/// Time stamp of the last frame received from the decoder (AV_NOPTS_VALUE if unknown, such as after seeking)
+	int64_t lastPTS;
+
+	bool liveMode; ///< \see setLiveMode
+	LatePolicy latePolicy; ///< \see setLatePolicy
+	std::chrono::milliseconds lateTolerance; ///< How late a frame must be for latePolicy to apply
+
+	/// The time stamp of the frame live mode's clock started from (AV_NOPTS_VALUE to start from the next frame)
+	int64_t paceStartPTS;
+
+	/// When the frame at paceStartPTS was returned
+	std::chrono::steady_clock::time_point paceStart;
+
+	/// Frames skipped in a row for being late
+	unsigned int lateStreak;
+
+	/// True while packets are being discarded up to the next keyframe (see LatePolicy::SkipToKeyframe)
+	bool skippingToKeyframe;
+
+	uint64_t lateFrames; ///< \see getLateFrames
+
+	/// When each packet sent to the decoder arrived, by time stamp, until its frame comes out (only in live mode)
+	std::deque<std::pair<int64_t, std::chrono::steady_clock::time_point>> arrivals;
+
+	/// When the frame in decodedFrame arrived (or was due)
+	std::chrono::steady_clock::time_point decodedArrival;
+
+	uint64_t latencyFrames; ///< Frames recorded by frameProcessed
+	std::chrono::steady_clock::duration latencyTotal; ///< Sum of their latencies
+	std::chrono::steady_clock::duration latencyLast; ///< Latency of the last one
+	std::chrono::steady_clock::duration latencyMax; ///< Highest latency
+
+	/// The file the input was opened from (empty for custom inputs)
+	std::string filename;
+
+	/// Where the keyframe index is saved (empty for custom inputs, which don't get one)
+	std::string indexPath;
+
+	/// Time stamps of the video stream's keyframes, in order
+	std::vector<int64_t> keyframes;
 
-	/// The amount of the current packet that has already been processed
-	int amountProcessed;
+	/// True once keyframes has been built or loaded
+	bool keyframesIndexed;
 
 	/// A pointer to the current frame
 	std::shared_ptr<StreamVideoFrame> currentFrame;
@@ -69,5 +322,10 @@ private:
 	/// Frame rate in frames per second (extracted from the video stream)
 	double fps;
 
-	bool byteFlip;
+	size_t outputWidth; ///< Width of returned frames (0 for the video's width)
+	size_t outputHeight; ///< Height of returned frames (0 for the video's height)
+	AVPixelFormat outputFormat; ///< Pixel format of returned frames
+	size_t outputDepth; ///< Bytes per pixel of outputFormat
+	int scalingFilter; ///< libswscale filter used to resize frames
+	std::pmr::memory_resource* frameResource; ///< Where returned frames are allocated from
 };
@@ -0,0 +1,70 @@
+#include "precomp.hpp"
+#include "HugePageResource.hpp"
+
+#include <cstdint>
+#include <new>
+
+#include <sys/mman.h>
+
+using namespace std;
+
+namespace {
+
+/// Rounds a size up to a whole number of huge pages
+inline size_t roundToPages(size_t bytes)
+{
+	return (max<size_t>(bytes, 1) + HugePageResource::kHugePageSize - 1) & ~(HugePageResource::kHugePageSize - 1);
+}
+
+} // end anonymous namespace
+
+constexpr size_t HugePageResource::kHugePageSize;
+
+HugePageResource::HugePageResource()
+	: reservedAllocations(0),
+	  transparentAllocations(0)
+{ }
+
+void* HugePageResource::do_allocate(size_t bytes, size_t alignment)
+{
+	if (alignment > kHugePageSize)
+		throw bad_alloc();
+
+	const size_t size = roundToPages(bytes);
+
+#ifdef MAP_HUGETLB
+	void* pages = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (pages != MAP_FAILED) {
+		++reservedAllocations;
+		return pages;
+	}
+#endif
+
+	// No reserved huge pages are free, so map an extra page's worth and trim it down to an aligned region,
+	// which the kernel can back with transparent huge pages
+	const size_t mappingSize = size + kHugePageSize;
+	uint8_t* mapping = static_cast<uint8_t*>(
+		mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (mapping == MAP_FAILED)
+		throw bad_alloc();
+
+	uint8_t* aligned = reinterpret_cast<uint8_t*>(
+		(reinterpret_cast<uintptr_t>(mapping) + kHugePageSize - 1) & ~(uintptr_t)(kHugePageSize - 1));
+	const size_t before = aligned - mapping;
+	if (before > 0)
+		munmap(mapping, before);
+	if (mappingSize - before > size)
+		munmap(aligned + size, mappingSize - before - size);
+
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+	++transparentAllocations;
+	return aligned;
+}
+
+void HugePageResource::do_deallocate(void* p, size_t bytes, size_t)
+{
+	// Both kinds of allocation are a single mapping of the rounded size
+	munmap(p, roundToPages(bytes));
+}
@@ -0,0 +1,199 @@
+#include "precomp.hpp"
+#include "LaneOccupancy.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Exceptions.hpp"
+#include "MotionExtractor.hpp"
+#include "VideoFrame.hpp"
+
+using namespace std;
+
+namespace {
+
+/**
+ * \brief Finds the spans of a row of pixels inside a polygon
+ * \param polygon The polygon's vertices
+ * \param y The row
+ * \param spans Receives the start and end (exclusive) of each span, in pairs
+ */
+void rowSpans(const vector<PixelPoint>& polygon, int y, vector<int>& spans)
+{
+	// Find where the edges cross the row's pixel centers
+	const double cy = y + 0.5;
+	vector<double> crossings;
+	for (size_t i = 0; i < polygon.size(); ++i) {
+		const PixelPoint& a = polygon[i];
+		const PixelPoint& b = polygon[(i + 1) % polygon.size()];
+		// Half-open, so that a vertex on the row is only counted once
+		if ((a.y <= cy) != (b.y <= cy))
+			crossings.push_back(a.x + (cy - a.y) * (b.x - a.x) / (b.y - a.y));
+	}
+	sort(crossings.begin(), crossings.end());
+
+	// A pixel is in a span if its center is
+	spans.clear();
+	for (size_t i = 0; i + 1 < crossings.size(); i += 2) {
+		const int start = (int)ceil(crossings[i] - 0.5);
+		const int end = (int)ceil(crossings[i + 1] - 0.5);
+		if (end > start) {
+			spans.push_back(start);
+			spans.push_back(end);
+		}
+	}
+}
+
+/// Counts the pixels of the rectangles inside a mask of the given size (or all of them, if the size is 0 x 0)
+uint32_t clippedArea(const vector<PixelRect>& rects, size_t maskWidth, size_t maskHeight)
+{
+	uint32_t area = 0;
+	for (const PixelRect& r : rects) {
+		if (maskWidth == 0 && maskHeight == 0) {
+			area += (uint32_t)(r.width * r.height);
+		}
+		else if (r.x < maskWidth && r.y < maskHeight) {
+			area += (uint32_t)((min(r.x + r.width, maskWidth) - r.x) * (min(r.y + r.height, maskHeight) - r.y));
+		}
+	}
+	return area;
+}
+
+} // end anonymous namespace
+
+LaneOccupancy::LaneOccupancy(size_t historyLen)
+	: lanes(),
+	  historyLength(historyLen),
+	  historyStart(0),
+	  historySize(0),
+	  maskWidth(0),
+	  maskHeight(0)
+{
+	if (historyLength == 0)
+		throw Exceptions::ArgumentOutOfRangeException("Lanes must keep at least one sample", __FUNCTION__);
+}
+
+uint32_t LaneOccupancy::addLane(const PixelRect& lane)
+{
+	if (lane.empty())
+		throw Exceptions::ArgumentException("Lanes cannot be empty", __FUNCTION__);
+
+	return addLane(vector<PixelRect>{ lane });
+}
+
+uint32_t LaneOccupancy::addLane(const vector<PixelPoint>& polygon)
+{
+	if (polygon.size() < 3)
+		throw Exceptions::ArgumentException("A polygon needs at least three vertices", __FUNCTION__);
+
+	int top = polygon[0].y, bottom = polygon[0].y;
+	for (const PixelPoint& p : polygon) {
+		if (p.x < 0 || p.y < 0)
+			throw Exceptions::ArgumentOutOfRangeException("Polygon vertices cannot be negative", __FUNCTION__);
+		top = min(top, p.y);
+		bottom = max(bottom, p.y);
+	}
+
+	// Runs of rows with the same spans become one rectangle per span
+	vector<PixelRect> rects;
+	vector<int> spans, runSpans;
+	int runStart = top;
+	for (int y = top; y <= bottom; ++y) {
+		if (y < bottom)
+			rowSpans(polygon, y, spans);
+		else
+			spans.clear(); // Ends the last run
+
+		if (spans == runSpans)
+			continue;
+
+		for (size_t i = 0; i < runSpans.size(); i += 2) {
+			rects.emplace_back(runSpans[i], runStart, runSpans[i + 1] - runSpans[i], y - runStart);
+		}
+		runSpans = spans;
+		runStart = y;
+	}
+
+	if (rects.empty())
+		throw Exceptions::ArgumentException("The polygon doesn't contain any pixels", __FUNCTION__);
+
+	return addLane(move(rects));
+}
+
+uint32_t LaneOccupancy::addLane(vector<PixelRect>&& rects)
+{
+	Lane lane;
+	lane.area = clippedArea(rects, maskWidth, maskHeight);
+	lane.rects = move(rects);
+	lane.history.resize(historyLength, Sample{ 0, 0, 0.0f });
+	lanes.push_back(move(lane));
+	return (uint32_t)(lanes.size() - 1);
+}
+
+void LaneOccupancy::clearLanes()
+{
+	lanes.clear();
+	historyStart = 0;
+	historySize = 0;
+}
+
+const LaneOccupancy::Lane& LaneOccupancy::getLane(uint32_t lane) const
+{
+	if (lane >= lanes.size())
+		throw Exceptions::ArgumentOutOfRangeException("There is no lane with that index", __FUNCTION__);
+
+	return lanes[lane];
+}
+
+uint32_t LaneOccupancy::getLaneArea(uint32_t lane) const
+{
+	return getLane(lane).area;
+}
+
+const vector<PixelRect>& LaneOccupancy::getLaneRects(uint32_t lane) const
+{
+	return getLane(lane).rects;
+}
+
+void LaneOccupancy::update(const MotionExtractor& extractor, int64_t pts)
+{
+	// Once the histories are full, the newest sample replaces the oldest
+	const size_t slot = (historyStart + historySize) % historyLength;
+	if (historySize < historyLength)
+		++historySize;
+	else
+		historyStart = (historyStart + 1) % historyLength;
+
+	// countMoving only counts what's inside the mask, so only that part of each lane counts towards its area
+	const VideoFrame& mask = extractor.getMotionMask();
+	if (mask.getWidth() != maskWidth || mask.getHeight() != maskHeight) {
+		maskWidth = mask.getWidth();
+		maskHeight = mask.getHeight();
+		for (Lane& lane : lanes)
+			lane.area = clippedArea(lane.rects, maskWidth, maskHeight);
+	}
+
+	for (Lane& lane : lanes) {
+		uint32_t pixels = 0;
+		for (const PixelRect& r : lane.rects)
+			pixels += extractor.countMoving(r);
+		lane.history[slot] = Sample{ pts, pixels, lane.area > 0 ? (float)pixels / lane.area : 0.0f };
+	}
+}
+
+LaneOccupancy::Sample LaneOccupancy::getOccupancy(uint32_t lane) const
+{
+	const Lane& l = getLane(lane);
+	if (historySize == 0)
+		return Sample{ 0, 0, 0.0f };
+
+	return l.history[(historyStart + historySize - 1) % historyLength];
+}
+
+void LaneOccupancy::getHistory(uint32_t lane, vector<Sample>& history) const
+{
+	const Lane& l = getLane(lane);
+	history.clear();
+	for (size_t i = 0; i < historySize; ++i)
+		history.push_back(l.history[(historyStart + i) % historyLength]);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "PixelPoint.hpp"
+#include "PixelRect.hpp"
+
+class MotionExtractor;
+
+/**
+ * \brief Measures how much of each lane (or any other region) of the motion mask is moving, frame by frame
+ *
+ * Each lane is broken into rectangles when it's added (a polygon becomes one rectangle per run of rows
+ * with the same spans), and each rectangle is counted with MotionExtractor::countMoving in constant time.
+ * A rectangular lane costs a few lookups per frame no matter how big it is, but a polygon with slanted edges
+ * becomes a rectangle per row, so it costs O(rows) lookups. The extractor's mask integral must be enabled
+ * (see MotionExtractor::setMaskIntegral).
+ *
+ * Only the part of a lane inside the motion mask counts towards its area, so a lane that runs off the edge
+ * of the mask can still be fully occupied.
+ *
+ * The last historyLength samples of each lane are kept as a time series.
+ * Lanes added after the first update read as zero for the frames before they were added.
+ */
+class LaneOccupancy final {
+public:
+	/// One measurement of a lane
+	struct Sample {
+		int64_t pts; ///< Timestamp of the frame (see StreamVideoFrame::getPTS)
+		uint32_t pixels; ///< Moving pixels in the lane
+		float occupancy; ///< Fraction (0 to 1) of the lane that is moving
+	};
+
+	/// \param historyLength The number of samples to keep for each lane
+	explicit LaneOccupancy(size_t historyLength = 300);
+
+	/**
+	 * \brief Adds a rectangular lane
+	 * \param lane The lane, in motion mask coordinates
+	 * \returns The index of the lane
+	 */
+	uint32_t addLane(const PixelRect& lane);
+
+	/**
+	 * \brief Adds a polygonal lane
+	 * \param polygon The polygon's vertices in order, in motion mask coordinates (which must not be negative).
+	 *                Pixels whose centers are inside the polygon (by the even-odd rule) are part of the lane.
+	 * \returns The index of the lane
+	 */
+	uint32_t addLane(const std::vector<PixelPoint>& polygon);
+
+	/// Removes all lanes and their histories
+	void clearLanes();
+
+	/// Gets the number of lanes
+	size_t getLaneCount() const { return lanes.size(); }
+
+	/// Gets the number of pixels in a lane that are inside the motion mask
+	/// (all of them, until the first update has seen the mask)
+	uint32_t getLaneArea(uint32_t lane) const;
+
+	/// Gets the rectangles a lane was broken into
+	const std::vector<PixelRect>& getLaneRects(uint32_t lane) const;
+
+	/**
+	 * \brief Measures every lane in the motion mask the extractor last generated
+	 * \param extractor The extractor that just processed a frame
+	 * \param pts The presentation timestamp of that frame
+	 */
+	void update(const MotionExtractor& extractor, int64_t pts);
+
+	/// Gets the latest sample of a lane (all zeros before the first update)
+	Sample getOccupancy(uint32_t lane) const;
+
+	/// Copies the samples of a lane into history, oldest first
+	void getHistory(uint32_t lane, std::vector<Sample>& history) const;
+
+private:
+	struct Lane {
+		std::vector<PixelRect> rects; ///< The lane, as non-overlapping rectangles
+		uint32_t area; ///< Total pixels in rects, inside the mask
+		std::vector<Sample> history; ///< A ring of the lane's latest samples
+	};
+
+	/// Validates a lane index
+	const Lane& getLane(uint32_t lane) const;
+
+	/// Adds a lane made of the given rectangles
+	uint32_t addLane(std::vector<PixelRect>&& rects);
+
+	std::vector<Lane> lanes;
+
+	size_t historyLength; ///< \see LaneOccupancy()
+
+	size_t historyStart; ///< Index of the oldest sample in each lane's history
+
+	size_t historySize; ///< Number of samples in each lane's history
+
+	size_t maskWidth; ///< The width of the mask the lane areas were clipped to (0 before the first update)
+	size_t maskHeight; ///< The height of the mask the lane areas were clipped to (0 before the first update)
+};
@@ -0,0 +1,356 @@
+#include "precomp.hpp"
+#include "MappedVideoReader.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Exceptions.hpp"
+#include "MKMath.hpp"
+
+using namespace std;
+
+namespace {
+
+/// Every Y4M file starts with this
+const char kY4MSignature[] = "YUV4MPEG2 ";
+
+/// Every Y4M frame starts with this
+const char kY4MFrameTag[] = "FRAME";
+
+/// The longest Y4M header we'll look through
+const size_t kMaxY4MHeader = 4096;
+
+/// How many frames past the one being returned the kernel is asked to read ahead
+const int64_t kReadaheadFrames = 4;
+
+/// Frame rates given as decimals are kept as a ratio with this denominator
+const int64_t kRateDenominator = 1000;
+
+/// Clamps a value to a byte
+inline uint8_t toByte(int v)
+{
+	return (uint8_t)Math::clamp(v, 0, 255);
+}
+
+/// Parses a Y4M "num:den" ratio, returning false if it's malformed
+bool parseRatio(const string& s, int64_t& num, int64_t& den)
+{
+	const size_t colon = s.find(':');
+	if (colon == string::npos)
+		return false;
+
+	char* end;
+	num = strtoll(s.c_str(), &end, 10);
+	if (end != s.c_str() + colon)
+		return false;
+	den = strtoll(s.c_str() + colon + 1, &end, 10);
+	return *end == '\0';
+}
+
+} // end anonymous namespace
+
+MappedVideoReader::Mapping::~Mapping()
+{
+	munmap(data, size);
+}
+
+bool MappedVideoReader::isY4M(const string& filename)
+{
+	char buf[sizeof(kY4MSignature) - 1];
+	FILE* f = fopen(filename.c_str(), "rb");
+	if (f == nullptr)
+		return false;
+	const bool match = fread(buf, 1, sizeof(buf), f) == sizeof(buf) && memcmp(buf, kY4MSignature, sizeof(buf)) == 0;
+	fclose(f);
+	return match;
+}
+
+MappedVideoReader::MappedVideoReader(const string& filename)
+	: mapping(), format(Format::Y420), fullRange(false), dataOffset(0), frameStride(0), frameHeaderSize(0),
+	  frameCount(0), rateNum(0), rateDen(1), nextIndex(0), currentFrame()
+{
+	map(filename);
+	parseY4MHeader();
+}
+
+MappedVideoReader::MappedVideoReader(const string& filename, size_t width, size_t height, size_t depth, double fps)
+	: mapping(), format(Format::Raw), fullRange(false), dataOffset(0), frameStride(width * height * depth),
+	  frameHeaderSize(0), frameCount(0), rateNum(0), rateDen(kRateDenominator), nextIndex(0), currentFrame()
+{
+	if (width == 0 || height == 0)
+		throw Exceptions::ArgumentOutOfRangeException("The frame size must be non-zero", __FUNCTION__);
+	if (depth != 3 && depth != 4)
+		throw Exceptions::ArgumentOutOfRangeException("The depth must be 3 or 4", __FUNCTION__);
+
+	rateNum = llround(fps * kRateDenominator);
+	if (rateNum <= 0)
+		throw Exceptions::ArgumentOutOfRangeException("The frame rate is too low", __FUNCTION__);
+	const int64_t divisor = gcd(rateNum, rateDen);
+	rateNum /= divisor;
+	rateDen /= divisor;
+
+	map(filename);
+	frameCount = (int64_t)(mapping->size / frameStride);
+	frameWidth = width;
+	frameHeight = height;
+	frameDepth = depth;
+	aspectRatio = (float)width / height;
+}
+
+void MappedVideoReader::map(const string& filename)
+{
+	const int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw Exceptions::FileException("Cannot open video file", __FUNCTION__);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		throw Exceptions::FileException("The video file is empty", __FUNCTION__);
+	}
+
+	// A private mapping, so that writing to a frame only copies the pages written
+	const size_t size = (size_t)st.st_size;
+	void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd); // The mapping keeps the file open
+	if (data == MAP_FAILED)
+		throw Exceptions::FileException("Cannot map the video file", __FUNCTION__);
+
+	madvise(data, size, MADV_SEQUENTIAL);
+	mapping = make_shared<Mapping>((uint8_t*)data, size);
+}
+
+void MappedVideoReader::parseY4MHeader()
+{
+	const char* const text = (const char*)mapping->data;
+	const size_t sigLength = sizeof(kY4MSignature) - 1;
+	const size_t limit = min(mapping->size, kMaxY4MHeader);
+	const char* const headerEnd = (const char*)memchr(text, '\n', limit);
+	if (mapping->size < sigLength || memcmp(text, kY4MSignature, sigLength) != 0 || headerEnd == nullptr)
+		throw Exceptions::FileException("The file is not Y4M", __FUNCTION__);
+
+	size_t width = 0;
+	size_t height = 0;
+	int64_t aspectNum = 0;
+	int64_t aspectDen = 0;
+	string colorspace = "420jpeg";
+	rateNum = 0;
+
+	// Parameters are a letter followed by a value, separated by spaces
+	const char* p = text + sigLength;
+	while (p < headerEnd) {
+		const char* tokenEnd = p;
+		while (tokenEnd < headerEnd && *tokenEnd != ' ')
+			++tokenEnd;
+		if (tokenEnd > p) {
+			const string value(p + 1, tokenEnd);
+			switch (*p) {
+				case 'W': width = (size_t)strtoull(value.c_str(), nullptr, 10); break;
+				case 'H': height = (size_t)strtoull(value.c_str(), nullptr, 10); break;
+				case 'F':
+					if (!parseRatio(value, rateNum, rateDen))
+						throw Exceptions::FileException("The Y4M frame rate is malformed", __FUNCTION__);
+					break;
+				case 'A':
+					if (!parseRatio(value, aspectNum, aspectDen))
+						throw Exceptions::FileException("The Y4M pixel aspect ratio is malformed", __FUNCTION__);
+					break;
+				case 'C': colorspace = value; break;
+				case 'X':
+					if (value == "COLORRANGE=FULL")
+						fullRange = true;
+					break;
+				default: break; // Interlacing and anything else don't change how frames are read
+			}
+		}
+		p = tokenEnd + 1;
+	}
+
+	if (width == 0 || height == 0)
+		throw Exceptions::FileException("The Y4M header has no frame size", __FUNCTION__);
+	if (rateNum <= 0 || rateDen <= 0)
+		throw Exceptions::FileException("The Y4M header has no frame rate", __FUNCTION__);
+
+	// All the 4:2:0 variants differ only in where chroma is sited, which we ignore
+	const size_t chromaWidth = (width + 1) / 2;
+	size_t chromaSize;
+	if (colorspace == "420jpeg" || colorspace == "420mpeg2" || colorspace == "420paldv" || colorspace == "420") {
+		format = Format::Y420;
+		chromaSize = chromaWidth * ((height + 1) / 2);
+	}
+	else if (colorspace == "422") {
+		format = Format::Y422;
+		chromaSize = chromaWidth * height;
+	}
+	else if (colorspace == "444") {
+		format = Format::Y444;
+		chromaSize = width * height;
+	}
+	else if (colorspace == "mono") {
+		format = Format::Mono;
+		chromaSize = 0;
+	}
+	else {
+		throw Exceptions::FileException("Unsupported Y4M colorspace: " + colorspace, __FUNCTION__);
+	}
+
+	// Frame headers can carry parameters too, but we only seek in O(1) if they're all the size of the first
+	dataOffset = (size_t)(headerEnd + 1 - text);
+	const size_t tagLength = sizeof(kY4MFrameTag) - 1;
+	if (dataOffset < mapping->size) {
+		const char* frameHeaderEnd = (const char*)memchr(text + dataOffset, '\n',
+		                                                 min(mapping->size - dataOffset, kMaxY4MHeader));
+		if (frameHeaderEnd == nullptr || memcmp(text + dataOffset, kY4MFrameTag, tagLength) != 0)
+			throw Exceptions::FileException("The first Y4M frame header is malformed", __FUNCTION__);
+		frameHeaderSize = (size_t)(frameHeaderEnd + 1 - (text + dataOffset));
+	}
+	else {
+		frameHeaderSize = tagLength + 1;
+	}
+
+	frameStride = frameHeaderSize + width * height + 2 * chromaSize;
+	frameCount = (int64_t)((mapping->size - dataOffset) / frameStride);
+	frameWidth = width;
+	frameHeight = height;
+	frameDepth = 3;
+	aspectRatio = (float)width / height;
+	if (aspectNum > 0 && aspectDen > 0)
+		aspectRatio *= (float)aspectNum / aspectDen;
+}
+
+const shared_ptr<StreamVideoFrame>& MappedVideoReader::getNextFrame()
+{
+	if (nextIndex >= frameCount) {
+		currentFrame = nullptr;
+		return currentFrame;
+	}
+
+	const int64_t index = nextIndex++;
+	uint8_t* const start = mapping->data + dataOffset + (size_t)index * frameStride;
+	readAhead(index);
+
+	if (format == Format::Raw) {
+		// The frame views the mapping, and keeps it alive until the frame goes away
+		shared_ptr<Mapping> keepAlive = mapping;
+		currentFrame = shared_ptr<StreamVideoFrame>(
+			new StreamVideoFrame(start, frameWidth, frameHeight, frameDepth, index),
+			[keepAlive](StreamVideoFrame* f) { delete f; });
+		return currentFrame;
+	}
+
+	// The frame header's size was only checked on the first frame, so check each one we read
+	const char* const header = (const char*)start;
+	if (memcmp(header, kY4MFrameTag, sizeof(kY4MFrameTag) - 1) != 0 || header[frameHeaderSize - 1] != '\n')
+		throw Exceptions::FileException("Y4M frame headers vary in size, which isn't supported", __FUNCTION__);
+
+	if (currentFrame != nullptr && currentFrame.use_count() == 1) {
+		// Don't overwrite the frame before the last thread to hold it (e.g. a Pipeline stage) is done reading it
+		atomic_thread_fence(memory_order_acquire);
+		currentFrame->setPTS(index);
+	}
+	else
+		currentFrame = make_shared<StreamVideoFrame>(frameWidth, frameHeight, frameDepth, index);
+	convertY4M(start + frameHeaderSize, *currentFrame);
+	return currentFrame;
+}
+
+void MappedVideoReader::convertY4M(const uint8_t* planes, StreamVideoFrame& frame) const
+{
+	const size_t width = frameWidth;
+	const size_t height = frameHeight;
+
+	size_t chromaShiftX = 0;
+	size_t chromaShiftY = 0;
+	if (format == Format::Y420) {
+		chromaShiftX = 1;
+		chromaShiftY = 1;
+	}
+	else if (format == Format::Y422) {
+		chromaShiftX = 1;
+	}
+	const size_t chromaWidth = (width + chromaShiftX) >> chromaShiftX;
+	const size_t chromaHeight = (height + chromaShiftY) >> chromaShiftY;
+	const uint8_t* const lumaPlane = planes;
+	const uint8_t* const uPlane = planes + width * height;
+	const uint8_t* const vPlane = uPlane + chromaWidth * chromaHeight;
+
+	// BT.601 in 8.8 fixed point, with luma expanded from 16-235 unless the file says it's full range
+	const int yScale = fullRange ? 256 : 298;
+	const int yOffset = fullRange ? 0 : 16;
+	const int rFromV = fullRange ? 359 : 409;
+	const int gFromU = fullRange ? 88 : 100;
+	const int gFromV = fullRange ? 183 : 208;
+	const int bFromU = fullRange ? 454 : 516;
+
+	uint8_t* out = frame.getPixels();
+	for (size_t y = 0; y < height; ++y) {
+		const uint8_t* luma = lumaPlane + y * width;
+		const uint8_t* u = uPlane + (y >> chromaShiftY) * chromaWidth;
+		const uint8_t* v = vPlane + (y >> chromaShiftY) * chromaWidth;
+		for (size_t x = 0; x < width; ++x, out += 3) {
+			const int c = (luma[x] - yOffset) * yScale + 128;
+			if (format == Format::Mono) {
+				out[0] = out[1] = out[2] = toByte(c >> 8);
+				continue;
+			}
+			const int d = u[x >> chromaShiftX] - 128;
+			const int e = v[x >> chromaShiftX] - 128;
+			out[0] = toByte((c + rFromV * e) >> 8);
+			out[1] = toByte((c - gFromU * d - gFromV * e) >> 8);
+			out[2] = toByte((c + bFromU * d) >> 8);
+		}
+	}
+}
+
+void MappedVideoReader::readAhead(int64_t index) const
+{
+	const int64_t last = min(index + 1 + kReadaheadFrames, frameCount);
+	if (index + 1 >= last)
+		return;
+
+	const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t rangeStart = (dataOffset + (size_t)(index + 1) * frameStride) & ~(pageSize - 1);
+	const size_t rangeEnd = dataOffset + (size_t)last * frameStride;
+	madvise(mapping->data + rangeStart, rangeEnd - rangeStart, MADV_WILLNEED);
+}
+
+void MappedVideoReader::seek(int64_t ts)
+{
+	nextIndex = Math::clamp(ts, (int64_t)0, frameCount);
+	// Sequential readahead won't have fetched wherever we jumped to
+	if (nextIndex < frameCount)
+		readAhead(nextIndex - 1);
+}
+
+int64_t MappedVideoReader::clocksToTimestamp(clock_t c) const
+{
+	return llround((double)c * rateNum / ((double)rateDen * CLOCKS_PER_SEC));
+}
+
+int64_t MappedVideoReader::durationToTimestamp(const std::chrono::milliseconds& d) const
+{
+	return llround((double)d.count() * rateNum / ((double)rateDen * 1000));
+}
+
+clock_t MappedVideoReader::timestampToClocks(int64_t ts) const
+{
+	return (clock_t)llround((double)ts * rateDen * CLOCKS_PER_SEC / rateNum);
+}
+
+std::chrono::milliseconds MappedVideoReader::timestampToDuration(int64_t ts) const
+{
+	return std::chrono::milliseconds(llround((double)ts * rateDen * 1000 / rateNum));
+}
+
+int64_t MappedVideoReader::timestampToSeconds(int64_t ts) const
+{
+	return llround((double)ts * rateDen / rateNum);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "StreamVideoFrame.hpp"
+#include "VideoReader.hpp"
+
+/**
+ * \brief Reads uncompressed video (raw packed RGB, or Y4M) straight from a memory-mapped file, without FFmpeg
+ *
+ * Raw frames are returned as views into the mapping, so reading one copies nothing: the pixels are paged in
+ * as they're touched, with the kernel reading ahead of the frames being returned. Frames are at fixed offsets,
+ * so seeking is instant. The mapping is private, so writing to a frame's pixels only changes that copy.
+ * Each frame keeps the mapping alive, so frames can outlive the reader.
+ *
+ * Y4M stores planar YUV, which is converted to RGB into a frame of its own (reused once the caller lets go of it).
+ * 8-bit 4:2:0, 4:2:2, 4:4:4, and monochrome are supported, in limited or (with XCOLORRANGE=FULL) full range.
+ *
+ * Time stamps count frames, so the frame rate is the time base.
+ */
+class MappedVideoReader final : public VideoReader {
+public:
+	/// Returns true if the file starts with a Y4M signature
+	static bool isY4M(const std::string& filename);
+
+	/**
+	 * \brief Opens a Y4M file
+	 * \param filename Path of the file
+	 * \throws Exceptions::FileException if the file can't be mapped or isn't supported Y4M
+	 */
+	explicit MappedVideoReader(const std::string& filename);
+
+	/**
+	 * \brief Opens a raw file of packed frames, back to back without headers
+	 * \param filename Path of the file
+	 * \param width Width of the frames
+	 * \param height Height of the frames
+	 * \param depth The bytes per pixel of the frames (3 for RGB or BGR, 4 with an alpha or padding byte)
+	 * \param fps The frame rate, in frames per second
+	 *
+	 * A partial frame at the end of the file is ignored.
+	 */
+	MappedVideoReader(const std::string& filename, size_t width, size_t height, size_t depth, double fps);
+
+	const std::shared_ptr<StreamVideoFrame>& getCurrentFrame() const override { return currentFrame; }
+
+	const std::shared_ptr<StreamVideoFrame>& getNextFrame() override;
+
+	double getFPS() const override { return (double)rateNum / rateDen; }
+
+	/// Returns the number of frames
+	int64_t getVideoLength() const override { return frameCount; }
+
+	/// Seeks so that the next frame is the one with the given time stamp (its index)
+	void seek(int64_t ts) override;
+
+	int64_t clocksToTimestamp(clock_t c) const override;
+
+	int64_t durationToTimestamp(const std::chrono::milliseconds& d) const override;
+
+	clock_t timestampToClocks(int64_t ts) const override;
+
+	std::chrono::milliseconds timestampToDuration(int64_t ts) const override;
+
+	int64_t timestampToSeconds(int64_t ts) const override;
+
+	/// Returns true if frames are views into the file rather than converted copies
+	bool isZeroCopy() const { return format == Format::Raw; }
+
+	// No copying
+	MappedVideoReader(const MappedVideoReader&) = delete;
+	MappedVideoReader& operator=(const MappedVideoReader&) = delete;
+
+private:
+	/// A mapped file, unmapped once the reader and every frame viewing it are gone
+	struct Mapping {
+		uint8_t* data;
+		size_t size;
+
+		Mapping(uint8_t* d, size_t s) : data(d), size(s) { }
+		~Mapping();
+
+		// No copying
+		Mapping(const Mapping&) = delete;
+		Mapping& operator=(const Mapping&) = delete;
+	};
+
+	/// How frames are stored
+	enum class Format {
+		Raw, ///< Packed pixels
+		Y420, ///< Y4M with chroma halved in both directions
+		Y422, ///< Y4M with chroma halved horizontally
+		Y444, ///< Y4M with full-resolution chroma
+		Mono ///< Y4M with luma only
+	};
+
+	/// Maps the file
+	void map(const std::string& filename);
+
+	/// Parses the Y4M stream header and the first frame header, filling in the frame layout
+	void parseY4MHeader();
+
+	/// Converts a Y4M frame's planes into RGB
+	void convertY4M(const uint8_t* planes, StreamVideoFrame& frame) const;
+
+	/// Asks the kernel to start reading the frames after the given one
+	void readAhead(int64_t index) const;
+
+	std::shared_ptr<Mapping> mapping;
+	Format format;
+	bool fullRange; ///< True if Y4M samples use the full 0-255 range rather than 16-235
+
+	size_t dataOffset; ///< Where the first frame starts
+	size_t frameStride; ///< The distance between the starts of consecutive frames
+	size_t frameHeaderSize; ///< The size of each Y4M frame header
+	int64_t frameCount;
+
+	int64_t rateNum; ///< The frame rate's numerator
+	int64_t rateDen; ///< The frame rate's denominator
+
+	int64_t nextIndex; ///< The index of the next frame to return
+	std::shared_ptr<StreamVideoFrame> currentFrame;
+};
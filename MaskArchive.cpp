@@ -0,0 +1,374 @@
+#include "precomp.hpp"
+#include "MaskArchive.hpp"
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Exceptions.hpp"
+
+using namespace std;
+
+namespace {
+
+const char kHeaderMagic[8] = {'V', 'M', 'O', 'X', 'M', 'A', 'S', 'K'};
+const char kFooterMagic[8] = {'V', 'M', 'O', 'X', 'I', 'N', 'D', 'X'};
+const uint32_t kVersion = 1;
+
+const size_t kHeaderSize = 24;
+const size_t kRecordHeaderSize = 16;
+const size_t kFooterSize = 16;
+
+enum FrameKind : uint8_t {
+	kKeyframe = 0,
+	kDelta = 1
+};
+
+void putLE(uint64_t v, size_t bytes, uint8_t* out)
+{
+	for (size_t i = 0; i < bytes; ++i, v >>= 8)
+		out[i] = (uint8_t)v;
+}
+
+uint64_t getLE(const uint8_t* in, size_t bytes)
+{
+	uint64_t v = 0;
+	for (size_t i = 0; i < bytes; ++i)
+		v |= (uint64_t)in[i] << (8 * i);
+	return v;
+}
+
+void putVarint(uint64_t v, vector<uint8_t>& out)
+{
+	while (v >= 0x80) {
+		out.push_back((uint8_t)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((uint8_t)v);
+}
+
+inline size_t getVarint(const uint8_t*& p, const uint8_t* end)
+{
+	size_t v = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		const uint8_t b = *p++;
+		v |= (size_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0)
+			return v;
+	}
+	throw Exceptions::FileException("Mask archive frame is corrupt", __FUNCTION__);
+}
+
+} // end anonymous namespace
+
+MaskArchiveWriter::MaskArchiveWriter(const string& filename, size_t w, size_t h, unsigned int kfInterval)
+	: file(nullptr),
+	  width(w),
+	  height(h),
+	  keyframeInterval(kfInterval),
+	  offset(0),
+	  frameCount(0),
+	  lastPTS(0),
+	  previous(w * h),
+	  current(w * h),
+	  payload(),
+	  index()
+{
+	if (w == 0 || h == 0)
+		throw Exceptions::ArgumentOutOfRangeException("Mask dimensions must be nonzero", __FUNCTION__);
+	if (kfInterval == 0)
+		throw Exceptions::ArgumentOutOfRangeException("The keyframe interval must be at least 1", __FUNCTION__);
+
+	file = fopen(filename.c_str(), "wb");
+	if (file == nullptr)
+		throw Exceptions::FileException("Could not create the mask archive", __FUNCTION__);
+
+	uint8_t header[kHeaderSize];
+	memcpy(header, kHeaderMagic, sizeof(kHeaderMagic));
+	putLE(kVersion, 4, header + 8);
+	putLE(width, 4, header + 12);
+	putLE(height, 4, header + 16);
+	putLE(keyframeInterval, 4, header + 20);
+	put(header, sizeof(header));
+}
+
+MaskArchiveWriter::~MaskArchiveWriter()
+{
+	if (file != nullptr) {
+		try {
+			close();
+		}
+		catch (...) {
+			// Destructors can't throw. Readers can still recover the frames without an index.
+		}
+	}
+}
+
+void MaskArchiveWriter::put(const void* bytes, size_t size)
+{
+	if (fwrite(bytes, 1, size, file) != size)
+		throw Exceptions::FileException("Could not write to the mask archive", __FUNCTION__);
+	offset += size;
+}
+
+void MaskArchiveWriter::write(const VideoFrame& frame, int64_t pts)
+{
+	if (file == nullptr)
+		throw Exceptions::InvalidOperationException("The mask archive has already been closed", __FUNCTION__);
+	if (frame.getWidth() != width || frame.getHeight() != height)
+		throw Exceptions::ArgumentException("The mask's dimensions don't match the archive's", __FUNCTION__);
+	if (frameCount > 0 && pts <= lastPTS)
+		throw Exceptions::ArgumentException("Mask timestamps must increase from frame to frame", __FUNCTION__);
+
+	// Pull out the motion channel
+	const size_t depth = frame.getBytesPerPixel();
+	const uint8_t* src = frame.getPixels();
+	for (size_t i = 0; i < current.size(); ++i, src += depth)
+		current[i] = src[0] != 0;
+
+	const bool key = frameCount % keyframeInterval == 0;
+	if (key)
+		fill(previous.begin(), previous.end(), 0);
+
+	// Encode the runs of pixels that differ from the previous frame (or from nothing, for keyframes)
+	payload.clear();
+	size_t skippedRows = 0;
+	for (size_t y = 0; y < height; ++y) {
+		const uint8_t* cur = current.data() + y * width;
+		const uint8_t* prev = previous.data() + y * width;
+		if (memcmp(cur, prev, width) == 0) {
+			++skippedRows;
+			continue;
+		}
+
+		putVarint(skippedRows, payload);
+		skippedRows = 0;
+
+		// Reserve room for the run count, which is patched in afterwards
+		const size_t countAt = payload.size();
+		payload.push_back(0);
+		size_t runs = 0;
+		size_t runEnd = 0;
+		for (size_t x = 0; x < width; ) {
+			if (cur[x] == prev[x]) {
+				++x;
+				continue;
+			}
+			const size_t runStart = x;
+			while (x < width && cur[x] != prev[x])
+				++x;
+			putVarint(runStart - runEnd, payload);
+			putVarint(x - runStart, payload);
+			runEnd = x;
+			++runs;
+		}
+
+		if (runs < 0x80) {
+			payload[countAt] = (uint8_t)runs;
+		}
+		else {
+			vector<uint8_t> count;
+			putVarint(runs, count);
+			payload.insert(payload.begin() + countAt + 1, count.begin() + 1, count.end());
+			payload[countAt] = count[0];
+		}
+	}
+	if (skippedRows > 0)
+		putVarint(skippedRows, payload);
+
+	if (key)
+		index.emplace_back(pts, offset);
+
+	uint8_t recordHeader[kRecordHeaderSize] = {};
+	putLE((uint64_t)pts, 8, recordHeader);
+	recordHeader[8] = key ? kKeyframe : kDelta;
+	putLE(payload.size(), 4, recordHeader + 12);
+	put(recordHeader, sizeof(recordHeader));
+	put(payload.data(), payload.size());
+
+	swap(previous, current);
+	lastPTS = pts;
+	++frameCount;
+}
+
+void MaskArchiveWriter::close()
+{
+	if (file == nullptr)
+		return;
+
+	const uint64_t indexOffset = offset;
+	vector<uint8_t> block(16 + index.size() * 16 + kFooterSize);
+	uint8_t* p = block.data();
+	putLE(frameCount, 8, p);
+	putLE(index.size(), 8, p + 8);
+	p += 16;
+	for (const auto& entry : index) {
+		putLE((uint64_t)entry.first, 8, p);
+		putLE(entry.second, 8, p + 8);
+		p += 16;
+	}
+	putLE(indexOffset, 8, p);
+	memcpy(p + 8, kFooterMagic, sizeof(kFooterMagic));
+	put(block.data(), block.size());
+
+	const int ret = fclose(file);
+	file = nullptr;
+	if (ret != 0)
+		throw Exceptions::FileException("Could not finish writing the mask archive", __FUNCTION__);
+}
+
+MaskArchiveReader::MaskArchiveReader(const string& filename)
+	: data(nullptr),
+	  fileSize(0),
+	  recordsEnd(0),
+	  width(0),
+	  height(0),
+	  frameCount(0),
+	  index(),
+	  mask()
+{
+	const int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw Exceptions::FileException("Could not open the mask archive", __FUNCTION__);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < kHeaderSize) {
+		::close(fd);
+		throw Exceptions::FileException("The mask archive is too short", __FUNCTION__);
+	}
+	fileSize = (size_t)st.st_size;
+
+	void* mapping = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd); // The mapping keeps the file open
+	if (mapping == MAP_FAILED)
+		throw Exceptions::FileException("Could not map the mask archive", __FUNCTION__);
+	data = (const uint8_t*)mapping;
+
+	// Only fault in what we decode
+	madvise(mapping, fileSize, MADV_RANDOM);
+
+	if (memcmp(data, kHeaderMagic, sizeof(kHeaderMagic)) != 0 || getLE(data + 8, 4) != kVersion) {
+		munmap(mapping, fileSize);
+		throw Exceptions::FileException("The file is not a mask archive", __FUNCTION__);
+	}
+	width = (size_t)getLE(data + 12, 4);
+	height = (size_t)getLE(data + 16, 4);
+	mask.reset(new VideoFrame(width, height, 1));
+
+	// Load the index if the archive was closed properly. Otherwise, rebuild it.
+	const uint8_t* footer = data + fileSize - kFooterSize;
+	if (fileSize >= kHeaderSize + kFooterSize + 16 &&
+	    memcmp(footer + 8, kFooterMagic, sizeof(kFooterMagic)) == 0) {
+		recordsEnd = (size_t)getLE(footer, 8);
+		if (recordsEnd < kHeaderSize || recordsEnd + 16 > fileSize - kFooterSize) {
+			munmap(mapping, fileSize);
+			throw Exceptions::FileException("The mask archive's index is corrupt", __FUNCTION__);
+		}
+		frameCount = getLE(data + recordsEnd, 8);
+		const uint64_t keyframes = getLE(data + recordsEnd + 8, 8);
+		if (recordsEnd + 16 + keyframes * 16 != fileSize - kFooterSize) {
+			munmap(mapping, fileSize);
+			throw Exceptions::FileException("The mask archive's index is corrupt", __FUNCTION__);
+		}
+		index.reserve(keyframes);
+		for (const uint8_t* p = data + recordsEnd + 16; p < footer; p += 16)
+			index.emplace_back((int64_t)getLE(p, 8), getLE(p + 8, 8));
+	}
+	else {
+		scanRecords();
+	}
+}
+
+MaskArchiveReader::~MaskArchiveReader()
+{
+	munmap((void*)data, fileSize);
+}
+
+void MaskArchiveReader::scanRecords()
+{
+	size_t off = kHeaderSize;
+	while (off + kRecordHeaderSize <= fileSize) {
+		const size_t payloadSize = (size_t)getLE(data + off + 12, 4);
+		if (off + kRecordHeaderSize + payloadSize > fileSize)
+			break; // A partially-written frame
+
+		if (data[off + 8] == kKeyframe)
+			index.emplace_back((int64_t)getLE(data + off, 8), off);
+		++frameCount;
+		off += kRecordHeaderSize + payloadSize;
+	}
+	recordsEnd = off;
+}
+
+void MaskArchiveReader::decodeRange(int64_t start, int64_t end,
+                                    const function<void(const VideoFrame&, int64_t)>& callback)
+{
+	if (index.empty() || end <= start)
+		return;
+
+	// Start at the last keyframe at or before the start of the range
+	auto kf = upper_bound(index.begin(), index.end(), start,
+	                      [](int64_t ts, const pair<int64_t, uint64_t>& e) { return ts < e.first; });
+	if (kf != index.begin())
+		--kf;
+
+	// Let the kernel know which part of the file we're about to read
+	auto kfEnd = lower_bound(index.begin(), index.end(), end,
+	                         [](const pair<int64_t, uint64_t>& e, int64_t ts) { return e.first < ts; });
+	const size_t rangeEnd = kfEnd == index.end() ? recordsEnd : (size_t)kfEnd->second;
+	const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t rangeStart = (size_t)kf->second & ~(pageSize - 1);
+	madvise((void*)(data + rangeStart), rangeEnd - rangeStart, MADV_WILLNEED);
+
+	uint8_t* pixels = mask->getPixels();
+	for (size_t off = (size_t)kf->second; off + kRecordHeaderSize <= recordsEnd; ) {
+		const int64_t pts = (int64_t)getLE(data + off, 8);
+		if (pts >= end)
+			break;
+
+		const bool key = data[off + 8] == kKeyframe;
+		const size_t payloadSize = (size_t)getLE(data + off + 12, 4);
+		const uint8_t* p = data + off + kRecordHeaderSize;
+		const uint8_t* payloadEnd = p + payloadSize;
+		if (payloadEnd > data + recordsEnd)
+			throw Exceptions::FileException("Mask archive frame is truncated", __FUNCTION__);
+
+		if (key)
+			memset(pixels, 0, width * height);
+
+		for (size_t y = 0; p < payloadEnd; ++y) {
+			y += getVarint(p, payloadEnd);
+			if (p == payloadEnd)
+				break;
+			if (y >= height)
+				throw Exceptions::FileException("Mask archive frame is corrupt", __FUNCTION__);
+
+			uint8_t* row = pixels + y * width;
+			const size_t runs = getVarint(p, payloadEnd);
+			size_t x = 0;
+			for (size_t r = 0; r < runs; ++r) {
+				x += getVarint(p, payloadEnd);
+				const size_t len = getVarint(p, payloadEnd);
+				if (x + len > width)
+					throw Exceptions::FileException("Mask archive frame is corrupt", __FUNCTION__);
+
+				if (key) {
+					memset(row + x, 255, len);
+				}
+				else {
+					for (uint8_t* q = row + x; q < row + x + len; ++q)
+						*q ^= 255;
+				}
+				x += len;
+			}
+		}
+
+		if (pts >= start)
+			callback(*mask, pts);
+
+		off += kRecordHeaderSize + payloadSize;
+	}
+}
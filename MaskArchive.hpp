@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "VideoFrame.hpp"
+
+/**
+ * \brief Writes motion masks to a compact archive file
+ *
+ * Only the motion channel (0) of each mask is stored, as a single bit per pixel.
+ * Each row is stored as runs of moving pixels, and empty rows are skipped entirely.
+ * Most frames are stored as the difference (XOR) from the previous frame, and every keyframeInterval frames a
+ * complete keyframe is stored so that readers can start decoding there.
+ * An index of keyframes is appended when the archive is closed.
+ *
+ * The file layout (all integers are little-endian) is:
+ * - A header: the magic "VMOXMASK", then version, width, height, and keyframe interval as 32-bit integers
+ * - Frame records: 64-bit PTS, 8-bit kind (0 for keyframes, 1 for deltas), 24 bits of padding,
+ *   32-bit payload size, and the payload
+ * - The index: 64-bit frame count, 64-bit keyframe count, then a 64-bit PTS and 64-bit file offset per keyframe
+ * - A footer: the 64-bit offset of the index and the magic "VMOXINDX"
+ *
+ * Each payload is a sequence of rows, each consisting of a variable-length integer (LEB128) count of rows
+ * to skip (which are empty or unchanged), then the number of runs in the row, then for each run,
+ * its distance from the end of the previous run and its length. The payload ends once all rows are accounted for.
+ */
+class MaskArchiveWriter final {
+public:
+	/**
+	 * \brief Creates a new archive, overwriting any existing file
+	 * \param filename The path of the archive
+	 * \param width The width of the motion masks
+	 * \param height The height of the motion masks
+	 * \param keyframeInterval A keyframe is stored every this many frames
+	 */
+	MaskArchiveWriter(const std::string& filename, size_t width, size_t height, unsigned int keyframeInterval = 300);
+
+	/// Closes the archive if close() hasn't been called yet
+	~MaskArchiveWriter();
+
+	/**
+	 * \brief Appends a mask to the archive
+	 * \param mask A motion mask, such as the one generated by MotionExtractor. Only the first channel is stored.
+	 * \param pts The timestamp of the mask. Timestamps must increase from frame to frame.
+	 */
+	void write(const VideoFrame& mask, int64_t pts);
+
+	/// Writes the index and closes the file. No more masks can be written afterwards.
+	void close();
+
+	/// Returns the number of bytes written so far
+	uint64_t getBytesWritten() const { return offset; }
+
+	// No copying
+	MaskArchiveWriter(const MaskArchiveWriter&) = delete;
+	MaskArchiveWriter& operator=(const MaskArchiveWriter&) = delete;
+
+private:
+	/// Appends raw bytes to the file
+	void put(const void* data, size_t size);
+
+	FILE* file;
+
+	size_t width;
+	size_t height;
+	unsigned int keyframeInterval;
+
+	uint64_t offset; ///< Current offset into the file
+	uint64_t frameCount; ///< Frames written so far
+	int64_t lastPTS; ///< Timestamp of the last frame written
+
+	/// The motion channel of the previous mask, one byte per pixel (0 or 1)
+	std::vector<uint8_t> previous;
+
+	/// The motion channel of the current mask, one byte per pixel (0 or 1)
+	std::vector<uint8_t> current;
+
+	std::vector<uint8_t> payload; ///< The current frame's encoded payload
+
+	/// PTS and file offset of each keyframe
+	std::vector<std::pair<int64_t, uint64_t>> index;
+};
+
+/**
+ * \brief Reads an archive written by MaskArchiveWriter
+ *
+ * The file is memory-mapped, and only the parts of it needed for the requested frames are touched.
+ */
+class MaskArchiveReader final {
+public:
+	/// Opens and maps the archive at the given path
+	explicit MaskArchiveReader(const std::string& filename);
+
+	~MaskArchiveReader();
+
+	size_t getWidth() const { return width; }
+
+	size_t getHeight() const { return height; }
+
+	/// Returns the number of frames in the archive
+	uint64_t getFrameCount() const { return frameCount; }
+
+	/// Returns the timestamp of the first frame (or 0 if the archive is empty)
+	int64_t getStartPTS() const { return index.empty() ? 0 : index.front().first; }
+
+	/**
+	 * \brief Decodes each frame with a timestamp in [start, end), in order
+	 * \param start The first timestamp to decode
+	 * \param end One past the last timestamp to decode
+	 * \param callback Called with each decoded mask and its timestamp.
+	 *                 Masks are one byte per pixel (0 or 255), and the frame is reused between calls.
+	 *
+	 * Decoding starts at the last keyframe at or before start.
+	 */
+	void decodeRange(int64_t start, int64_t end,
+	                 const std::function<void(const VideoFrame& mask, int64_t pts)>& callback);
+
+	// No copying
+	MaskArchiveReader(const MaskArchiveReader&) = delete;
+	MaskArchiveReader& operator=(const MaskArchiveReader&) = delete;
+
+private:
+	/// Rebuilds the index by walking the frame records (for archives that weren't closed)
+	void scanRecords();
+
+	const uint8_t* data; ///< The mapped file
+	size_t fileSize;
+	size_t recordsEnd; ///< Offset of the end of the frame records
+
+	size_t width;
+	size_t height;
+	uint64_t frameCount;
+
+	/// PTS and file offset of each keyframe
+	std::vector<std::pair<int64_t, uint64_t>> index;
+
+	/// The decoded mask
+	std::unique_ptr<VideoFrame> mask;
+};
@@ -0,0 +1,164 @@
+#include "precomp.hpp"
+#include "MotionEvent.hpp"
+
+#include "Exceptions.hpp"
+
+#include <cmath>
+
+using namespace std;
+
+namespace {
+
+const char* typeName(MotionEvent::Type t)
+{
+	switch (t) {
+		case MotionEvent::Type::MotionStart: return "motion start";
+		case MotionEvent::Type::MotionStop: return "motion stop";
+		case MotionEvent::Type::RegionActivity: return "region activity";
+		case MotionEvent::Type::Blob: return "blob";
+		case MotionEvent::Type::IlluminationChange: return "illumination change";
+		case MotionEvent::Type::TripwireCrossing: return "tripwire crossing";
+	}
+	return "unknown";
+}
+
+/// Writes an unsigned LEB128 variable-length integer
+void putVarint(uint64_t v, vector<uint8_t>& out)
+{
+	while (v >= 0x80) {
+		out.push_back((uint8_t)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((uint8_t)v);
+}
+
+uint64_t getVarint(const uint8_t*& data, const uint8_t* end)
+{
+	uint64_t v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (data >= end)
+			throw Exceptions::InvalidInputException("Motion event stream is truncated", __FUNCTION__);
+
+		const uint8_t b = *data++;
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0)
+			return v;
+	}
+	throw Exceptions::InvalidInputException("Motion event stream contains an invalid integer", __FUNCTION__);
+}
+
+/// Maps signed integers to unsigned ones so that small magnitudes stay small
+uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+
+int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+void putRect(const PixelRect& r, vector<uint8_t>& out)
+{
+	putVarint(r.x, out);
+	putVarint(r.y, out);
+	putVarint(r.width, out);
+	putVarint(r.height, out);
+}
+
+PixelRect getRect(const uint8_t*& data, const uint8_t* end)
+{
+	PixelRect r;
+	r.x = (size_t)getVarint(data, end);
+	r.y = (size_t)getVarint(data, end);
+	r.width = (size_t)getVarint(data, end);
+	r.height = (size_t)getVarint(data, end);
+	return r;
+}
+
+} // end anonymous namespace
+
+void MotionEvent::save(Json::Value& eventObject) const
+{
+	eventObject["type"] = typeName(type);
+	eventObject["pts"] = (Json::Int64)pts;
+
+	if (type == Type::RegionActivity || type == Type::Blob) {
+		if (type == Type::RegionActivity)
+			eventObject["region"] = region;
+		eventObject["pixels"] = pixelCount;
+
+		Json::Value& b = eventObject["bounds"];
+		b["x"] = (Json::UInt64)bounds.x;
+		b["y"] = (Json::UInt64)bounds.y;
+		b["width"] = (Json::UInt64)bounds.width;
+		b["height"] = (Json::UInt64)bounds.height;
+	}
+	else if (type == Type::IlluminationChange) {
+		eventObject["gain"] = gain;
+	}
+	else if (type == Type::TripwireCrossing) {
+		eventObject["tripwire"] = region;
+		eventObject["direction"] = direction;
+	}
+}
+
+void MotionEventEncoder::encode(const MotionEvent& event, vector<uint8_t>& out)
+{
+	out.push_back((uint8_t)event.type);
+	putVarint(zigzag(event.pts - lastPTS), out);
+	lastPTS = event.pts;
+
+	switch (event.type) {
+		case MotionEvent::Type::RegionActivity:
+			putVarint(event.region, out);
+			// Fall through
+		case MotionEvent::Type::Blob:
+			putVarint(event.pixelCount, out);
+			putRect(event.bounds, out);
+			break;
+
+		case MotionEvent::Type::IlluminationChange:
+			// In thousandths
+			putVarint((uint64_t)lround(event.gain * 1000), out);
+			break;
+
+		case MotionEvent::Type::TripwireCrossing:
+			putVarint(event.region, out);
+			putVarint(zigzag(event.direction), out);
+			break;
+
+		default:
+			break;
+	}
+}
+
+bool MotionEventDecoder::decode(const uint8_t*& data, const uint8_t* end, MotionEvent& event)
+{
+	if (data >= end)
+		return false;
+
+	const uint8_t t = *data++;
+	if (t > (uint8_t)MotionEvent::Type::TripwireCrossing)
+		throw Exceptions::InvalidInputException("Motion event stream contains an unknown event type", __FUNCTION__);
+
+	event = MotionEvent((MotionEvent::Type)t, lastPTS + unzigzag(getVarint(data, end)));
+	lastPTS = event.pts;
+
+	switch (event.type) {
+		case MotionEvent::Type::RegionActivity:
+			event.region = (uint32_t)getVarint(data, end);
+			// Fall through
+		case MotionEvent::Type::Blob:
+			event.pixelCount = (uint32_t)getVarint(data, end);
+			event.bounds = getRect(data, end);
+			break;
+
+		case MotionEvent::Type::IlluminationChange:
+			event.gain = (float)getVarint(data, end) / 1000;
+			break;
+
+		case MotionEvent::Type::TripwireCrossing:
+			event.region = (uint32_t)getVarint(data, end);
+			event.direction = (int8_t)unzigzag(getVarint(data, end));
+			break;
+
+		default:
+			break;
+	}
+	return true;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "PixelRect.hpp"
+
+namespace Json {
+class Value;
+}
+
+/// A structured summary of motion, generated by a MotionEventGenerator
+struct MotionEvent {
+
+	enum class Type : uint8_t {
+		MotionStart, ///< Motion appeared after a motionless period
+		MotionStop, ///< No motion has been seen for the generator's stop delay
+		RegionActivity, ///< Activity within a region of interest
+		Blob, ///< A connected area of motion
+		IlluminationChange, ///< The lighting changed and the extractor compensated for it
+		TripwireCrossing ///< Something crossed one of the extractor's tripwires
+	};
+
+	Type type;
+
+	/// Presentation timestamp of the frame the event was generated from (see StreamVideoFrame::getPTS)
+	int64_t pts;
+
+	/// Index of the region of interest (RegionActivity) or tripwire (TripwireCrossing)
+	uint32_t region;
+
+	/// Number of moving pixels in the region or blob
+	uint32_t pixelCount;
+
+	/// The region of interest (RegionActivity) or the bounding rectangle of the blob (Blob),
+	/// in motion mask coordinates
+	PixelRect bounds;
+
+	/// How much the lighting changed by since the last IlluminationChange, as a gain (IlluminationChange only)
+	float gain;
+
+	/// 1 if the tripwire was crossed from its left side to its right, -1 if the other way (TripwireCrossing only)
+	/// \see Tripwire
+	int8_t direction;
+
+	MotionEvent()
+		: type(Type::MotionStart), pts(0), region(0), pixelCount(0), bounds(), gain(1), direction(0) { }
+
+	MotionEvent(Type t, int64_t presTS)
+		: type(t), pts(presTS), region(0), pixelCount(0), bounds(), gain(1), direction(0) { }
+
+	/// Writes the event into the given JSON object
+	void save(Json::Value& eventObject) const;
+};
+
+/**
+ * \brief Encodes motion events into a compact binary stream
+ *
+ * Each event is a type byte followed by variable-length integers,
+ * and timestamps are stored as the difference from the previous event's.
+ * A typical event takes 2 to 12 bytes.
+ */
+class MotionEventEncoder final {
+public:
+	MotionEventEncoder() : lastPTS(0) { }
+
+	/// Appends the encoded event to out
+	void encode(const MotionEvent& event, std::vector<uint8_t>& out);
+
+	/// Starts a new stream (the next timestamp is encoded relative to 0)
+	void reset() { lastPTS = 0; }
+
+private:
+	int64_t lastPTS; ///< Timestamp of the last event encoded
+};
+
+/// Decodes a stream written by MotionEventEncoder
+class MotionEventDecoder final {
+public:
+	MotionEventDecoder() : lastPTS(0) { }
+
+	/**
+	 * \brief Decodes the next event
+	 * \param data The next byte to decode. This is advanced past the event.
+	 * \param end One past the last byte of the stream
+	 * \param event Receives the decoded event
+	 * \returns false if there are no more events
+	 * \throws Exceptions::InvalidInputException if the stream is malformed or truncated
+	 */
+	bool decode(const uint8_t*& data, const uint8_t* end, MotionEvent& event);
+
+	/// Starts a new stream (the next timestamp is decoded relative to 0)
+	void reset() { lastPTS = 0; }
+
+private:
+	int64_t lastPTS; ///< Timestamp of the last event decoded
+};
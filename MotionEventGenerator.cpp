@@ -0,0 +1,202 @@
+#include "precomp.hpp"
+#include "MotionEventGenerator.hpp"
+
+#include "MotionExtractor.hpp"
+#include "VideoFrame.hpp"
+
+using namespace std;
+
+namespace {
+
+/// Returns the intersection of two rectangles (which may be empty)
+PixelRect intersect(const PixelRect& a, const PixelRect& b)
+{
+	const size_t left = max(a.x, b.x);
+	const size_t top = max(a.y, b.y);
+	const size_t right = min(a.x + a.width, b.x + b.width);
+	const size_t bottom = min(a.y + a.height, b.y + b.height);
+	if (right <= left || bottom <= top)
+		return PixelRect();
+	return PixelRect(left, top, right - left, bottom - top);
+}
+
+/// Counts the moving pixels of the mask within the given rectangle
+uint32_t countMoving(const VideoFrame& mask, const PixelRect& r)
+{
+	uint32_t count = 0;
+	const size_t depth = mask.getBytesPerPixel();
+	for (size_t y = r.y; y < r.y + r.height; ++y) {
+		const uint8_t* p = mask.getPixel(r.x, y);
+		const uint8_t* rowEnd = p + r.width * depth;
+		for (; p < rowEnd; p += depth)
+			count += p[0] != 0;
+	}
+	return count;
+}
+
+} // end anonymous namespace
+
+MotionEventGenerator::MotionEventGenerator(size_t queueCapacity)
+	: events(queueCapacity),
+	  dropped(0),
+	  regions(),
+	  regionCounts(),
+	  stopDelay(1),
+	  motionlessFrames(0),
+	  inMotion(false),
+	  minBlobSize(1),
+	  tileMotionIndex(),
+	  tileBlobs(),
+	  fillStack()
+{ }
+
+uint32_t MotionEventGenerator::addRegion(const PixelRect& region)
+{
+	if (region.empty())
+		throw Exceptions::ArgumentException("Regions of interest cannot be empty", __FUNCTION__);
+
+	regions.push_back(region);
+	regionCounts.push_back(0);
+	return (uint32_t)(regions.size() - 1);
+}
+
+void MotionEventGenerator::clearRegions()
+{
+	regions.clear();
+	regionCounts.clear();
+}
+
+void MotionEventGenerator::push(const MotionEvent& event)
+{
+	if (!events.tryPush(event))
+		dropped.fetch_add(1, memory_order_relaxed);
+}
+
+void MotionEventGenerator::update(const MotionExtractor& extractor, int64_t pts)
+{
+	const VideoFrame& mask = extractor.getMotionMask();
+	const vector<PixelRect>& tiles = extractor.getMotionTiles();
+
+	if (extractor.hasIlluminationChange()) {
+		MotionEvent e(MotionEvent::Type::IlluminationChange, pts);
+		e.gain = (float)extractor.getIlluminationChangeGain();
+		push(e);
+	}
+
+	if (extractor.hasMotion()) {
+		motionlessFrames = 0;
+		if (!inMotion) {
+			inMotion = true;
+			push(MotionEvent(MotionEvent::Type::MotionStart, pts));
+		}
+	}
+
+	// Count the moving pixels in each region, with the extractor's mask integral if it has one,
+	// or else looking only at tiles with motion
+	for (size_t r = 0; r < regions.size(); ++r) {
+		uint32_t count = 0;
+		if (extractor.getMaskIntegral()) {
+			count = extractor.countMoving(regions[r]);
+		}
+		else {
+			for (const PixelRect& tile : tiles) {
+				const PixelRect overlap = intersect(regions[r], tile);
+				if (!overlap.empty())
+					count += countMoving(mask, overlap);
+			}
+		}
+
+		// Report activity, plus one final event when it stops
+		if (count > 0 || regionCounts[r] > 0) {
+			MotionEvent e(MotionEvent::Type::RegionActivity, pts);
+			e.region = (uint32_t)r;
+			e.pixelCount = count;
+			e.bounds = regions[r];
+			push(e);
+		}
+		regionCounts[r] = count;
+	}
+
+	if (extractor.hasMotion())
+		generateBlobs(extractor, pts);
+
+	const vector<Tripwire>& wires = extractor.getTripwires();
+	for (size_t w = 0; w < wires.size(); ++w) {
+		if (wires[w].getLastCrossing() != 0) {
+			MotionEvent e(MotionEvent::Type::TripwireCrossing, pts);
+			e.region = (uint32_t)w;
+			e.direction = (int8_t)wires[w].getLastCrossing();
+			push(e);
+		}
+	}
+
+	if (!extractor.hasMotion() && inMotion && ++motionlessFrames >= stopDelay) {
+		inMotion = false;
+		push(MotionEvent(MotionEvent::Type::MotionStop, pts));
+	}
+}
+
+void MotionEventGenerator::generateBlobs(const MotionExtractor& extractor, int64_t pts)
+{
+	const VideoFrame& mask = extractor.getMotionMask();
+	const vector<PixelRect>& tiles = extractor.getMotionTiles();
+	const size_t ts = MotionExtractor::kTileSize;
+	const int tilesWide = (int)((mask.getWidth() + ts - 1) / ts);
+	const int tilesHigh = (int)((mask.getHeight() + ts - 1) / ts);
+
+	tileMotionIndex.assign(tilesWide * tilesHigh, -1);
+	for (size_t i = 0; i < tiles.size(); ++i)
+		tileMotionIndex[(tiles[i].y / ts) * tilesWide + tiles[i].x / ts] = (int)i;
+
+	// Flood fill 8-connected groups of motion tiles. Each group is a blob.
+	tileBlobs.assign(tiles.size(), -1);
+	int blobCount = 0;
+	for (size_t seed = 0; seed < tiles.size(); ++seed) {
+		if (tileBlobs[seed] >= 0)
+			continue;
+
+		MotionEvent e(MotionEvent::Type::Blob, pts);
+		size_t left = mask.getWidth(), top = mask.getHeight(), right = 0, bottom = 0;
+
+		tileBlobs[seed] = blobCount;
+		fillStack.assign(1, (int)seed);
+		while (!fillStack.empty()) {
+			const PixelRect& tile = tiles[fillStack.back()];
+			fillStack.pop_back();
+
+			// Find the exact bounds and pixel count of the motion in this tile
+			const size_t depth = mask.getBytesPerPixel();
+			for (size_t y = tile.y; y < tile.y + tile.height; ++y) {
+				const uint8_t* p = mask.getPixel(tile.x, y);
+				for (size_t x = tile.x; x < tile.x + tile.width; ++x, p += depth) {
+					if (p[0] == 0)
+						continue;
+
+					++e.pixelCount;
+					left = min(left, x);
+					top = min(top, y);
+					right = max(right, x + 1);
+					bottom = max(bottom, y + 1);
+				}
+			}
+
+			const int tx = (int)(tile.x / ts);
+			const int ty = (int)(tile.y / ts);
+			for (int ny = max(ty - 1, 0); ny <= min(ty + 1, tilesHigh - 1); ++ny) {
+				for (int nx = max(tx - 1, 0); nx <= min(tx + 1, tilesWide - 1); ++nx) {
+					const int neighbor = tileMotionIndex[ny * tilesWide + nx];
+					if (neighbor >= 0 && tileBlobs[neighbor] < 0) {
+						tileBlobs[neighbor] = blobCount;
+						fillStack.push_back(neighbor);
+					}
+				}
+			}
+		}
+		++blobCount;
+
+		if (e.pixelCount >= minBlobSize && e.pixelCount > 0) {
+			e.bounds = PixelRect(left, top, right - left, bottom - top);
+			push(e);
+		}
+	}
+}
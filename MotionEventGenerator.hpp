@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include "MotionEvent.hpp"
+#include "SpscRing.hpp"
+
+class MotionExtractor;
+
+/**
+ * \brief Turns the output of a MotionExtractor into a stream of MotionEvents
+ *
+ * After each call to MotionExtractor::generateMotionMask, call update() with the frame's timestamp.
+ * Events are queued in a lock-free ring, so update() and nextEvent() may be called from two different threads.
+ * Only the tiles of the mask that contain motion are examined.
+ */
+class MotionEventGenerator final {
+public:
+	/// \param queueCapacity The number of events that can be queued before new ones are dropped
+	explicit MotionEventGenerator(size_t queueCapacity = 1024);
+
+	/**
+	 * \brief Adds a region of interest, which will generate RegionActivity events
+	 * \param region The region, in motion mask coordinates
+	 * \returns The index of the region, used in its events
+	 */
+	uint32_t addRegion(const PixelRect& region);
+
+	/// Removes all regions of interest
+	void clearRegions();
+
+	/// Sets how many consecutive motionless frames must pass before a MotionStop event
+	void setStopDelay(unsigned int frames) { stopDelay = frames; }
+
+	/// Blobs with fewer moving pixels than this do not generate events
+	void setMinimumBlobSize(uint32_t pixels) { minBlobSize = pixels; }
+
+	/**
+	 * \brief Generates events for the motion mask the extractor last generated
+	 * \param extractor The extractor that just processed a frame
+	 * \param pts The presentation timestamp of that frame (see StreamVideoFrame::getPTS)
+	 *
+	 * Events are generated in the order IlluminationChange, MotionStart, RegionActivity, Blob,
+	 * TripwireCrossing, MotionStop.
+	 */
+	void update(const MotionExtractor& extractor, int64_t pts);
+
+	/// Gets the oldest queued event. Returns false if there are none.
+	bool nextEvent(MotionEvent& event) { return events.tryPop(event); }
+
+	/// Returns the number of events dropped because the queue was full
+	uint64_t getDroppedEvents() const { return dropped.load(std::memory_order_relaxed); }
+
+	// No copying
+	MotionEventGenerator(const MotionEventGenerator&) = delete;
+	MotionEventGenerator& operator=(const MotionEventGenerator&) = delete;
+
+private:
+	/// Queues an event, dropping it if the queue is full
+	void push(const MotionEvent& event);
+
+	/// Groups adjacent tiles with motion into blobs and queues a Blob event for each
+	void generateBlobs(const MotionExtractor& extractor, int64_t pts);
+
+	SpscRing<MotionEvent> events;
+
+	std::atomic<uint64_t> dropped; ///< Events dropped because the queue was full
+
+	std::vector<PixelRect> regions; ///< Regions of interest
+
+	/// Moving pixels in each region as of the last update
+	/// (used to send a final event when activity in a region ends)
+	std::vector<uint32_t> regionCounts;
+
+	unsigned int stopDelay; ///< \see setStopDelay
+
+	unsigned int motionlessFrames; ///< Consecutive frames without motion
+
+	bool inMotion; ///< True between MotionStart and MotionStop events
+
+	uint32_t minBlobSize; ///< \see setMinimumBlobSize
+
+	/// Index into the extractor's motion tiles for each tile of the mask (or -1 if the tile has no motion)
+	std::vector<int> tileMotionIndex;
+
+	/// Blob number assigned to each motion tile
+	std::vector<int> tileBlobs;
+
+	/// Flood fill stack of motion tile indices
+	std::vector<int> fillStack;
+};
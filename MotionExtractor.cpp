@@ -1,44 +1,324 @@
 #include "precomp.hpp"
 #include "MotionExtractor.hpp"
 
+#include "Affinity.hpp"
 #include "Exceptions.hpp"
 #include "MKMath.hpp"
 #include "VideoFrame.hpp"
 
+#include <numeric>
+
 using namespace std;
 
 namespace {
 
-const size_t kDownscaleRatio = 2;
-const size_t kDownscaleSquare = kDownscaleRatio * kDownscaleRatio;
 const size_t kBytesPerPixel = 3;
 
+/// Fractional bits of the fixed-point noise deviations.
+/// 255 << 7 still fits in a signed 16-bit SIMD lane, which keeps the update in 16-bit arithmetic.
+const int kNoiseFractionBits = 7;
+
+/// Each frame, noise deviations move 1 / 2^kNoiseRate of the way towards the newest sample
+const int kNoiseRate = 5;
+
+/// For Gaussian noise, the standard deviation is about 1.2533 times the mean absolute deviation
+const double kDeviationToSigma = 1.2533;
+
+/// Converts a noise multiplier into the 16-bit factor used by updateNoiseThresholds()
+/// (thresholds are the high 16 bits of deviation * scale)
+uint16_t noiseMultiplierToScale(double k)
+{
+	return (uint16_t)lround(k * kDeviationToSigma * (1 << (16 - kNoiseFractionBits)));
+}
+
+const double kDefaultNoiseMultiplier = 3.0;
+
+/// Each buffer in an extractor's arena starts on its own cache line
+const size_t kArenaAlignment = 64;
+
+const int kDefaultStaticTolerance = 8;
+
+const double kDefaultIlluminationThreshold = 0.15;
+
+/// The static image is rescaled whenever the frame's brightness is off from it by more than this,
+/// which is just enough to keep noise and small moving objects from rescaling it every frame
+const double kIlluminationDeadBand = 0.02;
+
+/// A tile is only rescaled by its own gain if that's within this much of the frame's overall gain
+/// (anything further off probably has motion in it)
+const double kTileGainSpread = 0.25;
+
+const int kDefaultMaxShake = 2;
+
+/// A shift is only accepted if it matches the static image this much better than no shift at all,
+/// so that noise and moving objects don't make the offset jitter
+const double kShakeMargin = 0.9;
+
+/// A shift of one pixel is only accepted if the profiles place the true shift at least this far from 0
+/// (see bestShift)
+const double kShakeDeadBand = 0.7;
+
+/// With coarse-to-fine detection, one of every this many rows of tiles is refreshed each frame
+/// even without motion, so that every part of the static image keeps following the scene
+const size_t kCoarseRefreshPeriod = 8;
+
+/**
+ * \brief Finds the shift that best lines up two brightness profiles
+ * \returns The d for which frame[i] best matches reference[i + d], from -maxShift to maxShift
+ *
+ * Each candidate is scored by the mean absolute difference of the overlapping parts of the profiles,
+ * with their means removed so that a change in brightness doesn't favor any shift.
+ */
+int bestShift(const pmr::vector<uint32_t>& frame, const pmr::vector<uint32_t>& reference, int maxShift)
+{
+	const int n = (int)frame.size();
+	const auto cost = [&](int d) {
+		const int begin = max(0, -d);
+		const int end = min(n, n - d);
+		double frameMean = 0, referenceMean = 0;
+		for (int i = begin; i < end; ++i) {
+			frameMean += frame[i];
+			referenceMean += reference[i + d];
+		}
+		frameMean /= end - begin;
+		referenceMean /= end - begin;
+
+		double total = 0;
+		for (int i = begin; i < end; ++i)
+			total += abs((frame[i] - frameMean) - (reference[i + d] - referenceMean));
+		return total / (end - begin);
+	};
+
+	const double unshifted = cost(0);
+	int best = 0;
+	double bestCost = unshifted;
+	for (int d = -maxShift; d <= maxShift; ++d) {
+		const double c = d != 0 ? cost(d) : unshifted;
+		if (c < bestCost) {
+			best = d;
+			bestCost = c;
+		}
+	}
+	if (bestCost >= unshifted * kShakeMargin)
+		return 0;
+
+	// The cost of a shift grows roughly linearly with its distance from the true one, so the costs of -1, 0, and 1
+	// place the true shift between pixels. A shift under a pixel (such as a small shake at a coarse downscale ratio)
+	// is ignored unless it's clearly closer to a whole pixel than to none.
+	if (abs(best) == 1) {
+		const double opposite = cost(-best);
+		const double subPixel = opposite > unshifted ? (opposite - bestCost) / (2 * (opposite - unshifted)) : 1;
+		if (subPixel < kShakeDeadBand)
+			return 0;
+	}
+	return best;
+}
+
+/**
+ * \brief Shifts an image in place so that each pixel takes the value of the one (dx, dy) from it
+ * \param channels The number of elements per pixel
+ *
+ * Where that falls outside the image, the nearest edge pixel is used.
+ */
+template <typename T>
+void shiftImage(T* pixels, size_t width, size_t height, size_t channels, int dx, int dy)
+{
+	const size_t rowSize = width * channels;
+	// Rows are copied in the order that reads each source row before it's overwritten
+	if (dy > 0) {
+		for (size_t y = 0; y < height; ++y) {
+			const size_t source = min(y + dy, height - 1);
+			copy(pixels + source * rowSize, pixels + (source + 1) * rowSize, pixels + y * rowSize);
+		}
+	}
+	else if (dy < 0) {
+		for (size_t y = height; y-- > 0;) {
+			const size_t source = y >= (size_t)-dy ? y + dy : 0;
+			copy(pixels + source * rowSize, pixels + (source + 1) * rowSize, pixels + y * rowSize);
+		}
+	}
+
+	const size_t shift = min((size_t)abs(dx), width - 1) * channels;
+	if (shift == 0)
+		return;
+	for (T* row = pixels; row < pixels + height * rowSize; row += rowSize) {
+		if (dx > 0) {
+			copy(row + shift, row + rowSize, row);
+			for (T* p = row + rowSize - shift; p < row + rowSize; p += channels)
+				copy(p - channels, p, p);
+		}
+		else {
+			copy_backward(row, row + rowSize - shift, row + rowSize);
+			for (T* p = row + shift; p > row; p -= channels)
+				copy(p, p + channels, p - channels);
+		}
+	}
+}
+
+/// Returns the sum of the given bytes
+uint32_t sumBytes(const uint8_t* p, size_t size)
+{
+	uint32_t sum = 0;
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i sums = _mm_setzero_si128();
+	for (; i + 16 <= size; i += 16)
+		sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(p + i)), _mm_setzero_si128()));
+	sum = (uint32_t)(_mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8)));
+#endif
+	for (; i < size; ++i)
+		sum += p[i];
+	return sum;
+}
+
+/// Returns true if any of the bytes differ by more than the tolerance
+bool exceedsTolerance(const uint8_t* a, const uint8_t* b, size_t size, int tolerance)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i tol = _mm_set1_epi8((char)tolerance);
+	__m128i over = _mm_setzero_si128();
+	for (; i + 16 <= size; i += 16) {
+		const __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		const __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+		const __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+		over = _mm_or_si128(over, _mm_subs_epu8(diff, tol));
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(over, _mm_setzero_si128())) != 0xffff)
+		return true;
+#endif
+	for (; i < size; ++i) {
+		if (abs((int)a[i] - (int)b[i]) > tolerance)
+			return true;
+	}
+	return false;
+}
+
+/// Averages each 2x2 block of a 3-byte-per-pixel image into one pixel of another, half the size
+void halve(const VideoFrame& src, VideoFrame& dst)
+{
+	const size_t srcLine = src.getWidth() * 3;
+	for (size_t y = 0; y < dst.getHeight(); ++y) {
+		const uint8_t* top = src.getPixels() + 2 * y * srcLine;
+		const uint8_t* bottom = top + srcLine;
+		uint8_t* dp = dst.getPixel(0, y);
+		for (size_t x = 0; x < dst.getWidth(); ++x, top += 6, bottom += 6, dp += 3) {
+			for (size_t c = 0; c < 3; ++c)
+				dp[c] = (uint8_t)((top[c] + top[c + 3] + bottom[c] + bottom[c + 3] + 2) / 4);
+		}
+	}
+}
+
+/// Calls f(begin, end) with the pixel columns of each run of consecutive flagged tiles in a row of tiles
+template <typename F>
+void forEachTileRun(const uint8_t* flags, size_t tilesWide, size_t width, F f)
+{
+	const size_t tileSize = MotionExtractor::kTileSize;
+	size_t tx = 0;
+	while (tx < tilesWide) {
+		if (!flags[tx]) {
+			++tx;
+			continue;
+		}
+
+		const size_t begin = tx;
+		while (tx < tilesWide && flags[tx])
+			++tx;
+		f(begin * tileSize, min(tx * tileSize, width));
+	}
+}
+
 } // end anonymous namespace
 
+constexpr size_t MotionExtractor::kTileSize;
 
 MotionExtractor::MotionExtractor(size_t frameWidth,
                                  size_t frameHeight,
                                  double videoFPS,
-                                 bool benchmark)
+                                 bool benchmark,
+                                 size_t downscaleRatio,
+                                 bool lowMem,
+                                 std::pmr::memory_resource* resource)
 	: motionMask(),
 	  fps(videoFPS),
 	  motionThreshold(26),
 	  stableCap((unsigned int)ceil(videoFPS)), // Make the stable cap equal to one second of frames
 	  erosionLevel(5),
-	  erodedMask(),
+	  noiseAdaptive(false),
+	  noiseMultiplier(kDefaultNoiseMultiplier),
+	  noiseScale(noiseMultiplierToScale(kDefaultNoiseMultiplier)),
+	  noiseDeviations(resource),
+	  adaptiveThresholds(resource),
+	  illuminationCompensation(false),
+	  illuminationThreshold(kDefaultIlluminationThreshold),
+	  illuminationGain(1),
+	  illuminationDrift(1),
+	  illuminationChangeGain(1),
+	  illuminationChanged(false),
+	  shakeCompensation(false),
+	  maxShake(kDefaultMaxShake),
+	  shakeOffset(0, 0, 0),
+	  shakeHeldFrames(0),
+	  frameRowSums(resource),
+	  frameColumnSums(resource),
+	  staticRowSums(resource),
+	  staticColumnSums(resource),
+	  coarseFactor(0),
+	  coarse(),
+	  coarseFrame(),
+	  coarseSums(resource),
+	  tileRefined(resource),
+	  tileSkippedFrames(resource),
+	  refinedTiles(0),
+	  refreshPhase(0),
+	  erosionRows(nullptr),
 	  offs(),
+	  tilesWide(0),
+	  tilesHigh(0),
+	  tileDirty(resource),
+	  tileScratch(resource),
+	  tileMotion(resource),
+	  tileFrameSums(resource),
+	  tileStaticSums(resource),
+	  dirtyTiles(),
+	  tripwires(),
+	  maskIntegral(resource),
+	  motionBounds(),
 	  currentImage(),
-	  currentStableTimes(),
-	  downscaleBuff(),
-	  downscaleAccumulators(),
+	  currentStableTimes(nullptr),
+	  downscaleBuff(nullptr),
+	  downscaleAccumulators(nullptr),
+	  downscaleStorage(resource),
 	  refImage(),
-	  stableRecords(),
+	  stableRecords(nullptr),
+	  ratio(downscaleRatio),
+	  downscaleKernel(nullptr),
+	  downscaleDepth(0),
+	  passThrough(false),
+	  trackKernel(nullptr),
+	  detectKernel(nullptr),
+	  shiftedDetectKernel(nullptr),
+	  genericKernels(false),
+	  lowMemory(lowMem),
+	  bandRows(0),
+	  memory(resource),
+	  arena(nullptr),
+	  arenaSize(0),
+	  staticGeneration(0),
+	  staticTracking(false),
+	  staticTolerance(kDefaultStaticTolerance),
+	  staticReplaced(true),
+	  tileStaticChanged(resource),
+	  tileGenerations(resource),
+	  staticPyramid(),
+	  pyramidInterval(1),
+	  pyramidCountdown(0),
+	  pyramidGeneration(0),
 	  firstFrame(true),
 	  imageWidth(0),
 	  imageHeight(0),
 	  imageArea(0),
 	  imageSize(0),
-	  srcLineSize(0),
 	  destLineSize(0),
 	  benchmarking(benchmark),
 	  lastMark(clock()),
@@ -46,24 +326,30 @@ MotionExtractor::MotionExtractor(size_t frameWidth,
 	  framesCounted(0)
 	  // Some of these aren't necessary, but appease g++ -Weffc++
 {
+	if (memory == nullptr)
+		throw Exceptions::ArgumentNullException("The memory resource cannot be null", __FUNCTION__);
+	if (ratio != 1 && ratio != 2 && ratio != 4 && ratio != 8)
+		throw Exceptions::ArgumentOutOfRangeException("Downscale ratio must be 1, 2, 4, or 8", __FUNCTION__);
+
 	// We're going to downscale the image by a certain ratio to speed up
 	// analysis and reduce the impact of noise
-	imageWidth = frameWidth / kDownscaleRatio;
-	imageHeight = frameHeight / kDownscaleRatio;
-	srcLineSize = frameWidth * kBytesPerPixel;
+	imageWidth = frameWidth / ratio;
+	imageHeight = frameHeight / ratio;
 	destLineSize = imageWidth * kBytesPerPixel;
 
 	// Light up our buffers
 	imageArea = imageWidth * imageHeight;
 	imageSize = imageArea * kBytesPerPixel;
-	currentImage.reset(new VideoFrame(imageWidth, imageHeight, kBytesPerPixel, false));
-	currentStableTimes.resize(imageArea);
-	downscaleBuff.reset(new VideoFrame(imageWidth, imageHeight, kBytesPerPixel));
-	downscaleAccumulators.resize(imageSize);
-	refImage.reset(new VideoFrame(imageWidth, imageHeight, kBytesPerPixel, false));
-	stableRecords = new unsigned int[imageArea];
-	motionMask.reset(new VideoFrame(imageWidth, imageHeight, kBytesPerPixel, false));
-	erodedMask.reset(new VideoFrame(imageWidth, imageHeight, kBytesPerPixel, false));
+	bandRows = lowMemory ? min(kTileSize, imageHeight) : imageHeight;
+	allocateBuffers();
+
+	// Split the mask into tiles so that motion-free areas can be skipped
+	tilesWide = (imageWidth + kTileSize - 1) / kTileSize;
+	tilesHigh = (imageHeight + kTileSize - 1) / kTileSize;
+	tileDirty.resize(tilesWide * tilesHigh);
+	tileScratch.resize(tilesWide * tilesHigh);
+	tileMotion.resize(tilesWide * tilesHigh);
+	dirtyTiles.reserve(tilesWide * tilesHigh);
 
 	// Generate pixel offsets for erosion
 	const int po = (int)motionMask->getBytesPerPixel(); // One pixel's worth of offset
@@ -73,26 +359,157 @@ MotionExtractor::MotionExtractor(size_t frameWidth,
 	offs.push_back(PixelOffset(-1, -1, upOne - po));
 	offs.push_back(PixelOffset(0, -1, upOne));
 	offs.push_back(PixelOffset(1, -1, upOne + po));
-	offs.push_back(PixelOffset(-1, 1, upOne - po));
-	offs.push_back(PixelOffset(0, 1, upOne));
-	offs.push_back(PixelOffset(1, 1, upOne + po));
+	offs.push_back(PixelOffset(-1, 1, -upOne - po));
+	offs.push_back(PixelOffset(0, 1, -upOne));
+	offs.push_back(PixelOffset(1, 1, -upOne + po));
+
+	selectKernels();
 
 	// Initialize our time-dependant stuff to the desired initial state
 	reset();
 }
 
+MotionExtractor::~MotionExtractor()
+{
+	memory->deallocate(arena, arenaSize, kArenaAlignment);
+}
+
+void MotionExtractor::allocateBuffers()
+{
+	const auto align = [](size_t bytes) { return (bytes + kArenaAlignment - 1) & ~(kArenaAlignment - 1); };
+	const size_t imageBytes = align(imageSize);
+	const size_t timerBytes = align(imageArea * sizeof(unsigned int));
+	const size_t erosionBytes = align(2 * imageWidth);
+
+	// Zero everything so the mask's user channels start blank
+	arenaSize = 3 * imageBytes + 2 * timerBytes + erosionBytes;
+	arena = static_cast<uint8_t*>(memory->allocate(arenaSize, kArenaAlignment));
+	memset(arena, 0, arenaSize);
+	uint8_t* next = arena;
+	const auto carve = [&next](size_t bytes) {
+		uint8_t* buffer = next;
+		next += bytes;
+		return buffer;
+	};
+
+	currentImage.reset(new VideoFrame(carve(imageBytes), imageWidth, imageHeight, kBytesPerPixel, false));
+	refImage.reset(new VideoFrame(carve(imageBytes), imageWidth, imageHeight, kBytesPerPixel, false));
+	motionMask.reset(new VideoFrame(carve(imageBytes), imageWidth, imageHeight, kBytesPerPixel, false));
+	currentStableTimes = reinterpret_cast<unsigned int*>(carve(timerBytes));
+	stableRecords = reinterpret_cast<unsigned int*>(carve(timerBytes));
+	erosionRows = carve(erosionBytes);
+
+	// At ratio 1, RGB frames are analyzed where they are, so the downscale buffers wait for a frame that needs them
+	if (ratio != 1)
+		allocateDownscaleBuffers();
+}
+
+void MotionExtractor::allocateDownscaleBuffers()
+{
+	// The accumulators follow the band, on an even offset
+	const size_t bandBytes = (bandRows * destLineSize + 1) & ~(size_t)1;
+	downscaleStorage.resize(bandBytes + destLineSize * sizeof(unsigned short));
+	downscaleBuff = downscaleStorage.data();
+	downscaleAccumulators = reinterpret_cast<unsigned short*>(downscaleStorage.data() + bandBytes);
+}
+
+size_t MotionExtractor::memoryUsage() const
+{
+	return sizeof(*this) + arenaSize + 3 * sizeof(VideoFrame)
+	       + noiseDeviations.capacity() * sizeof(uint16_t) + adaptiveThresholds.capacity()
+	       + offs.capacity() * sizeof(PixelOffset) + downscaleStorage.capacity()
+	       + tileDirty.capacity() + tileScratch.capacity() + tileMotion.capacity()
+	       + dirtyTiles.capacity() * sizeof(PixelRect)
+	       + (tileFrameSums.capacity() + tileStaticSums.capacity()) * sizeof(uint32_t)
+	       + (frameRowSums.capacity() + frameColumnSums.capacity()
+	          + staticRowSums.capacity() + staticColumnSums.capacity()) * sizeof(uint32_t)
+	       + maskIntegral.capacity() * sizeof(uint32_t)
+	       + (coarse != nullptr ? coarse->memoryUsage() + sizeof(VideoFrame) + coarseFrame->getTotalSize() : 0)
+	       + coarseSums.capacity() * sizeof(uint16_t) + tileRefined.capacity()
+	       + tileSkippedFrames.capacity() * sizeof(unsigned int)
+	       + tileStaticChanged.capacity() + tileGenerations.capacity() * sizeof(uint64_t)
+	       + accumulate(staticPyramid.begin(), staticPyramid.end(), (size_t)0,
+	                    [](size_t sum, const unique_ptr<VideoFrame>& level) {
+	                        return sum + sizeof(VideoFrame) + level->getTotalSize();
+	                    });
+}
+
 /// Returns true if the two pixels are significantly different
-bool MotionExtractor::pixelIsDifferent(uint8_t* __restrict pa,
-                                       uint8_t* __restrict pb)
-{
-	bool ret = false;
-	for (size_t b = 0; b < kBytesPerPixel; ++b) {
-		if (abs((int)pa[b] - (int)pb[b]) > motionThreshold) {
-			ret = true;
-			break;
-		}
+bool MotionExtractor::pixelIsDifferent(const uint8_t* __restrict pa,
+                                       const uint8_t* __restrict pb)
+{
+	// Check every channel instead of stopping at the first that differs.
+	// With the channel count fixed at compile time, this unrolls into straight-line code with no branches.
+	int ret = 0;
+	for (size_t b = 0; b < kBytesPerPixel; ++b)
+		ret |= abs((int)pa[b] - (int)pb[b]) > motionThreshold;
+	return ret != 0;
+}
+
+/// Returns true if the two pixels differ by more than their per-channel thresholds
+bool MotionExtractor::pixelIsDifferent(const uint8_t* __restrict pa,
+                                       const uint8_t* __restrict pb,
+                                       const uint8_t* __restrict thresholds)
+{
+	int ret = 0;
+	for (size_t b = 0; b < kBytesPerPixel; ++b)
+		ret |= abs((int)pa[b] - (int)pb[b]) > (int)thresholds[b];
+	return ret != 0;
+}
+
+vector<size_t> MotionExtractor::getMemoryPlacement() const
+{
+	return Affinity::getPagesPerNode(arena, arenaSize);
+}
+
+void MotionExtractor::updateNoiseThresholds(const uint8_t* tip, size_t first, size_t count)
+{
+	const size_t offset = first * kBytesPerPixel;
+	const size_t size = count * kBytesPerPixel;
+	const uint8_t* cip = currentImage->getPixels() + offset;
+	uint16_t* dev = noiseDeviations.data() + offset;
+	uint8_t* thr = adaptiveThresholds.data() + offset;
+	size_t i = 0;
+
+	// Each sample is the difference between the new frame and the current image. Channels that differ by more than
+	// their threshold are moving, and are left out: clamping them to the threshold instead would still feed back
+	// noiseMultiplier * kDeviationToSigma (> 1) times the estimate, so a busy scene would inflate it without bound.
+	// Thresholds are then max(motionThreshold, noiseMultiplier * sigma), computed as the high half of dev * noiseScale.
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i scale = _mm_set1_epi16((short)noiseScale);
+	const __m128i minThreshold = _mm_set1_epi8((char)motionThreshold);
+	for (; i + 16 <= size; i += 16) {
+		const __m128i a = _mm_loadu_si128((const __m128i*)(tip + i));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(cip + i));
+		const __m128i t = _mm_loadu_si128((const __m128i*)(thr + i));
+		const __m128i d = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+		// 0xFF where d <= t
+		const __m128i still = _mm_cmpeq_epi8(_mm_min_epu8(d, t), d);
+
+		const __m128i dLo = _mm_slli_epi16(_mm_unpacklo_epi8(d, zero), kNoiseFractionBits);
+		const __m128i dHi = _mm_slli_epi16(_mm_unpackhi_epi8(d, zero), kNoiseFractionBits);
+		__m128i devLo = _mm_loadu_si128((const __m128i*)(dev + i));
+		__m128i devHi = _mm_loadu_si128((const __m128i*)(dev + i + 8));
+		const __m128i stepLo = _mm_srai_epi16(_mm_sub_epi16(dLo, devLo), kNoiseRate);
+		const __m128i stepHi = _mm_srai_epi16(_mm_sub_epi16(dHi, devHi), kNoiseRate);
+		devLo = _mm_add_epi16(devLo, _mm_and_si128(stepLo, _mm_unpacklo_epi8(still, still)));
+		devHi = _mm_add_epi16(devHi, _mm_and_si128(stepHi, _mm_unpackhi_epi8(still, still)));
+		_mm_storeu_si128((__m128i*)(dev + i), devLo);
+		_mm_storeu_si128((__m128i*)(dev + i + 8), devHi);
+
+		const __m128i thresholds = _mm_packus_epi16(_mm_mulhi_epu16(devLo, scale), _mm_mulhi_epu16(devHi, scale));
+		_mm_storeu_si128((__m128i*)(thr + i), _mm_max_epu8(thresholds, minThreshold));
+	}
+#endif
+	// Scalar version for the remainder (or everything, if SSE2 isn't available)
+	for (; i < size; ++i) {
+		const int d = abs((int)tip[i] - (int)cip[i]);
+		if (d <= (int)thr[i])
+			dev[i] = (uint16_t)(dev[i] + (((d << kNoiseFractionBits) - (int)dev[i]) >> kNoiseRate));
+		const int t = ((int)dev[i] * noiseScale) >> 16;
+		thr[i] = (uint8_t)Math::clamp(t, motionThreshold, 255);
 	}
-	return ret;
 }
 
 VideoFrame& MotionExtractor::generateMotionMask(const VideoFrame& frame)
@@ -106,13 +523,50 @@ VideoFrame& MotionExtractor::generateMotionMask(const VideoFrame& frame)
 		++framesCounted;
 	}
 
-	// Downscale the current image into a temporary buffer
-	downscale(frame, *downscaleBuff);
+	checkInput(frame);
+
+	// Bring the frame to the analysis resolution (a band of rows at a time in low-memory mode)
+	// and fold it into the current image
+	const uint8_t* tip = nullptr;
+	for (size_t y = 0; y < imageHeight; y += bandRows) {
+		const size_t rows = min(bandRows, imageHeight - y);
+		tip = prepareBand(frame, y, rows);
+		const size_t first = y * imageWidth;
+		const size_t count = rows * imageWidth;
+
+		if (coarse != nullptr)
+			shrinkBand(tip, y, rows);
+
+		// The first frame is copied to the reference image to avoid the formation of a screen-wide delta for one frame.
+		if (firstFrame) {
+			memcpy(currentImage->getPixels() + first * kBytesPerPixel, tip, count * kBytesPerPixel);
+			memcpy(refImage->getPixels() + first * kBytesPerPixel, tip, count * kBytesPerPixel);
+			continue;
+		}
+
+		if (illuminationCompensation)
+			sumBrightness(tip, y, rows);
+
+		if (shakeCompensation)
+			projectBand(tip, y, rows);
+
+		if (noiseAdaptive)
+			updateNoiseThresholds(tip, first, count);
+
+		// With coarse-to-fine detection, the current image is only updated once the coarse level has been checked
+		if (coarse == nullptr)
+			(this->*trackKernel)(tip, first, count);
+	}
+
+	if (coarse != nullptr) {
+		coarse->generateMotionMask(*coarseFrame);
+		if (!firstFrame) {
+			selectRefinedTiles();
+			trackRefinedTiles(frame, tip);
+		}
+	}
 
-	// The first frame is copied to the reference image to avoid the formation of a screen-wide delta for one frame.
 	if (firstFrame) {
-		memcpy(currentImage->getPixels(), downscaleBuff->getPixels(), imageSize);
-		memcpy(refImage->getPixels(), downscaleBuff->getPixels(), imageSize);
 		firstFrame = false;
 		// No motion on the first frame. Wipe the motion channel (0)
 		uint8_t* mask = motionMask->getPixels();
@@ -120,18 +574,115 @@ VideoFrame& MotionExtractor::generateMotionMask(const VideoFrame& frame)
 		for (; mask < mEnd; mask += motionMask->getBytesPerPixel()) {
 			mask[0] = 0;
 		}
+		fill(tileDirty.begin(), tileDirty.end(), 0);
+		updateMotionTiles();
+		if (!maskIntegral.empty())
+			updateMaskIntegral();
+		updateTripwires();
+		updateStaticState();
 		return *motionMask;
 	}
 
+	if (illuminationCompensation)
+		compensateIllumination();
+
+	if (shakeCompensation)
+		estimateShake();
+
+	(this->*(shakeOffset.x != 0 || shakeOffset.y != 0 ? shiftedDetectKernel : detectKernel))();
+
+	updateMotionTiles();
+	if (!maskIntegral.empty())
+		updateMaskIntegral();
+	updateTripwires();
+	updateStaticState();
+	return *motionMask;
+}
+
+void MotionExtractor::sumBrightness(const uint8_t* tip, size_t y, size_t rows)
+{
+	const uint8_t* rip = refImage->getPixels() + y * destLineSize;
+	for (size_t row = 0; row < rows; ++row, tip += destLineSize, rip += destLineSize) {
+		const size_t tileRow = ((y + row) / kTileSize) * tilesWide;
+		for (size_t tx = 0; tx < tilesWide; ++tx) {
+			const size_t x = tx * kTileSize;
+			const size_t bytes = (min(x + kTileSize, imageWidth) - x) * kBytesPerPixel;
+			tileFrameSums[tileRow + tx] += sumBytes(tip + x * kBytesPerPixel, bytes);
+			tileStaticSums[tileRow + tx] += sumBytes(rip + x * kBytesPerPixel, bytes);
+		}
+	}
+}
+
+void MotionExtractor::compensateIllumination()
+{
+	const uint64_t frameSum = accumulate(tileFrameSums.begin(), tileFrameSums.end(), (uint64_t)0);
+	const uint64_t staticSum = accumulate(tileStaticSums.begin(), tileStaticSums.end(), (uint64_t)0);
+	illuminationGain = staticSum > 0 ? (double)frameSum / staticSum : 1;
+
+	// Even a slow change is followed every frame, so that the static image never falls far behind the lighting.
+	// Only once the lighting has changed by more than the threshold since the last reported change is it reported.
+	const bool rescale = abs(illuminationGain - 1) > kIlluminationDeadBand;
+	if (rescale)
+		illuminationDrift *= illuminationGain;
+	illuminationChanged = abs(illuminationDrift - 1) > illuminationThreshold;
+	if (illuminationChanged) {
+		illuminationChangeGain = illuminationDrift;
+		illuminationDrift = 1;
+	}
+
+	if (rescale) {
+		for (size_t t = 0; t < tileFrameSums.size(); ++t) {
+			double gain = tileStaticSums[t] > 0 ? (double)tileFrameSums[t] / tileStaticSums[t] : illuminationGain;
+			if (abs(gain / illuminationGain - 1) > kTileGainSpread)
+				gain = illuminationGain;
+
+			// Rescale in 8.8 fixed point
+			const unsigned int scale = (unsigned int)lround(gain * 256);
+			const PixelRect r = tileRect(t);
+			int largestChange = 0;
+			for (size_t y = r.y; y < r.y + r.height; ++y) {
+				uint8_t* rip = refImage->getPixel(r.x, y);
+				uint8_t* rowEnd = rip + r.width * kBytesPerPixel;
+				for (; rip < rowEnd; ++rip) {
+					const uint8_t scaled = (uint8_t)min((*rip * scale + 128) >> 8, 255u);
+					largestChange = max(largestChange, abs((int)scaled - (int)*rip));
+					*rip = scaled;
+				}
+				// The current image lags the lighting just as much, except where it was just replaced by the frame
+				uint8_t* cip = currentImage->getPixel(r.x, y);
+				const unsigned int* currentTime = currentStableTimes + y * imageWidth + r.x;
+				for (size_t x = 0; x < r.width; ++x, cip += kBytesPerPixel, ++currentTime) {
+					if (*currentTime == 0)
+						continue;
+					for (size_t b = 0; b < kBytesPerPixel; ++b)
+						cip[b] = (uint8_t)min((cip[b] * scale + 128) >> 8, 255u);
+				}
+			}
+			if (staticTracking && largestChange > staticTolerance)
+				tileStaticChanged[t] = 1;
+		}
+		// A small rescale is left for the static pyramid to pick up in its own time
+		if (illuminationChanged)
+			staticReplaced = true;
+	}
+
+	fill(tileFrameSums.begin(), tileFrameSums.end(), 0);
+	fill(tileStaticSums.begin(), tileStaticSums.end(), 0);
+}
+
+template <MotionExtractor::Switch Adaptive>
+void MotionExtractor::trackChanges(const uint8_t* tip, size_t first, size_t count)
+{
+	const bool adaptive = isOn(Adaptive, noiseAdaptive);
+
 	// See if the current image has changed significantly
-	unsigned int* currentTime = currentStableTimes.data();
-	uint8_t* tip = downscaleBuff->getPixels();
-	uint8_t* bmp = motionMask->getPixels();
-	uint8_t* cip = currentImage->getPixels();
-	uint8_t* currEnd = cip + imageSize;
+	unsigned int* currentTime = currentStableTimes + first;
+	uint8_t* cip = currentImage->getPixels() + first * kBytesPerPixel;
+	uint8_t* currEnd = cip + count * kBytesPerPixel;
+	const uint8_t* thp = adaptiveThresholds.data() + (adaptive ? first * kBytesPerPixel : 0);
 	for (; cip < currEnd; cip += kBytesPerPixel, tip += kBytesPerPixel,
-	        bmp += kBytesPerPixel, ++currentTime) {
-		if (pixelIsDifferent(tip, cip)) {
+	        ++currentTime, thp += kBytesPerPixel) {
+		if (adaptive ? pixelIsDifferent(tip, cip, thp) : pixelIsDifferent(tip, cip)) {
 			*currentTime = 0;
 			memcpy(cip, tip, kBytesPerPixel);
 		}
@@ -143,154 +694,670 @@ VideoFrame& MotionExtractor::generateMotionMask(const VideoFrame& frame)
 			}
 		}
 	}
+}
 
-	// If the current pixel has set a new stability record or is close to the
-	// background pixel, copy it over. Also light up our blob map.
-	currentTime = currentStableTimes.data();
-	unsigned int* record = stableRecords;
-	uint8_t* rip = refImage->getPixels();
-	bmp = motionMask->getPixels();
-	cip = currentImage->getPixels();
-	for (; cip < currEnd; cip += kBytesPerPixel, rip += kBytesPerPixel,
-	        bmp += kBytesPerPixel, ++currentTime, ++record) {
-		if (*currentTime > *record) {
-			memcpy(rip, cip, kBytesPerPixel);
-			*record = min(*currentTime, stableCap);
+void MotionExtractor::projectBand(const uint8_t* tip, size_t y, size_t rows)
+{
+	const uint8_t* rip = refImage->getPixels() + y * destLineSize;
+	uint32_t* frameColumns = frameColumnSums.data();
+	uint32_t* staticColumns = staticColumnSums.data();
+	for (size_t row = y; row < y + rows; ++row, tip += destLineSize, rip += destLineSize) {
+		frameRowSums[row] = sumBytes(tip, destLineSize);
+		staticRowSums[row] = sumBytes(rip, destLineSize);
+		for (size_t x = 0; x < imageWidth; ++x) {
+			const uint8_t* tp = tip + x * kBytesPerPixel;
+			const uint8_t* rp = rip + x * kBytesPerPixel;
+			frameColumns[x] += tp[0] + tp[1] + tp[2];
+			staticColumns[x] += rp[0] + rp[1] + rp[2];
 		}
-		// If the reference image pixel is significantly different from the current image pixel,
-		// the pixel is considered to be moving
-		/// \todo Optimize by removing branching?
-		if (pixelIsDifferent(rip, cip))
-			bmp[0] = 255;
+	}
+}
+
+void MotionExtractor::estimateShake()
+{
+	const int dx = bestShift(frameColumnSums, staticColumnSums, maxShake);
+	const int dy = bestShift(frameRowSums, staticRowSums, maxShake);
+	const bool held = (dx != 0 || dy != 0) && dx == shakeOffset.x && dy == shakeOffset.y;
+	shakeHeldFrames = held ? shakeHeldFrames + 1 : 0;
+	shakeOffset = PixelOffset(dx, dy, (dy * (int)imageWidth + dx) * (int)kBytesPerPixel);
+
+	fill(frameColumnSums.begin(), frameColumnSums.end(), 0);
+	fill(staticColumnSums.begin(), staticColumnSums.end(), 0);
+
+	// The static image isn't updated while shifted, so if the camera has come to rest somewhere new,
+	// move the static image to match instead of waiting forever for the camera to come back
+	if (shakeHeldFrames >= stableCap)
+		realignStatic();
+}
+
+void MotionExtractor::realignStatic()
+{
+	shiftImage(refImage->getPixels(), imageWidth, imageHeight, kBytesPerPixel, shakeOffset.x, shakeOffset.y);
+	shiftImage(stableRecords, imageWidth, imageHeight, 1, shakeOffset.x, shakeOffset.y);
+	shakeOffset = PixelOffset(0, 0, 0);
+	shakeHeldFrames = 0;
+	staticReplaced = true;
+}
+
+template <MotionExtractor::Switch Adaptive, MotionExtractor::Switch Shifted, MotionExtractor::Switch Erode>
+void MotionExtractor::detectMotion()
+{
+	const bool adaptive = isOn(Adaptive, noiseAdaptive);
+	const bool shifted = isOn(Shifted, shakeOffset.x != 0 || shakeOffset.y != 0);
+
+	// If the current pixel has set a new stability record or is close to the
+	// background pixel, copy it over. Also light up our blob map, noting which tiles have motion.
+	fill(tileDirty.begin(), tileDirty.end(), 0);
+	for (size_t y = 0; y < imageHeight; ++y) {
+		uint8_t* rowTiles = &tileDirty[(y / kTileSize) * tilesWide];
+		uint8_t* changedTiles = staticTracking ? &tileStaticChanged[(y / kTileSize) * tilesWide] : nullptr;
+		// When shifted, pixels whose match falls off the edge are compared with the nearest edge pixel
+		const uint8_t* shiftedRow = shifted
+			? refImage->getPixels() + Math::clamp((int)y + shakeOffset.y, 0, (int)imageHeight - 1) * destLineSize
+			: nullptr;
+
+		// Detects motion in the pixels of the row from begin to end
+		const auto detectRun = [&](size_t begin, size_t end) {
+			const size_t first = y * imageWidth + begin;
+			const unsigned int* currentTime = currentStableTimes + first;
+			unsigned int* record = stableRecords + first;
+			uint8_t* rip = refImage->getPixels() + first * kBytesPerPixel;
+			uint8_t* bmp = motionMask->getPixels() + first * kBytesPerPixel;
+			const uint8_t* cip = currentImage->getPixels() + first * kBytesPerPixel;
+			const uint8_t* thp = adaptiveThresholds.data() + (adaptive ? first * kBytesPerPixel : 0);
+			for (size_t x = begin; x < end; ++x, cip += kBytesPerPixel, rip += kBytesPerPixel,
+			        bmp += kBytesPerPixel, ++currentTime, ++record, thp += kBytesPerPixel) {
+				// While the camera is shaken, the current image is a blend of frames from different positions,
+				// so copying it into the static image (at either position) would smear the static image.
+				// The static image waits until the camera is back in line with it.
+				if (!shifted && *currentTime > *record) {
+					if (changedTiles != nullptr && exceedsTolerance(rip, cip, kBytesPerPixel, staticTolerance))
+						changedTiles[x / kTileSize] = 1;
+					memcpy(rip, cip, kBytesPerPixel);
+					*record = min(*currentTime, stableCap);
+				}
+				const uint8_t* sip = shifted
+					? shiftedRow + Math::clamp((int)x + shakeOffset.x, 0, (int)imageWidth - 1) * kBytesPerPixel
+					: rip;
+				// If the reference image pixel is significantly different from the current image pixel,
+				// the pixel is considered to be moving
+				if (adaptive ? pixelIsDifferent(sip, cip, thp) : pixelIsDifferent(sip, cip)) {
+					bmp[0] = 255;
+					rowTiles[x / kTileSize] = 1;
+				}
+				else {
+					bmp[0] = 0;
+				}
+			}
+		};
+
+		if (tileRefined.empty())
+			detectRun(0, imageWidth);
 		else
-			bmp[0] = 0;
-	}
-
-	// Erosion pass
-	if (erosionLevel > 0) {
-		int x = 0;
-		int y = 0;
-		uint8_t* eroded = erodedMask->getPixels();
-		uint8_t* bEnd = motionMask->getPixels() + motionMask->getTotalSize();
-		for (bmp = motionMask->getPixels(); bmp < bEnd; bmp += kBytesPerPixel, eroded += kBytesPerPixel) {
-			// If the current pixel is "moving"
-			if (bmp[0] > 0) {
-				// Find the number of adjacent moving pixels
-				int adjacents = 0;
-				for (auto it = offs.begin(); it != offs.end(); ++it) {
-					if (x + it->x > 0 &&
-						y + it->y > 0 &&
-						(bmp + it->p)[0] > 0)
-						++adjacents;
+			forEachTileRun(&tileRefined[(y / kTileSize) * tilesWide], tilesWide, imageWidth, detectRun);
+	}
+
+	if (isOn(Erode, erosionLevel > 0))
+		erodeMotion();
+}
+
+void MotionExtractor::shrinkBand(const uint8_t* tip, size_t y, size_t rows)
+{
+	const size_t f = coarseFactor;
+	const size_t coarseWidth = coarseFrame->getWidth();
+	const size_t coarseLineSize = coarseWidth * kBytesPerPixel;
+	// Rows past the last whole coarse row are dropped, like the right and bottom edges of downscaled frames
+	const size_t end = min((y + rows) / f, coarseFrame->getHeight());
+	for (size_t cy = y / f; cy < end; ++cy) {
+		fill(coarseSums.begin(), coarseSums.end(), 0);
+		const uint8_t* srcRow = tip + (cy * f - y) * destLineSize;
+		for (size_t r = 0; r < f; ++r, srcRow += destLineSize) {
+			const uint8_t* sp = srcRow;
+			uint16_t* sum = coarseSums.data();
+			for (size_t x = 0; x < coarseWidth; ++x, sum += kBytesPerPixel) {
+				for (size_t p = 0; p < f; ++p, sp += kBytesPerPixel) {
+					for (size_t c = 0; c < kBytesPerPixel; ++c)
+						sum[c] += sp[c];
 				}
-				if (adjacents >= erosionLevel)
-					eroded[0] = bmp[0];
-				else
-					eroded[0] = 0;
 			}
-			else {
-				eroded[0] = 0;
+		}
+
+		uint8_t* dp = coarseFrame->getPixel(0, cy);
+		for (size_t i = 0; i < coarseLineSize; ++i)
+			dp[i] = (uint8_t)(coarseSums[i] / (f * f));
+	}
+}
+
+void MotionExtractor::configureCoarse()
+{
+	// The coarse level has no need for erosion: reducing the frame averages most noise away,
+	// and eroding would erase small objects the refined tiles should catch
+	coarse->motionThreshold = motionThreshold;
+	coarse->stableCap = stableCap;
+	coarse->erosionLevel = 0;
+	coarse->genericKernels = genericKernels;
+	coarse->selectKernels();
+	if (coarse->noiseAdaptive != noiseAdaptive)
+		coarse->setNoiseAdaptive(noiseAdaptive);
+	coarse->setNoiseMultiplier(noiseMultiplier);
+	if (coarse->illuminationCompensation != illuminationCompensation)
+		coarse->setIlluminationCompensation(illuminationCompensation);
+	coarse->illuminationThreshold = illuminationThreshold;
+}
+
+void MotionExtractor::selectRefinedTiles()
+{
+	// Mark the tiles under the coarse level's moving pixels. Each coarse pixel lies within one tile.
+	fill(tileScratch.begin(), tileScratch.end(), 0);
+	const VideoFrame& coarseMask = coarse->getMotionMask();
+	for (const PixelRect& r : coarse->getMotionTiles()) {
+		for (size_t cy = r.y; cy < r.y + r.height; ++cy) {
+			const uint8_t* mp = coarseMask.getPixel(r.x, cy);
+			uint8_t* rowTiles = &tileScratch[min(cy * coarseFactor / kTileSize, tilesHigh - 1) * tilesWide];
+			for (size_t cx = r.x; cx < r.x + r.width; ++cx, mp += kBytesPerPixel) {
+				if (mp[0] != 0)
+					rowTiles[min(cx * coarseFactor / kTileSize, tilesWide - 1)] = 1;
 			}
-			eroded[1] = bmp[1];
-			eroded[2] = bmp[2];
+		}
+	}
 
-			if (++x == (int)motionMask->getWidth()) {
-				++y;
-				x = 0;
+	// Refine those tiles and their neighbors, since the edges of moving objects blur into the background
+	// at the coarse level, plus this frame's rows of tiles to refresh
+	refinedTiles = 0;
+	for (size_t ty = 0; ty < tilesHigh; ++ty) {
+		const bool refresh = ty % kCoarseRefreshPeriod == refreshPhase;
+		for (size_t tx = 0; tx < tilesWide; ++tx) {
+			bool refine = refresh;
+			for (size_t ny = (ty > 0 ? ty - 1 : 0); ny <= min(ty + 1, tilesHigh - 1) && !refine; ++ny) {
+				for (size_t nx = (tx > 0 ? tx - 1 : 0); nx <= min(tx + 1, tilesWide - 1) && !refine; ++nx)
+					refine = tileScratch[ny * tilesWide + nx] != 0;
 			}
+			tileRefined[ty * tilesWide + tx] = refine ? 1 : 0;
+			refinedTiles += refine;
+			if (!refine)
+				++tileSkippedFrames[ty * tilesWide + tx];
 		}
-		*motionMask = *erodedMask;
-
-		x = 0;
-		y = 0;
-		eroded = erodedMask->getPixels();
-		for (bmp = motionMask->getPixels(); bmp < bEnd; bmp += kBytesPerPixel, eroded += kBytesPerPixel) {
-			// Any pixel that is either on itself or has neighbors that are on is turned on
-			if (bmp[0] > 0) {
-				eroded[0] = bmp[0];
+	}
+	refreshPhase = (refreshPhase + 1) % kCoarseRefreshPeriod;
+
+	// Detection won't visit the other tiles, so wipe the motion they had in the last frame
+	for (size_t t = 0; t < tileDirty.size(); ++t) {
+		if (!tileDirty[t] || tileRefined[t])
+			continue;
+
+		const PixelRect r = tileRect(t);
+		for (size_t y = r.y; y < r.y + r.height; ++y) {
+			uint8_t* bmp = motionMask->getPixel(r.x, y);
+			for (size_t x = 0; x < r.width; ++x, bmp += kBytesPerPixel)
+				bmp[0] = 0;
+		}
+	}
+}
+
+void MotionExtractor::trackRefinedTiles(const VideoFrame& frame, const uint8_t* tip)
+{
+	for (size_t y = 0; y < imageHeight; y += bandRows) {
+		const size_t rows = min(bandRows, imageHeight - y);
+		const uint8_t* bandTiles = &tileRefined[(y / kTileSize) * tilesWide];
+		const uint8_t* bandEnd = &tileRefined[0] + ((y + rows - 1) / kTileSize + 1) * tilesWide;
+		if (none_of(bandTiles, bandEnd, [](uint8_t t) { return t != 0; }))
+			continue;
+
+		// In low-memory mode, the band has been overwritten since, so bring it to the analysis resolution again.
+		// Bands are a row of tiles, so rows without refined tiles aren't downscaled twice.
+		const uint8_t* band = rows == imageHeight ? tip : prepareBand(frame, y, rows);
+		for (size_t row = 0; row < rows; ++row) {
+			const size_t first = (y + row) * imageWidth;
+			const uint8_t* rowTip = band + row * destLineSize;
+			const size_t tileRow = ((y + row) / kTileSize) * tilesWide;
+			forEachTileRun(&tileRefined[tileRow], tilesWide, imageWidth, [&](size_t begin, size_t end) {
+				(this->*trackKernel)(rowTip + begin * kBytesPerPixel, first + begin, end - begin);
+
+				// A tile that was skipped was only skipped because the coarse level saw nothing change in it,
+				// so the pixels that still match have been stable for the skipped frames too
+				for (size_t x = begin; x < end; x += kTileSize) {
+					const unsigned int skipped = tileSkippedFrames[tileRow + x / kTileSize];
+					if (skipped == 0)
+						continue;
+
+					unsigned int* currentTime = currentStableTimes + first + x;
+					unsigned int* timeEnd = currentTime + (min(x + kTileSize, end) - x);
+					for (; currentTime < timeEnd; ++currentTime) {
+						if (*currentTime != 0)
+							*currentTime += skipped;
+					}
+				}
+			});
+		}
+	}
+
+	for (size_t t = 0; t < tileRefined.size(); ++t) {
+		if (tileRefined[t])
+			tileSkippedFrames[t] = 0;
+	}
+}
+
+void MotionExtractor::erodeMotion()
+{
+	// Tiles without motion stay empty when eroded, so they are skipped entirely
+	if (!any_of(tileDirty.begin(), tileDirty.end(), [](uint8_t d) { return d != 0; }))
+		return;
+
+	erodeTiles<false>(tileDirty);
+
+	// Dilation can spill over into neighboring tiles, so grow the set of tiles to visit by one
+	fill(tileScratch.begin(), tileScratch.end(), 0);
+	for (size_t ty = 0; ty < tilesHigh; ++ty) {
+		for (size_t tx = 0; tx < tilesWide; ++tx) {
+			if (!tileDirty[ty * tilesWide + tx])
+				continue;
+
+			for (size_t ny = (ty > 0 ? ty - 1 : 0); ny <= min(ty + 1, tilesHigh - 1); ++ny) {
+				for (size_t nx = (tx > 0 ? tx - 1 : 0); nx <= min(tx + 1, tilesWide - 1); ++nx)
+					tileScratch[ny * tilesWide + nx] = 1;
 			}
-			else {
-				bool activeNeighbors = false;
-				for (auto it = offs.begin(); it != offs.end(); ++it) {
-					if (x + it->x > 0 &&
-						y + it->y > 0 &&
-						(bmp + it->p)[0] > 0) {
-						activeNeighbors = true;
-						break;
+		}
+	}
+	erodeTiles<true>(tileScratch);
+}
+
+template <bool Dilate>
+void MotionExtractor::erodeTiles(const pmr::vector<uint8_t>& tiles)
+{
+	const int w = (int)imageWidth;
+	const int h = (int)imageHeight;
+	const int po = (int)kBytesPerPixel; // One pixel's worth of offset
+	const int line = w * po; // One row's worth of offset
+	uint8_t* mask = motionMask->getPixels();
+
+	// Erodes or dilates the motion channel of one row of the given tiles into a staging row
+	const auto erodeRow = [&](int y, const uint8_t* rowTiles, uint8_t* staged) {
+		// Neighbors are only counted if they are inside the mask.
+		// Away from its edges, all eight neighbors can be counted without any checks.
+		const bool interiorRow = y >= 1 && y <= h - 2;
+		for (size_t tx = 0; tx < tilesWide; ++tx) {
+			if (!rowTiles[tx])
+				continue;
+
+			const int tileEnd = min((int)((tx + 1) * kTileSize), w);
+			int x = (int)(tx * kTileSize);
+			const uint8_t* bmp = mask + (y * w + x) * po;
+			for (; x < tileEnd; ++x, bmp += po) {
+				// Pixels only turn off when eroding, and only turn on when dilating
+				if ((bmp[0] > 0) == Dilate) {
+					staged[x] = bmp[0];
+					continue;
+				}
+
+				int adjacents = 0;
+				if (interiorRow && x >= 1 && x <= w - 2) {
+					adjacents = (bmp[-line - po] > 0) + (bmp[-line] > 0) + (bmp[-line + po] > 0) +
+					            (bmp[-po] > 0) + (bmp[po] > 0) +
+					            (bmp[line - po] > 0) + (bmp[line] > 0) + (bmp[line + po] > 0);
+				}
+				else {
+					for (auto it = offs.begin(); it != offs.end(); ++it) {
+						if (x + it->x >= 0 &&
+						    x + it->x < w &&
+						    y + it->y >= 0 &&
+						    y + it->y < h &&
+						    (bmp + it->p)[0] > 0)
+							++adjacents;
 					}
 				}
-				eroded[0] = activeNeighbors ? 255 : 0;
+
+				// When eroding, moving pixels need erosionLevel moving neighbors to survive.
+				// When dilating, any pixel with a moving neighbor is turned on.
+				if (Dilate)
+					staged[x] = adjacents > 0 ? 255 : 0;
+				else
+					staged[x] = adjacents >= erosionLevel ? bmp[0] : 0;
 			}
-			eroded[1] = bmp[1];
-			eroded[2] = bmp[2];
+		}
+	};
+
+	// Copies a staging row back into the motion channel (leaving the user channels alone),
+	// noting which tiles still have motion
+	const auto writeBackRow = [&](int y, const uint8_t* rowTiles, uint8_t* rowMotion, const uint8_t* staged) {
+		for (size_t tx = 0; tx < tilesWide; ++tx) {
+			if (!rowTiles[tx])
+				continue;
 
-			if (++x == (int)motionMask->getWidth()) {
-				++y;
-				x = 0;
+			const size_t tileEnd = min((tx + 1) * kTileSize, imageWidth);
+			size_t x = tx * kTileSize;
+			uint8_t* bmp = mask + (y * imageWidth + x) * kBytesPerPixel;
+			uint8_t any = 0;
+			for (; x < tileEnd; ++x, bmp += kBytesPerPixel) {
+				bmp[0] = staged[x];
+				any |= staged[x];
 			}
+			rowMotion[tx] |= any;
 		}
-		*motionMask = *erodedMask;
+	};
+
+	// Eroding a row reads the rows above and below it, so each row is only written back
+	// once the row below it has been eroded. Rows alternate between the two staging rows.
+	fill(tileMotion.begin(), tileMotion.end(), 0);
+	bool active = false; // True if the current row of tiles has any tiles to visit
+	bool pending = false; // True if the previous row has been eroded but not written back
+	for (int y = 0; y < h; ++y) {
+		const size_t tileRow = (y / kTileSize) * tilesWide;
+		if (y % kTileSize == 0)
+			active = any_of(&tiles[tileRow], &tiles[tileRow] + tilesWide, [](uint8_t t) { return t != 0; });
+
+		if (active)
+			erodeRow(y, &tiles[tileRow], erosionRows + (y & 1) * w);
+
+		if (pending) {
+			const size_t previousRow = ((y - 1) / kTileSize) * tilesWide;
+			writeBackRow(y - 1, &tiles[previousRow], &tileMotion[previousRow], erosionRows + ((y - 1) & 1) * w);
+		}
+		pending = active;
 	}
-	return *motionMask;
+	if (pending) {
+		const size_t lastRow = ((h - 1) / kTileSize) * tilesWide;
+		writeBackRow(h - 1, &tiles[lastRow], &tileMotion[lastRow], erosionRows + ((h - 1) & 1) * w);
+	}
+
+	// Re-mark which of the visited tiles still have motion
+	for (size_t t = 0; t < tiles.size(); ++t) {
+		if (tiles[t])
+			tileDirty[t] = tileMotion[t] != 0 ? 1 : 0;
+	}
+}
+
+void MotionExtractor::updateMotionTiles()
+{
+	dirtyTiles.clear();
+	size_t left = imageWidth, top = imageHeight, right = 0, bottom = 0;
+	for (size_t t = 0; t < tileDirty.size(); ++t) {
+		if (!tileDirty[t])
+			continue;
+
+		const PixelRect r = tileRect(t);
+		dirtyTiles.push_back(r);
+		left = min(left, r.x);
+		top = min(top, r.y);
+		right = max(right, r.x + r.width);
+		bottom = max(bottom, r.y + r.height);
+	}
+
+	if (dirtyTiles.empty())
+		motionBounds = PixelRect();
+	else
+		motionBounds = PixelRect(left, top, right - left, bottom - top);
+}
+
+void MotionExtractor::updateMaskIntegral()
+{
+	// Built after erosion, since erosion changes the mask. Within tiles without motion
+	// the running row count doesn't change, so only the tiles with motion are read.
+	const size_t stride = imageWidth + 1;
+	const uint8_t* mask = motionMask->getPixels();
+	uint32_t* row = maskIntegral.data() + stride;
+	bool active = false;
+	for (size_t y = 0; y < imageHeight; ++y, row += stride) {
+		const uint32_t* above = row - stride;
+		const uint8_t* rowTiles = &tileDirty[(y / kTileSize) * tilesWide];
+		if (y % kTileSize == 0)
+			active = any_of(rowTiles, rowTiles + tilesWide, [](uint8_t d) { return d != 0; });
+
+		if (!active) {
+			memcpy(row, above, stride * sizeof(uint32_t));
+			continue;
+		}
+
+		uint32_t running = 0;
+		for (size_t tx = 0; tx < tilesWide; ++tx) {
+			const size_t tileEnd = min((tx + 1) * kTileSize, imageWidth);
+			size_t x = tx * kTileSize;
+			if (rowTiles[tx]) {
+				const uint8_t* bmp = mask + (y * imageWidth + x) * kBytesPerPixel;
+				for (; x < tileEnd; ++x, bmp += kBytesPerPixel) {
+					running += bmp[0] != 0;
+					row[x + 1] = above[x + 1] + running;
+				}
+			}
+			else {
+				for (; x < tileEnd; ++x)
+					row[x + 1] = above[x + 1] + running;
+			}
+		}
+	}
+}
+
+void MotionExtractor::updateTripwires()
+{
+	const uint8_t* mask = motionMask->getPixels();
+	for (Tripwire& wire : tripwires)
+		wire.update(mask);
+}
+
+uint32_t MotionExtractor::addTripwire(const PixelPoint& from, const PixelPoint& to, int gap, uint32_t minPixels)
+{
+	tripwires.emplace_back(from, to, imageWidth, imageHeight, kBytesPerPixel, gap, minPixels);
+	return (uint32_t)(tripwires.size() - 1);
+}
+
+void MotionExtractor::clearTripwires()
+{
+	tripwires.clear();
+}
+
+uint32_t MotionExtractor::countMoving(const PixelRect& r) const
+{
+	if (maskIntegral.empty())
+		throw Exceptions::InvalidOperationException("The mask integral isn't enabled", __FUNCTION__);
+
+	const size_t stride = imageWidth + 1;
+	const size_t left = min(r.x, imageWidth);
+	const size_t top = min(r.y, imageHeight);
+	const size_t right = min(r.x + r.width, imageWidth);
+	const size_t bottom = min(r.y + r.height, imageHeight);
+	const uint32_t* integral = maskIntegral.data();
+	return integral[bottom * stride + right] - integral[top * stride + right]
+	       - integral[bottom * stride + left] + integral[top * stride + left];
+}
+
+void MotionExtractor::updateStaticState()
+{
+	++staticGeneration;
+
+	if (staticTracking)
+		updateStaticChanges();
+
+	if (!staticPyramid.empty() && (staticReplaced || --pyramidCountdown == 0)) {
+		rebuildStaticPyramid();
+		pyramidCountdown = pyramidInterval;
+		pyramidGeneration = staticGeneration;
+	}
+
+	staticReplaced = false;
+}
+
+void MotionExtractor::updateStaticChanges()
+{
+	for (size_t t = 0; t < tileGenerations.size(); ++t) {
+		if (staticReplaced || tileStaticChanged[t])
+			tileGenerations[t] = staticGeneration;
+	}
+	fill(tileStaticChanged.begin(), tileStaticChanged.end(), 0);
+}
+
+void MotionExtractor::rebuildStaticPyramid()
+{
+	halve(*refImage, *staticPyramid[0]);
+	for (size_t level = 1; level < staticPyramid.size(); ++level)
+		halve(*staticPyramid[level - 1], *staticPyramid[level]);
+}
+
+uint64_t MotionExtractor::getStaticImageChanges(uint64_t since, vector<PixelRect>& tiles) const
+{
+	if (!staticTracking)
+		throw Exceptions::InvalidOperationException("Static image tracking isn't enabled", __FUNCTION__);
+
+	tiles.clear();
+	for (size_t t = 0; t < tileGenerations.size(); ++t) {
+		if (tileGenerations[t] > since)
+			tiles.push_back(tileRect(t));
+	}
+	return staticGeneration;
+}
+
+const VideoFrame& MotionExtractor::getStaticPyramidLevel(size_t level) const
+{
+	if (level >= staticPyramid.size())
+		throw Exceptions::ArgumentOutOfRangeException("The static image pyramid doesn't have that level", __FUNCTION__);
+
+	return *staticPyramid[level];
+}
+
+PixelRect MotionExtractor::tileRect(size_t tileIndex) const
+{
+	const size_t x = (tileIndex % tilesWide) * kTileSize;
+	const size_t y = (tileIndex / tilesWide) * kTileSize;
+	return PixelRect(x, y, min(kTileSize, imageWidth - x), min(kTileSize, imageHeight - y));
 }
 
 void MotionExtractor::reset()
 {
 	// For comparison purposes, it is important that pixel timers start at zero
-	fill(currentStableTimes.begin(), currentStableTimes.end(), 0);
+	fill(currentStableTimes, currentStableTimes + imageArea, 0);
 	memset(stableRecords, 0, imageArea * sizeof(unsigned int));
 
+	// Noise estimates start from scratch, so thresholds start at the base sensitivity
+	fill(noiseDeviations.begin(), noiseDeviations.end(), 0);
+	fill(adaptiveThresholds.begin(), adaptiveThresholds.end(), (uint8_t)motionThreshold);
+
 	// The first frame will be used to wipe the reference and current images.
 	firstFrame = true;
+	staticReplaced = true;
+	illuminationGain = 1;
+	illuminationDrift = 1;
+	illuminationChangeGain = 1;
+	illuminationChanged = false;
+	shakeOffset = PixelOffset(0, 0, 0);
+	shakeHeldFrames = 0;
+	fill(frameColumnSums.begin(), frameColumnSums.end(), 0);
+	fill(staticColumnSums.begin(), staticColumnSums.end(), 0);
+	fill(tileFrameSums.begin(), tileFrameSums.end(), 0);
+	fill(tileStaticSums.begin(), tileStaticSums.end(), 0);
+	fill(tileDirty.begin(), tileDirty.end(), 0);
+	updateMotionTiles();
+	fill(maskIntegral.begin(), maskIntegral.end(), 0);
+	for (Tripwire& wire : tripwires)
+		wire.reset();
+
+	// The coarse level starts over with this one
+	refreshPhase = 0;
+	fill(tileSkippedFrames.begin(), tileSkippedFrames.end(), 0);
+	if (coarse != nullptr) {
+		configureCoarse();
+		coarse->reset();
+	}
 }
 
-void MotionExtractor::downscale(const VideoFrame& frame, VideoFrame& down)
+void MotionExtractor::checkInput(const VideoFrame& frame)
 {
-	const uint8_t* srcPixel = frame.getPixels();
-	unsigned short* accum = downscaleAccumulators.data();
-	unsigned short* accumRow = accum;
-	unsigned short* accumEnd = accum + downscaleAccumulators.size();
+	const size_t depth = frame.getBytesPerPixel();
+	if (frame.getWidth() / ratio != imageWidth || frame.getHeight() / ratio != imageHeight)
+		throw Exceptions::ArgumentException("Frame dimensions don't match the extractor's", __FUNCTION__);
 
-	int accumRowsDone = 0;
-	size_t rowPixelsDone = 0;
+	// Frames that are already at the analysis resolution and format are used as-is
+	passThrough = ratio == 1 && depth == kBytesPerPixel;
+	if (!passThrough && downscaleStorage.empty())
+		allocateDownscaleBuffers();
+	if (!passThrough && depth != downscaleDepth) {
+		downscaleKernel = selectDownscaleKernel(depth);
+		downscaleDepth = depth;
+	}
+}
 
-	// Clear the accumulators
-	fill(downscaleAccumulators.begin(), downscaleAccumulators.end(), 0);
+const uint8_t* MotionExtractor::prepareBand(const VideoFrame& frame, size_t y, size_t rows)
+{
+	if (passThrough)
+		return frame.getPixels() + y * destLineSize;
 
-	// source rows accumulated for the current accumulator row
-	int srcRowsPerAccumRow = 0;
+	(this->*downscaleKernel)(frame, y, rows, downscaleBuff);
+	return downscaleBuff;
+}
 
-	while (accum < accumEnd) {
+MotionExtractor::DownscaleKernel MotionExtractor::selectDownscaleKernel(size_t depth) const
+{
+	// One instantiation for each supported source depth (3 or 4) and downscale ratio (1, 2, 4, or 8)
+	static const DownscaleKernel kernels[2][4] = {
+		{ &MotionExtractor::downscale<3, 1>, &MotionExtractor::downscale<3, 2>,
+		  &MotionExtractor::downscale<3, 4>, &MotionExtractor::downscale<3, 8> },
+		{ &MotionExtractor::downscale<4, 1>, &MotionExtractor::downscale<4, 2>,
+		  &MotionExtractor::downscale<4, 4>, &MotionExtractor::downscale<4, 8> }
+	};
 
-		// Accumulate the downscale ratio of pixels, then advance the accumulator pointer
-		for (size_t p = 0; p < kDownscaleRatio; ++p) {
-			for (size_t c = 0; c < kBytesPerPixel; ++c)
-				accum[c] += srcPixel[c];
+	if (depth != 3 && depth != 4)
+		throw Exceptions::ArgumentException("Frames must have 3 or 4 bytes per pixel", __FUNCTION__);
 
-			srcPixel += kBytesPerPixel;
-		}
-		accum += kBytesPerPixel;
+	if (genericKernels)
+		return &MotionExtractor::downscale<0, 0>;
 
-		// If we've reached the end of a accumulator row
-		if (++rowPixelsDone == imageWidth) {
-			rowPixelsDone = 0;
+	const size_t ratioIndex = ratio == 1 ? 0 : ratio == 2 ? 1 : ratio == 4 ? 2 : 3;
+	return kernels[depth - 3][ratioIndex];
+}
 
-			// Only move to a new accumulator row if we've accumulated the correct number of source rows
-			if (++srcRowsPerAccumRow == kDownscaleRatio) {
-				++accumRowsDone;
-				accumRow = downscaleAccumulators.data() + accumRowsDone * destLineSize;
-				srcRowsPerAccumRow = 0;
-			}
+void MotionExtractor::selectKernels()
+{
+	typedef Switch S;
+	// One instantiation for each combination of noise adaptation and erosion, unshifted and shifted
+	// (erosion only picks whether erodeMotion is called, which is checked once a frame anyway)
+	static const DetectKernel detectKernels[2][2][2] = {
+		{ { &MotionExtractor::detectMotion<S::Off, S::Off, S::Off>, &MotionExtractor::detectMotion<S::Off, S::Off, S::On> },
+		  { &MotionExtractor::detectMotion<S::Off, S::On, S::Off>, &MotionExtractor::detectMotion<S::Off, S::On, S::On> } },
+		{ { &MotionExtractor::detectMotion<S::On, S::Off, S::Off>, &MotionExtractor::detectMotion<S::On, S::Off, S::On> },
+		  { &MotionExtractor::detectMotion<S::On, S::On, S::Off>, &MotionExtractor::detectMotion<S::On, S::On, S::On> } }
+	};
+
+	if (genericKernels) {
+		trackKernel = &MotionExtractor::trackChanges<S::Runtime>;
+		detectKernel = &MotionExtractor::detectMotion<S::Runtime, S::Runtime, S::Runtime>;
+		shiftedDetectKernel = detectKernel;
+		return;
+	}
+
+	const bool erode = erosionLevel > 0;
+	trackKernel = noiseAdaptive ? &MotionExtractor::trackChanges<S::On> : &MotionExtractor::trackChanges<S::Off>;
+	detectKernel = detectKernels[noiseAdaptive][false][erode];
+	shiftedDetectKernel = detectKernels[noiseAdaptive][true][erode];
+}
+
+template <size_t Channels, size_t Ratio>
+void MotionExtractor::downscale(const VideoFrame& frame, size_t y, size_t rows, uint8_t* down)
+{
+	static_assert(Ratio * Ratio * 255 <= 0xffff, "Downscale accumulators would overflow");
+	const size_t channels = Channels != 0 ? Channels : frame.getBytesPerPixel();
+	const size_t factor = Ratio != 0 ? Ratio : ratio;
+
+	const size_t srcLineSize = frame.getWidth() * channels;
+	const uint8_t* srcRow = frame.getPixels() + y * factor * srcLineSize;
+	uint8_t* dp = down;
+	unsigned short* accumRow = downscaleAccumulators;
 
-			// Move back to the start of the row, or advance to the next one
-			accum = accumRow;
-			srcPixel = frame.getPixels() + (accumRowsDone * kDownscaleRatio + srcRowsPerAccumRow) * srcLineSize;
+	for (size_t row = 0; row < rows; ++row) {
+		// Accumulate a Ratio x Ratio block of source pixels into each accumulator
+		fill(accumRow, accumRow + destLineSize, 0);
+		for (size_t r = 0; r < factor; ++r, srcRow += srcLineSize) {
+			const uint8_t* srcPixel = srcRow;
+			unsigned short* accum = accumRow;
+			for (size_t x = 0; x < imageWidth; ++x, accum += kBytesPerPixel) {
+				for (size_t p = 0; p < factor; ++p, srcPixel += channels) {
+					for (size_t c = 0; c < kBytesPerPixel; ++c)
+						accum[c] += srcPixel[c];
+				}
+			}
 		}
+
+		// Now that we've accumulated everything, just divide it by the number of pixels accumulated
+		for (size_t i = 0; i < destLineSize; ++i)
+			dp[i] = (uint8_t)(accumRow[i] / (factor * factor));
+		dp += destLineSize;
 	}
-	// Now that we've accumulated everything, just divide it by the number of pixels accumulated
-	auto dp = down.getPixels();
-	for (accum = downscaleAccumulators.data(); accum < accumEnd; ++accum, ++dp)
-		*dp = *accum / kDownscaleSquare;
 }
 
 void MotionExtractor::setSensitivity(int newSens)
@@ -318,9 +1385,194 @@ void MotionExtractor::setErosion(int newErosion)
 		throw Exceptions::ArgumentOutOfRangeException("Erosion value must be between 0 and 8 pixels", __FUNCTION__);
 
 	erosionLevel = newErosion;
+	selectKernels();
+	reset();
+}
+
+void MotionExtractor::setNoiseAdaptive(bool enable)
+{
+	noiseAdaptive = enable;
+	selectKernels();
+	if (enable) {
+		noiseDeviations.resize(imageSize);
+		adaptiveThresholds.resize(imageSize);
+	}
+	else {
+		noiseDeviations.clear();
+		noiseDeviations.shrink_to_fit();
+		adaptiveThresholds.clear();
+		adaptiveThresholds.shrink_to_fit();
+	}
+	reset();
+}
+
+void MotionExtractor::setIlluminationCompensation(bool enable)
+{
+	illuminationCompensation = enable;
+	if (enable) {
+		tileFrameSums.assign(tilesWide * tilesHigh, 0);
+		tileStaticSums.assign(tilesWide * tilesHigh, 0);
+	}
+	else {
+		tileFrameSums.clear();
+		tileFrameSums.shrink_to_fit();
+		tileStaticSums.clear();
+		tileStaticSums.shrink_to_fit();
+	}
+	illuminationGain = 1;
+	illuminationDrift = 1;
+	illuminationChangeGain = 1;
+	illuminationChanged = false;
+	if (coarse != nullptr)
+		configureCoarse();
+}
+
+void MotionExtractor::setIlluminationThreshold(double threshold)
+{
+	if (threshold < 0.01 || threshold > 1)
+		throw Exceptions::ArgumentOutOfRangeException("Illumination threshold must be between 0.01 and 1", __FUNCTION__);
+
+	illuminationThreshold = threshold;
+	if (coarse != nullptr)
+		configureCoarse();
+}
+
+void MotionExtractor::setShakeCompensation(bool enable)
+{
+	shakeCompensation = enable;
+	if (enable) {
+		frameRowSums.assign(imageHeight, 0);
+		frameColumnSums.assign(imageWidth, 0);
+		staticRowSums.assign(imageHeight, 0);
+		staticColumnSums.assign(imageWidth, 0);
+	}
+	else {
+		for (auto* sums : { &frameRowSums, &frameColumnSums, &staticRowSums, &staticColumnSums }) {
+			sums->clear();
+			sums->shrink_to_fit();
+		}
+	}
+	shakeOffset = PixelOffset(0, 0, 0);
+	shakeHeldFrames = 0;
+}
+
+void MotionExtractor::setMaxShake(int pixels)
+{
+	if (pixels < 1 || pixels > 8)
+		throw Exceptions::ArgumentOutOfRangeException("Max shake must be between 1 and 8 pixels", __FUNCTION__);
+	if ((size_t)pixels * 2 >= min(imageWidth, imageHeight))
+		throw Exceptions::ArgumentOutOfRangeException("Max shake is too large for the image", __FUNCTION__);
+
+	maxShake = pixels;
+}
+
+void MotionExtractor::setCoarseToFine(size_t factor)
+{
+	if (factor != 0 && factor != 2 && factor != 4 && factor != 8)
+		throw Exceptions::ArgumentOutOfRangeException("The coarse-to-fine factor must be 0, 2, 4, or 8", __FUNCTION__);
+	if (factor > 0 && (imageWidth / factor == 0 || imageHeight / factor == 0))
+		throw Exceptions::ArgumentOutOfRangeException("The image is too small for that coarse-to-fine factor",
+		                                              __FUNCTION__);
+
+	coarseFactor = factor;
+	if (factor > 0) {
+		const size_t coarseWidth = imageWidth / factor;
+		const size_t coarseHeight = imageHeight / factor;
+		// Frames are reduced here, so the coarse level analyzes them as they are
+		coarse.reset(new MotionExtractor(coarseWidth, coarseHeight, fps, false, 1, false, memory));
+		coarseFrame.reset(new VideoFrame(coarseWidth, coarseHeight, kBytesPerPixel, false, memory));
+		coarseSums.assign(coarseWidth * kBytesPerPixel, 0);
+		tileRefined.assign(tilesWide * tilesHigh, 0);
+		tileSkippedFrames.assign(tilesWide * tilesHigh, 0);
+	}
+	else {
+		coarse.reset();
+		coarseFrame.reset();
+		coarseSums.clear();
+		coarseSums.shrink_to_fit();
+		tileRefined.clear();
+		tileRefined.shrink_to_fit();
+		tileSkippedFrames.clear();
+		tileSkippedFrames.shrink_to_fit();
+	}
 	reset();
 }
 
+void MotionExtractor::setMaskIntegral(bool enable)
+{
+	if (enable) {
+		maskIntegral.assign((imageWidth + 1) * (imageHeight + 1), 0);
+		updateMaskIntegral();
+	}
+	else {
+		maskIntegral.clear();
+		maskIntegral.shrink_to_fit();
+	}
+}
+
+void MotionExtractor::setStaticTracking(bool enable)
+{
+	staticTracking = enable;
+	if (enable) {
+		tileStaticChanged.assign(tilesWide * tilesHigh, 0);
+		tileGenerations.assign(tilesWide * tilesHigh, 0);
+		// Changes made before tracking started are unknown, so everything counts as changed
+		staticReplaced = true;
+	}
+	else {
+		tileStaticChanged.clear();
+		tileStaticChanged.shrink_to_fit();
+		tileGenerations.clear();
+		tileGenerations.shrink_to_fit();
+	}
+}
+
+void MotionExtractor::setStaticTolerance(int tolerance)
+{
+	if (tolerance < 0 || tolerance > 255)
+		throw Exceptions::ArgumentOutOfRangeException("Static tolerance must be between 0 and 255", __FUNCTION__);
+
+	staticTolerance = tolerance;
+}
+
+void MotionExtractor::setStaticPyramid(size_t levels, size_t interval)
+{
+	if (interval == 0)
+		throw Exceptions::ArgumentOutOfRangeException("The pyramid interval must be at least one frame", __FUNCTION__);
+	if (levels > 0 && (imageWidth >> levels == 0 || imageHeight >> levels == 0))
+		throw Exceptions::ArgumentOutOfRangeException("The static image is too small for that many levels", __FUNCTION__);
+
+	staticPyramid.clear();
+	for (size_t level = 1; level <= levels; ++level) {
+		staticPyramid.emplace_back(new VideoFrame(imageWidth >> level, imageHeight >> level, kBytesPerPixel,
+		                                          true, memory));
+	}
+	pyramidInterval = interval;
+	// Build the pyramid on the next frame
+	pyramidCountdown = 1;
+}
+
+void MotionExtractor::setGenericKernels(bool enable)
+{
+	genericKernels = enable;
+	selectKernels();
+	// Pick the downscale kernel again on the next frame
+	downscaleDepth = 0;
+	if (coarse != nullptr)
+		configureCoarse();
+}
+
+void MotionExtractor::setNoiseMultiplier(double k)
+{
+	if (k < 1 || k > 20)
+		throw Exceptions::ArgumentOutOfRangeException("Noise multiplier must be between 1 and 20", __FUNCTION__);
+
+	noiseMultiplier = k;
+	noiseScale = noiseMultiplierToScale(k);
+	if (coarse != nullptr)
+		configureCoarse();
+}
+
 int MotionExtractor::getSensitivity() const
 {
 	return motionThreshold;
@@ -336,11 +1588,91 @@ int MotionExtractor::getErosion() const
 	return erosionLevel;
 }
 
+bool MotionExtractor::getNoiseAdaptive() const
+{
+	return noiseAdaptive;
+}
+
+double MotionExtractor::getNoiseMultiplier() const
+{
+	return noiseMultiplier;
+}
+
+bool MotionExtractor::getIlluminationCompensation() const
+{
+	return illuminationCompensation;
+}
+
+double MotionExtractor::getIlluminationThreshold() const
+{
+	return illuminationThreshold;
+}
+
+bool MotionExtractor::getShakeCompensation() const
+{
+	return shakeCompensation;
+}
+
+int MotionExtractor::getMaxShake() const
+{
+	return maxShake;
+}
+
+bool MotionExtractor::getMaskIntegral() const
+{
+	return !maskIntegral.empty();
+}
+
+bool MotionExtractor::getStaticTracking() const
+{
+	return staticTracking;
+}
+
+int MotionExtractor::getStaticTolerance() const
+{
+	return staticTolerance;
+}
+
+bool MotionExtractor::getGenericKernels() const
+{
+	return genericKernels;
+}
+
+size_t MotionExtractor::getCoarseToFine() const
+{
+	return coarseFactor;
+}
+
+size_t MotionExtractor::getStaticPyramidLevels() const
+{
+	return staticPyramid.size();
+}
+
 void MotionExtractor::save(Json::Value& paramsObject) const
 {
 	paramsObject["sensitivity"] = getSensitivity();
 	paramsObject["settle time"] = getSettleTime();
 	paramsObject["erosion level"] = getErosion();
+	paramsObject["noise adaptive"] = getNoiseAdaptive();
+	paramsObject["noise multiplier"] = getNoiseMultiplier();
+	paramsObject["illumination compensation"] = getIlluminationCompensation();
+	paramsObject["illumination threshold"] = getIlluminationThreshold();
+	paramsObject["shake compensation"] = getShakeCompensation();
+	paramsObject["max shake"] = getMaxShake();
+	paramsObject["coarse to fine"] = (Json::UInt)getCoarseToFine();
+
+	Json::Value& wires = paramsObject["tripwires"];
+	wires = Json::Value(Json::arrayValue);
+	for (const Tripwire& wire : tripwires) {
+		Json::Value w;
+		w["from x"] = wire.getFrom().x;
+		w["from y"] = wire.getFrom().y;
+		w["to x"] = wire.getTo().x;
+		w["to y"] = wire.getTo().y;
+		w["gap"] = wire.getGap();
+		w["min pixels"] = wire.getMinPixels();
+		wires.append(w);
+	}
 }
 
 void MotionExtractor::load(Json::Value& paramsObject)
@@ -361,4 +1693,76 @@ void MotionExtractor::load(Json::Value& paramsObject)
 	setSensitivity(si);
 	setSettleTime(td);
 	setErosion(ei);
+
+	// Noise adaptation is optional so that older settings files still load
+	const Json::Value& nav = paramsObject["noise adaptive"];
+	const Json::Value& nmv = paramsObject["noise multiplier"];
+	if (!nmv.isNull()) {
+		const double nm = nmv.asDouble();
+		if (nm < 1 || nm > 20)
+			throw Exceptions::FileException("Motion detection settings are invalid", __FUNCTION__);
+		setNoiseMultiplier(nm);
+	}
+	if (!nav.isNull())
+		setNoiseAdaptive(nav.asBool());
+
+	// So is illumination compensation
+	const Json::Value& icv = paramsObject["illumination compensation"];
+	const Json::Value& itv = paramsObject["illumination threshold"];
+	if (!itv.isNull()) {
+		const double it = itv.asDouble();
+		if (it < 0.01 || it > 1)
+			throw Exceptions::FileException("Motion detection settings are invalid", __FUNCTION__);
+		setIlluminationThreshold(it);
+	}
+	if (!icv.isNull())
+		setIlluminationCompensation(icv.asBool());
+
+	// And shake compensation
+	const Json::Value& scv = paramsObject["shake compensation"];
+	const Json::Value& msv = paramsObject["max shake"];
+	if (!msv.isNull()) {
+		const int ms = msv.asInt();
+		if (ms < 1 || ms > 8)
+			throw Exceptions::FileException("Motion detection settings are invalid", __FUNCTION__);
+		setMaxShake(ms);
+	}
+	if (!scv.isNull())
+		setShakeCompensation(scv.asBool());
+
+	// And coarse-to-fine detection
+	const Json::Value& ctv = paramsObject["coarse to fine"];
+	if (!ctv.isNull()) {
+		const int ct = ctv.asInt();
+		if (ct != 0 && ct != 2 && ct != 4 && ct != 8)
+			throw Exceptions::FileException("Motion detection settings are invalid", __FUNCTION__);
+		setCoarseToFine((size_t)ct);
+	}
+
+	// And tripwires, which replace any already added
+	const Json::Value& wires = paramsObject["tripwires"];
+	if (!wires.isNull()) {
+		if (!wires.isArray())
+			throw Exceptions::FileException("Motion detection settings are invalid", __FUNCTION__);
+
+		vector<Tripwire> loaded;
+		for (const Json::Value& w : wires) {
+			const PixelPoint from(w["from x"].asInt(), w["from y"].asInt());
+			const PixelPoint to(w["to x"].asInt(), w["to y"].asInt());
+			const int gap = w["gap"].isNull() ? 4 : w["gap"].asInt();
+			const int minPixels = w["min pixels"].isNull() ? 3 : w["min pixels"].asInt();
+			if (w["from x"].isNull() || w["from y"].isNull() || w["to x"].isNull() || w["to y"].isNull() ||
+			    minPixels < 1)
+				throw Exceptions::FileException("Motion detection settings are invalid", __FUNCTION__);
+
+			try {
+				loaded.emplace_back(from, to, imageWidth, imageHeight, kBytesPerPixel, gap, (uint32_t)minPixels);
+			}
+			catch (const Exceptions::Exception&) {
+				throw Exceptions::FileException("A tripwire in the motion detection settings is invalid",
+				                                __FUNCTION__);
+			}
+		}
+		tripwires = move(loaded);
+	}
 }
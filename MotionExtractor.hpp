@@ -2,9 +2,12 @@
 
 #include <ctime>
 #include <memory>
+#include <memory_resource>
 #include <vector>
 
 #include "PixelOffset.hpp"
+#include "PixelRect.hpp"
+#include "Tripwire.hpp"
 
 class VideoFrame;
 
@@ -20,21 +23,35 @@ class Value;
  */
 class MotionExtractor final {
 public:
+	/// The motion mask is tracked in square tiles of this many pixels on a side (see getMotionTiles)
+	static constexpr size_t kTileSize = 16;
+
 	/*
 	 * \brief Constructor
 	 * \param frameWidth The width of video frames
 	 * \param frameHeight The height of video frames
 	 * \param videoFPS The frame rate of the video, in frames per second
 	 * \param benchmark true to print the number of frames processed each second.
+	 * \param downscaleRatio Frames are downscaled by this factor (1, 2, 4, or 8) before analysis.
+	 *                       Pass 1 to analyze frames that have already been reduced to the analysis resolution.
+	 * \param lowMemory true to downscale frames a band of kTileSize rows at a time instead of into a
+	 *                  whole-frame buffer, which saves a frame's worth of memory per extractor
+	 * \param resource Where the extractor's state is allocated from (e.g. a per-thread pool backed by huge pages)
 	 */
 	MotionExtractor(size_t frameWidth,
 	                size_t frameHeight,
 	                double videoFPS,
-	                bool  benchmark);
+	                bool  benchmark,
+	                size_t downscaleRatio = 2,
+	                bool lowMemory = false,
+	                std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+	~MotionExtractor();
 
 	/**
 	 * \brief Updates the motion mask given a new frame.
-	 * \param frame The next frame of video to process
+	 * \param frame The next frame of video to process, with 3 (RGB or BGR) or 4 (with a trailing alpha or padding byte)
+	 *              bytes per pixel
 	 * \returns A reference to the motion mask
 	 *
 	 * The motion mask's red and green channels can be used for user/display purposees.
@@ -50,12 +67,117 @@ public:
 	 */
 	VideoFrame& getMotionMask() { return *motionMask; }
 
+	/// \copydoc getMotionMask()
+	const VideoFrame& getMotionMask() const { return *motionMask; }
+
+	/// Returns true if the last motion mask contains any moving pixels
+	bool hasMotion() const { return !dirtyTiles.empty(); }
+
+	/// Returns true if, as of the last frame, the lighting has changed by more than the illumination threshold
+	/// since the last time this returned true (see setIlluminationCompensation)
+	bool hasIlluminationChange() const { return illuminationChanged; }
+
+	/// Returns how much the lighting changed by, as a gain, as of the last time hasIlluminationChange returned true
+	double getIlluminationChangeGain() const { return illuminationChangeGain; }
+
+	/// Returns the last frame's overall brightness relative to the static image (before compensation),
+	/// or 1 if illumination compensation is disabled
+	double getIlluminationGain() const { return illuminationGain; }
+
+	/// Returns how far the last frame was shifted from the static image, in analysis pixels
+	/// (x and y only; see setShakeCompensation)
+	const PixelOffset& getShakeOffset() const { return shakeOffset; }
+
+	/**
+	 * \brief Returns the tiles of the last motion mask that contain moving pixels
+	 *
+	 * Every moving pixel lies in one of these tiles, so consumers can skip the rest of the mask.
+	 * Tiles are kTileSize pixels square, except along the right and bottom edges of the mask.
+	 */
+	const std::vector<PixelRect>& getMotionTiles() const { return dirtyTiles; }
+
+	/// Returns the bounding rectangle of getMotionTiles(), which is empty if there is no motion
+	const PixelRect& getMotionBounds() const { return motionBounds; }
+
+	/// Returns the number of tiles analyzed at the analysis resolution for the last frame,
+	/// which is all of them unless coarse-to-fine detection is enabled (see setCoarseToFine)
+	size_t getRefinedTileCount() const { return coarse != nullptr ? refinedTiles : tileDirty.size(); }
+
+	/**
+	 * \brief Adds a tripwire, which counts what crosses it (see Tripwire)
+	 * \param from One end of the wire, in motion mask coordinates
+	 * \param to The other end of the wire
+	 * \param gap The distance between the lines watched on either side of the wire, in pixels
+	 * \param minPixels The number of moving pixels on one of those lines that counts as something being on it
+	 * \returns The index of the tripwire
+	 *
+	 * Tripwires are checked after each motion mask is generated, and are saved with the other settings.
+	 */
+	uint32_t addTripwire(const PixelPoint& from, const PixelPoint& to, int gap = 4, uint32_t minPixels = 3);
+
+	/// Removes all tripwires
+	void clearTripwires();
+
+	/// Gets the tripwires, with their counts and what crossed them in the last frame
+	const std::vector<Tripwire>& getTripwires() const { return tripwires; }
+
+	/**
+	 * \brief Counts the moving pixels of the last motion mask within a rectangle, in constant time
+	 * \param r The rectangle, in motion mask coordinates (clipped to the mask)
+	 * \warning The mask integral must be enabled (see setMaskIntegral).
+	 */
+	uint32_t countMoving(const PixelRect& r) const;
+
 	/// Gets the "static" image with moving objects (hopefully) filtered out
 	const VideoFrame& getStaticImage() const { return *refImage; }
 
+	/// Returns the generation of the static image, which counts the frames processed
+	uint64_t getStaticGeneration() const { return staticGeneration; }
+
+	/**
+	 * \brief Gets the tiles of the static image that changed after a given generation
+	 * \param since The generation of the static image the caller last has (0 for everything)
+	 * \param tiles Receives the tiles that changed (kTileSize pixels square, like getMotionTiles)
+	 * \returns The current generation, to pass as since next time
+	 * \warning Static image tracking must be enabled (see setStaticTracking).
+	 *
+	 * Copying just these tiles keeps a copy of the static image up to date,
+	 * give or take the static tolerance, without copying the whole image every frame.
+	 */
+	uint64_t getStaticImageChanges(uint64_t since, std::vector<PixelRect>& tiles) const;
+
+	/**
+	 * \brief Gets a level of the downsampled static image pyramid
+	 * \param level The level, from 0 (half the static image's width and height) to getStaticPyramidLevels() - 1,
+	 *              each level half the size of the one before it
+	 * \see setStaticPyramid
+	 */
+	const VideoFrame& getStaticPyramidLevel(size_t level) const;
+
+	/// Returns the static image generation the pyramid was last built from
+	uint64_t getStaticPyramidGeneration() const { return pyramidGeneration; }
+
 	/// Derived classes should call this within their reset function
 	void reset();
 
+	/**
+	 * \brief Returns the number of bytes of memory used by the extractor
+	 *
+	 * Everything that scales with the frame size (images, the motion mask, and per-pixel timers) lives in
+	 * a single allocation. Noise estimates are allocated separately, and only while noise adaptation is enabled.
+	 */
+	size_t memoryUsage() const;
+
+	/// Returns true if the extractor was constructed in low-memory mode
+	bool isLowMemory() const { return lowMemory; }
+
+	/**
+	 * \brief Reports which NUMA nodes the extractor's per-pixel state is on
+	 * \returns The number of its pages on each node, indexed by node (empty if the system can't tell us)
+	 * \see Affinity for keeping the state local to the thread using it
+	 */
+	std::vector<size_t> getMemoryPlacement() const;
+
 	/// Gets the number of frames processed in the last second
 	/// \warning Will return 0 if benchmarking is not enabled
 	int getDetectionFPS() { return detectorFPS; }
@@ -69,6 +191,109 @@ public:
 	/// Pixels will be erased if they are not neighbored by this many other moving pixels (set to 0 to erase)
 	void setErosion(int newErosion);
 
+	/**
+	 * \brief Enables or disables noise-adaptive thresholds
+	 *
+	 * When enabled, each channel of each pixel keeps a running estimate of its own noise,
+	 * and must differ by more than the noise multiplier times that estimate
+	 * (and never by less than the sensitivity) to be considered moving.
+	 * The estimate only learns from frames in which the channel isn't moving, so steady traffic doesn't raise it.
+	 * This suppresses spurious motion in noisy regions such as foliage or dark, grainy areas.
+	 */
+	void setNoiseAdaptive(bool enable);
+
+	/// Sets how many standard deviations of its own noise a channel must differ by to be considered moving
+	void setNoiseMultiplier(double k);
+
+	/**
+	 * \brief Enables or disables compensating for lighting changes
+	 *
+	 * When clouds pass or lights switch on, every pixel changes at once and the whole frame would be
+	 * marked as moving until the static image settled. With compensation enabled, the brightness of each tile
+	 * of the frame is compared to the static image's. If the whole frame has brightened or darkened
+	 * by more than a couple of percent, each tile of the static image is rescaled to match before
+	 * looking for motion, so even slow changes (dusk) are followed frame by frame. Tiles whose change is far
+	 * from the frame's overall change (e.g. because something moved into them) are rescaled by the overall change
+	 * instead. Once the lighting has changed by more than the illumination threshold, it's reported
+	 * by hasIlluminationChange.
+	 */
+	void setIlluminationCompensation(bool enable);
+
+	/// Sets how much (0.01 to 1) the lighting must change before hasIlluminationChange reports it.
+	/// 0.15 ignores anything under a 15% change. It doesn't affect how the static image is rescaled.
+	void setIlluminationThreshold(double threshold);
+
+	/**
+	 * \brief Enables or disables compensating for camera shake
+	 *
+	 * A camera that sways by a pixel or two makes every edge in the scene show up as motion.
+	 * With compensation enabled, the row and column brightness profiles of each frame are matched against
+	 * the static image's to estimate how far the frame has shifted, and the static image is compared
+	 * with that shift when looking for motion. Only translation is compensated, not rotation or zoom.
+	 * The static image isn't updated while the frame is shifted, so if the camera holds the same shift for the
+	 * settle time (e.g. after being bumped), the static image is moved to match it.
+	 */
+	void setShakeCompensation(bool enable);
+
+	/// Sets the largest shift (1 to 8 pixels, at the analysis resolution) that shake compensation looks for
+	void setMaxShake(int pixels);
+
+	/**
+	 * \brief Enables or disables coarse-to-fine detection
+	 * \param factor How much further (2, 4, or 8) the coarse level is reduced from the analysis resolution,
+	 *               or 0 to disable coarse-to-fine detection
+	 *
+	 * A second extractor, with its own static image, looks for motion in each frame reduced by the factor.
+	 * Only the tiles it finds motion in, and their neighbors, are analyzed at the analysis resolution.
+	 * The rest of the mask stays empty, and their part of the static image is only kept up to date
+	 * a few rows of tiles at a time, so mostly static scenes cost a fraction of the per-pixel work.
+	 * Objects much smaller than a pixel of the coarse level can blur into the background there and be missed.
+	 * Changing this resets the extractor.
+	 */
+	void setCoarseToFine(size_t factor);
+
+	/**
+	 * \brief Enables or disables building a summed-area table of the motion mask for countMoving
+	 *
+	 * The table costs four bytes per mask pixel and a pass over the mask each frame
+	 * (rows of tiles without motion are copied from the row above), which pays for itself
+	 * once a few regions are counted per frame.
+	 */
+	void setMaskIntegral(bool enable);
+
+	/**
+	 * \brief Enables or disables tracking which tiles of the static image change (see getStaticImageChanges)
+	 *
+	 * A tile counts as changed when a write to its static image moves a channel by more than the static tolerance.
+	 * It's checked as the static image is written, so tracking costs no extra pass or memory per pixel.
+	 * Drift of less than the tolerance per frame (noise, slow lighting changes) isn't reported until the lighting
+	 * has changed by the illumination threshold, when every tile counts as changed.
+	 */
+	void setStaticTracking(bool enable);
+
+	/// Sets how far (0 to 255) a single write must move a channel of the static image for its tile to count as changed.
+	/// The static image follows noise and lighting by a level at a time, so 0 would mark almost every tile.
+	void setStaticTolerance(int tolerance);
+
+	/**
+	 * \brief Keeps a pyramid of downsampled static images, rebuilt every few frames
+	 * \param levels The number of levels, or 0 to disable the pyramid
+	 * \param interval The number of frames between rebuilds
+	 */
+	void setStaticPyramid(size_t levels, size_t interval);
+
+	/**
+	 * \brief Switches between kernels specialized for the current settings and generic ones
+	 *
+	 * The downscaling, tracking, and detection kernels are normally instantiated for each combination
+	 * of source depth, downscale ratio, noise adaptation, and shake offset, so their inner loops don't check
+	 * any of them. (Whether to erode is picked with them too, but that only saves a check per frame: erosion
+	 * itself runs the same code either way.) The generic kernels check the settings as they run. They produce
+	 * the same masks, and are there to check the specialized ones against. benchmark.cpp times both, but the
+	 * generic kernels are a worst case rather than what a hand-written general loop would manage.
+	 */
+	void setGenericKernels(bool enable);
+
 	/// \see setSensitvity
 	int getSensitivity() const;
 
@@ -78,6 +303,42 @@ public:
 	/// \see setErosion
 	int getErosion() const;
 
+	/// \see setNoiseAdaptive
+	bool getNoiseAdaptive() const;
+
+	/// \see setNoiseMultiplier
+	double getNoiseMultiplier() const;
+
+	/// \see setIlluminationCompensation
+	bool getIlluminationCompensation() const;
+
+	/// \see setIlluminationThreshold
+	double getIlluminationThreshold() const;
+
+	/// \see setShakeCompensation
+	bool getShakeCompensation() const;
+
+	/// \see setMaxShake
+	int getMaxShake() const;
+
+	/// \see setCoarseToFine
+	size_t getCoarseToFine() const;
+
+	/// \see setMaskIntegral
+	bool getMaskIntegral() const;
+
+	/// \see setStaticTracking
+	bool getStaticTracking() const;
+
+	/// \see setStaticTolerance
+	int getStaticTolerance() const;
+
+	/// \see setGenericKernels
+	bool getGenericKernels() const;
+
+	/// \see setStaticPyramid
+	size_t getStaticPyramidLevels() const;
+
 	void save(Json::Value& paramsObject) const;
 
 	void load(Json::Value& paramsObject);
@@ -88,14 +349,171 @@ public:
 
 private:
 	/// Returns true if any of the channels in the two given pixels differ by MotionExtractor::motionThreshold
-	bool pixelIsDifferent(uint8_t* __restrict pa,
-	                      uint8_t* __restrict pb);
+	bool pixelIsDifferent(const uint8_t* __restrict pa,
+	                      const uint8_t* __restrict pb);
+
+	/// Returns true if any of the channels in the two given pixels differ by the given per-channel thresholds
+	bool pixelIsDifferent(const uint8_t* __restrict pa,
+	                      const uint8_t* __restrict pb,
+	                      const uint8_t* __restrict thresholds);
+
+	/**
+	 * \brief Updates the running noise estimates and per-channel thresholds from a band of the downscaled frame
+	 * \param tip The band's pixels
+	 * \param first The index of the band's first pixel
+	 * \param count The number of pixels in the band
+	 */
+	void updateNoiseThresholds(const uint8_t* tip, size_t first, size_t count);
+
+	/**
+	 * \brief Sums the brightness of each tile of a band of the downscaled frame and of the static image
+	 * \param tip The band's pixels
+	 * \param y The band's first row (a multiple of kTileSize)
+	 * \param rows The number of rows in the band
+	 */
+	void sumBrightness(const uint8_t* tip, size_t y, size_t rows);
+
+	/// Rescales the static image if the frame's brightness (from sumBrightness) changed significantly
+	void compensateIllumination();
+
+	/// A setting a kernel is instantiated for: fixed off or on, or read from the extractor as the kernel runs
+	/// (by the generic kernels, see setGenericKernels)
+	enum class Switch { Off, On, Runtime };
+
+	/// Returns whether a switch is on, given the current value of the setting it stands for
+	static constexpr bool isOn(Switch s, bool setting) { return s == Switch::Runtime ? setting : s == Switch::On; }
 
 	/**
-	 * \brief Downscales an image
+	 * \brief Updates the current image and its stable times from a band of the downscaled frame
+	 * \tparam Adaptive On to use the per-channel adaptiveThresholds instead of motionThreshold
+	 * \param tip The band's pixels
+	 * \param first The index of the band's first pixel
+	 * \param count The number of pixels in the band
+	 */
+	template <Switch Adaptive>
+	void trackChanges(const uint8_t* tip, size_t first, size_t count);
+
+	/**
+	 * \brief Adds a band of the downscaled frame and the static image to their row and column brightness profiles
+	 * \param tip The band's pixels
+	 * \param y The band's first row
+	 * \param rows The number of rows in the band
+	 */
+	void projectBand(const uint8_t* tip, size_t y, size_t rows);
+
+	/// Estimates shakeOffset from the profiles built by projectBand
+	void estimateShake();
+
+	/// Shifts the static image and stable records by shakeOffset, once the camera has stayed there for stableCap frames
+	void realignStatic();
+
+	/**
+	 * \brief Reduces a band of the downscaled frame into coarseFrame
+	 * \param tip The band's pixels
+	 * \param y The band's first row (a multiple of coarseFactor)
+	 * \param rows The number of rows in the band
+	 */
+	void shrinkBand(const uint8_t* tip, size_t y, size_t rows);
+
+	/// Copies the settings the coarse level shares with this extractor to it
+	void configureCoarse();
+
+	/// Picks the tiles to refine from the coarse level's motion mask, and clears the rest of the motion mask
+	void selectRefinedTiles();
+
+	/**
+	 * \brief Updates the current image and its stable times within the refined tiles
+	 * \param frame The frame being processed
+	 * \param tip The last band of the downscaled frame, which is the whole frame unless in low-memory mode
+	 */
+	void trackRefinedTiles(const VideoFrame& frame, const uint8_t* tip);
+
+	/**
+	 * \brief Updates the reference image from the current one, and generates the motion mask
+	 * \tparam Adaptive On to use the per-channel adaptiveThresholds instead of motionThreshold
+	 * \tparam Shifted On to compare each pixel with the static image's pixel at shakeOffset from it
+	 * \tparam Erode On to erode the mask afterwards (erosionLevel is above 0). This only hoists the choice of whether to
+	 *               call erodeMotion out of the frame; the erosion isn't specialized.
+	 *
+	 * With coarse-to-fine detection, only the refined tiles are visited.
+	 */
+	template <Switch Adaptive, Switch Shifted, Switch Erode>
+	void detectMotion();
+
+	/// Erodes the raw motion mask within the tiles with motion, then dilates what's left back out
+	void erodeMotion();
+
+	/**
+	 * \brief Erodes (or dilates) the motion channel of the motion mask, but only within the given tiles
+	 * \tparam Dilate true to turn on pixels next to moving ones instead of turning off isolated ones
+	 * \param tiles A flag for each tile, nonzero if it should be processed
+	 *
+	 * Afterwards, tileDirty is updated for each processed tile.
+	 */
+	template <bool Dilate>
+	void erodeTiles(const std::pmr::vector<uint8_t>& tiles);
+
+	/// Rebuilds dirtyTiles and motionBounds from tileDirty
+	void updateMotionTiles();
+
+	/// Rebuilds maskIntegral from the motion mask
+	void updateMaskIntegral();
+
+	/// Samples the motion mask along each tripwire
+	void updateTripwires();
+
+	/// Advances the static image generation, then updates the static tile generations and pyramid as needed
+	void updateStaticState();
+
+	/// Stamps the tiles of the static image marked in tileStaticChanged with the current generation, and clears them
+	void updateStaticChanges();
+
+	/// Rebuilds the static image pyramid
+	void rebuildStaticPyramid();
+
+	/// Returns the pixel rectangle covered by the tile with the given index
+	PixelRect tileRect(size_t tileIndex) const;
+
+	/// Checks that a frame matches the extractor's dimensions, and picks a downscale kernel for its depth
+	void checkInput(const VideoFrame& frame);
+
+	/**
+	 * \brief Gets a band of a frame at the analysis resolution and format
+	 * \param frame The frame, which has been passed to checkInput
+	 * \param y The first row of the band, at the analysis resolution
+	 * \param rows The number of rows in the band
+	 * \returns The pixels of the frame itself if it needs no downscaling, or of downscaleBuff otherwise
+	 */
+	const uint8_t* prepareBand(const VideoFrame& frame, size_t y, size_t rows);
+
+	/**
+	 * \brief Downscales a band of an image
+	 * \tparam Channels The bytes per pixel of the source frame, or 0 to read it from the frame.
+	 *                  Any past the third are dropped.
+	 * \tparam Ratio The downscale ratio, or 0 to read it from the extractor
 	 * \param frame The video frame being downscaled
+	 * \param y The first row of the band, at the analysis resolution
+	 * \param rows The number of rows in the band
+	 * \param down Receives the downscaled rows
 	 */
-	void downscale(const VideoFrame& frame, VideoFrame& down);
+	template <size_t Channels, size_t Ratio>
+	void downscale(const VideoFrame& frame, size_t y, size_t rows, uint8_t* down);
+
+	/// Carves the per-pixel buffers out of a single allocation
+	void allocateBuffers();
+
+	/// Allocates downscaleBuff and downscaleAccumulators
+	void allocateDownscaleBuffers();
+
+	typedef void (MotionExtractor::*DownscaleKernel)(const VideoFrame&, size_t, size_t, uint8_t*);
+	typedef void (MotionExtractor::*TrackKernel)(const uint8_t*, size_t, size_t);
+	typedef void (MotionExtractor::*DetectKernel)();
+
+	/// Picks the downscale instantiation for the given source depth and the extractor's downscale ratio
+	DownscaleKernel selectDownscaleKernel(size_t depth) const;
+
+	/// Picks the trackChanges and detectMotion instantiations for the current settings
+	void selectKernels();
 
 	/**
 	 * \brief The mask of "moving" pixels
@@ -119,24 +537,137 @@ private:
 	/// Moving pixels will be erased if they are not neighbored by this many other moving pixels
 	int erosionLevel;
 
-	std::unique_ptr<VideoFrame> erodedMask;
+	/// True if each channel's threshold adapts to its running noise (see setNoiseAdaptive)
+	bool noiseAdaptive;
+
+	/// The number of noise standard deviations a channel must differ by to be considered moving
+	double noiseMultiplier;
+
+	/// noiseMultiplier as a 16-bit fixed point factor that converts noiseDeviations into thresholds
+	uint16_t noiseScale;
+
+	/// Running mean absolute deviation of each channel of each pixel, in fixed point
+	/// (kept in its own array, parallel to the image bytes)
+	std::pmr::vector<uint16_t> noiseDeviations;
+
+	/// The motion threshold of each channel of each pixel, derived from noiseDeviations
+	std::pmr::vector<uint8_t> adaptiveThresholds;
+
+	/// True to rescale the static image when the lighting changes (see setIlluminationCompensation)
+	bool illuminationCompensation;
+
+	/// The relative change in brightness that counts as a lighting change
+	double illuminationThreshold;
+
+	/// \see getIlluminationGain
+	double illuminationGain;
+
+	/// The product of the gains the static image has been rescaled by since the last reported lighting change
+	double illuminationDrift;
+
+	/// \see getIlluminationChangeGain
+	double illuminationChangeGain;
+
+	/// \see hasIlluminationChange
+	bool illuminationChanged;
+
+	/// True to compensate for camera shake (see setShakeCompensation)
+	bool shakeCompensation;
+
+	/// The largest shift shake compensation looks for
+	int maxShake;
+
+	/// \see getShakeOffset
+	PixelOffset shakeOffset;
+
+	/// Frames in a row that shakeOffset has held the same non-zero shift
+	unsigned int shakeHeldFrames;
+
+	std::pmr::vector<uint32_t> frameRowSums; ///< Brightness of each row of the frame (only while compensating for shake)
+	std::pmr::vector<uint32_t> frameColumnSums; ///< Brightness of each column of the frame
+	std::pmr::vector<uint32_t> staticRowSums; ///< Brightness of each row of the static image
+	std::pmr::vector<uint32_t> staticColumnSums; ///< Brightness of each column of the static image
+
+	/// How much further the coarse level is reduced (see setCoarseToFine), or 0
+	size_t coarseFactor;
+
+	/// The extractor that looks for motion at the coarse level (only while coarse-to-fine detection is enabled)
+	std::unique_ptr<MotionExtractor> coarse;
+
+	/// The frame being reduced for the coarse level
+	std::unique_ptr<VideoFrame> coarseFrame;
+
+	/// Accumulators used for reducing frames for the coarse level (one coarse row's worth)
+	std::pmr::vector<uint16_t> coarseSums;
+
+	/// A flag for each tile, nonzero if it is analyzed at the analysis resolution this frame
+	/// (only while coarse-to-fine detection is enabled)
+	std::pmr::vector<uint8_t> tileRefined;
+
+	/// The frames each tile has gone without being refined since it last was
+	/// (only while coarse-to-fine detection is enabled)
+	std::pmr::vector<unsigned int> tileSkippedFrames;
+
+	/// \see getRefinedTileCount
+	size_t refinedTiles;
+
+	/// Which of every kCoarseRefreshPeriod rows of tiles is refreshed this frame, whether it has motion or not
+	size_t refreshPhase;
+
+	/// Two rows of eroded motion values, waiting to be copied back into the motion mask
+	/// (a row can't be changed until the row below it has been eroded)
+	uint8_t* erosionRows;
 
 	/// Offsets for adjacent pixels in the motion mask (used for erosion)
 	std::vector<PixelOffset> offs;
 
+	size_t tilesWide; ///< Number of tile columns in the motion mask
+	size_t tilesHigh; ///< Number of tile rows in the motion mask
+
+	/// A flag for each tile, nonzero if it contains moving pixels
+	std::pmr::vector<uint8_t> tileDirty;
+
+	/// Scratch tile flags (used to grow the set of tiles visited by dilation)
+	std::pmr::vector<uint8_t> tileScratch;
+
+	/// Whether each tile visited by erosion still has motion afterwards
+	std::pmr::vector<uint8_t> tileMotion;
+
+	/// The sum of every channel of every pixel in each tile of the frame (only while compensating for lighting)
+	std::pmr::vector<uint32_t> tileFrameSums;
+
+	/// The same sums for the static image
+	std::pmr::vector<uint32_t> tileStaticSums;
+
+	/// Rectangles of the tiles that contain moving pixels
+	std::vector<PixelRect> dirtyTiles;
+
+	/// \see addTripwire
+	std::vector<Tripwire> tripwires;
+
+	/// The number of moving pixels above and to the left of each mask pixel, with a row and column of zeros
+	/// at the top and left ((width + 1) * (height + 1) entries, and only while enabled)
+	std::pmr::vector<uint32_t> maskIntegral;
+
+	/// Bounding rectangle of dirtyTiles
+	PixelRect motionBounds;
+
 	/// The current image
 	std::unique_ptr<VideoFrame> currentImage;
 
 	/// The numer of frames since each pixel of the current image changed
 	/// significantly
-	std::vector<unsigned int> currentStableTimes;
+	unsigned int* currentStableTimes;
 
-	/// A buffer for downscaling new frames and comparing them to the current image
+	/// A buffer for downscaling new frames (bandRows rows of them) and comparing them to the current image
 	/// to see if they've changed
-	std::unique_ptr<VideoFrame> downscaleBuff;
+	uint8_t* downscaleBuff;
+
+	/// Accumulators used for downscaling new frames (one downscaled row's worth)
+	unsigned short* downscaleAccumulators;
 
-	/// Accumulators used for downscaling new frames
-	std::vector<unsigned short> downscaleAccumulators;
+	/// Holds downscaleBuff and downscaleAccumulators, which are only allocated once a frame needs downscaling
+	std::pmr::vector<uint8_t> downscaleStorage;
 
 	/// The "background" image
 	std::unique_ptr<VideoFrame> refImage;
@@ -145,6 +676,71 @@ private:
 	/// to earn its place in the background
 	unsigned int* stableRecords;
 
+	/// The ratio frames are downscaled by before analysis
+	size_t ratio;
+
+	/// The downscale instantiation for downscaleDepth and ratio
+	DownscaleKernel downscaleKernel;
+
+	/// The source depth downscaleKernel was selected for (0 until the first frame)
+	size_t downscaleDepth;
+
+	/// True if the current frame is already at the analysis resolution and format, and isn't downscaled
+	bool passThrough;
+
+	/// The trackChanges instantiation for the current settings
+	TrackKernel trackKernel;
+
+	/// The detectMotion instantiation for the current settings
+	DetectKernel detectKernel;
+
+	/// The detectMotion instantiation for the current settings, for frames with a shake offset
+	DetectKernel shiftedDetectKernel;
+
+	/// \see setGenericKernels
+	bool genericKernels;
+
+	/// True to save memory at some cost in speed (see the constructor)
+	bool lowMemory;
+
+	/// The number of rows frames are downscaled in at a time
+	size_t bandRows;
+
+	/// Where arena and the other buffers are allocated from
+	std::pmr::memory_resource* memory;
+
+	/// The allocation that the per-pixel buffers are carved from
+	uint8_t* arena;
+
+	/// The size of arena, in bytes
+	size_t arenaSize;
+
+	/// Incremented each frame (see getStaticGeneration)
+	uint64_t staticGeneration;
+
+	/// True to track which tiles of the static image change
+	bool staticTracking;
+
+	/// How far a channel of the static image must drift before its tile counts as changed
+	int staticTolerance;
+
+	/// True when the whole static image has been replaced (e.g. by the first frame)
+	bool staticReplaced;
+
+	/// Nonzero for each tile whose static image has been changed by more than the tolerance this frame
+	/// (only while tracking)
+	std::pmr::vector<uint8_t> tileStaticChanged;
+
+	/// The generation each tile of the static image last changed in (only while tracking)
+	std::pmr::vector<uint64_t> tileGenerations;
+
+	/// The downsampled static images, largest first
+	std::vector<std::unique_ptr<VideoFrame>> staticPyramid;
+
+	size_t pyramidInterval; ///< Frames between pyramid rebuilds
+	size_t pyramidCountdown; ///< Frames until the next pyramid rebuild
+	uint64_t pyramidGeneration; ///< The static image generation the pyramid was last built from
+
 	/// True before a single frame is processed.
 	/// The first frame is copied to the reference image to avoid the formation of a screen-wide delta for one frame.
 	bool firstFrame;
@@ -154,7 +750,6 @@ private:
 	size_t imageHeight; ///< Downscaled image height
 	size_t imageArea; ///< Downscaled image area (width * height)
 	size_t imageSize; ///< Downscaled image size (area * bytes per pixel)
-	size_t srcLineSize; ///< Byte size of a source image row
 	size_t destLineSize; ///< Byte size of a downscaled image row
 
 	bool benchmarking; ///< true if tracking how many frames per second the detector can process
@@ -0,0 +1,295 @@
+#include "precomp.hpp"
+#include "Pipeline.hpp"
+
+#include <chrono>
+#include <utility>
+
+#include "Affinity.hpp"
+#include "Exceptions.hpp"
+#include "MotionEventGenerator.hpp"
+#include "MotionExtractor.hpp"
+#include "VideoReader.hpp"
+
+using namespace std;
+
+namespace {
+
+/// How many times a stage waiting on a queue yields before it starts sleeping between checks
+const unsigned int kSpinsBeforeSleep = 64;
+
+/// How long a stage waiting on a queue sleeps between checks, once it has stopped yielding
+const chrono::microseconds kIdleSleep(100);
+
+/// Waits a little before checking a queue again, yielding at first and then sleeping
+void backOff(unsigned int spins)
+{
+	if (spins < kSpinsBeforeSleep)
+		this_thread::yield();
+	else
+		this_thread::sleep_for(kIdleSleep);
+}
+
+/// Returns the nanoseconds since a time point
+uint64_t nanosSince(chrono::steady_clock::time_point start)
+{
+	return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+} // end anonymous namespace
+
+Pipeline::Stage::Stage(const string& n, Transform w, const StageOptions& options, size_t defaultCapacity, bool first)
+	: name(n), work(std::move(w)), cpus(options.cpus), input(), packets(0), dropped(0), busyNanos(0),
+	  inputStallNanos(0), outputStallNanos(0), taken(0), depthSum(0), maxDepth(0)
+{
+	if (!first && options.ownThread)
+		input.reset(new SpscRing<Packet>(options.queueCapacity != 0 ? options.queueCapacity : defaultCapacity));
+}
+
+Pipeline::Pipeline(VideoReader& src, size_t capacity)
+	: source(src), queueCapacity(capacity), stages(), threads(), stopRequested(false), aborting(false), errorLock(),
+	  firstError()
+{
+	if (queueCapacity == 0)
+		throw Exceptions::ArgumentOutOfRangeException("Queues must be able to hold at least one packet", __FUNCTION__);
+
+	uint64_t sequence = 0;
+	addStage("source", [this, sequence](Packet& p) mutable {
+		if (!stopRequested.load(memory_order_relaxed)) {
+			p.frame = source.getNextFrame();
+			p.sequence = sequence++;
+		}
+		return true;
+	}, StageOptions());
+}
+
+Pipeline::~Pipeline()
+{
+	stop();
+	abort();
+	join();
+}
+
+Pipeline& Pipeline::setSourceCpus(const vector<int>& cpus)
+{
+	if (!threads.empty())
+		throw Exceptions::InvalidOperationException("The pipeline has already been started", __FUNCTION__);
+
+	stages.front()->cpus = cpus;
+	return *this;
+}
+
+Pipeline& Pipeline::addTransform(const string& name, Transform transform, const StageOptions& options)
+{
+	if (!transform)
+		throw Exceptions::ArgumentNullException("The transform cannot be empty", __FUNCTION__);
+
+	addStage(name, std::move(transform), options);
+	return *this;
+}
+
+Pipeline& Pipeline::addMotionStage(MotionExtractor& extractor, MotionEventGenerator* events,
+                                   const StageOptions& options)
+{
+	vector<shared_ptr<VideoFrame>> masks;
+	addStage("motion", [&extractor, events, masks](Packet& p) mutable {
+		const VideoFrame& mask = extractor.generateMotionMask(*p.frame);
+
+		// Reuse a copy every other stage has let go of
+		shared_ptr<VideoFrame> copy;
+		for (const shared_ptr<VideoFrame>& m : masks) {
+			if (m.use_count() == 1) {
+				// Don't overwrite the copy before the last stage to hold it is done reading it
+				atomic_thread_fence(memory_order_acquire);
+				copy = m;
+				break;
+			}
+		}
+		if (copy != nullptr) {
+			*copy = mask;
+		}
+		else {
+			copy = make_shared<VideoFrame>(mask);
+			masks.push_back(copy);
+		}
+		p.mask = std::move(copy);
+
+		if (events != nullptr) {
+			events->update(extractor, p.frame->getPTS());
+			MotionEvent e;
+			while (events->nextEvent(e))
+				p.events.push_back(e);
+		}
+		return true;
+	}, options);
+	return *this;
+}
+
+Pipeline& Pipeline::addSink(const string& name, Sink sink, const StageOptions& options)
+{
+	if (!sink)
+		throw Exceptions::ArgumentNullException("The sink cannot be empty", __FUNCTION__);
+
+	addStage(name, [sink](Packet& p) {
+		sink(p);
+		return true;
+	}, options);
+	return *this;
+}
+
+void Pipeline::addStage(const string& name, Transform work, const StageOptions& options)
+{
+	if (!threads.empty())
+		throw Exceptions::InvalidOperationException("The pipeline has already been started", __FUNCTION__);
+
+	stages.emplace_back(new Stage(name, std::move(work), options, queueCapacity, stages.empty()));
+}
+
+void Pipeline::start()
+{
+	if (!threads.empty())
+		throw Exceptions::InvalidOperationException("The pipeline has already been started", __FUNCTION__);
+
+	// Each stage with a queue starts a thread, which runs it and the stages after it up to the next queue
+	size_t first = 0;
+	for (size_t i = 1; i <= stages.size(); ++i) {
+		if (i == stages.size() || stages[i]->input != nullptr) {
+			threads.emplace_back([this, first, i] {
+				try {
+					runThread(first, i);
+				}
+				catch (...) {
+					{
+						lock_guard<mutex> guard(errorLock);
+						if (firstError == nullptr)
+							firstError = current_exception();
+					}
+					abort();
+				}
+			});
+			first = i;
+		}
+	}
+}
+
+void Pipeline::wait()
+{
+	join();
+
+	lock_guard<mutex> guard(errorLock);
+	if (firstError != nullptr)
+		rethrow_exception(exchange(firstError, nullptr));
+}
+
+void Pipeline::join()
+{
+	for (thread& t : threads) {
+		if (t.joinable())
+			t.join();
+	}
+}
+
+void Pipeline::runThread(size_t first, size_t last)
+{
+	Stage& head = *stages[first];
+	Stage& tail = *stages[last - 1];
+	Stage* const next = last < stages.size() ? stages[last].get() : nullptr;
+
+	unique_ptr<Affinity::ScopedPin> pin;
+	if (!head.cpus.empty())
+		pin.reset(new Affinity::ScopedPin(head.cpus));
+
+	Packet p;
+	while (!aborting.load(memory_order_relaxed)) {
+		if (head.input != nullptr && !popPacket(head, p))
+			return;
+
+		// The end of the video passes straight through every stage
+		bool forward = true;
+		auto start = chrono::steady_clock::now();
+		for (size_t i = first; i < last && (i == 0 || p.frame != nullptr); ++i) {
+			Stage& stage = *stages[i];
+			forward = stage.work(p);
+			const auto end = chrono::steady_clock::now();
+			stage.busyNanos.fetch_add((uint64_t)chrono::duration_cast<chrono::nanoseconds>(end - start).count(),
+			                          memory_order_relaxed);
+			start = end;
+
+			if (p.frame == nullptr)
+				break;
+			stage.packets.fetch_add(1, memory_order_relaxed);
+			if (!forward) {
+				stage.dropped.fetch_add(1, memory_order_relaxed);
+				break;
+			}
+		}
+
+		const bool ended = p.frame == nullptr;
+		if (forward && next != nullptr && !pushPacket(tail, *next, p))
+			return;
+		if (ended)
+			return;
+
+		// Start the source from an empty packet, and drop our hold on a dropped packet's frame and mask
+		p = Packet();
+	}
+}
+
+bool Pipeline::popPacket(Stage& stage, Packet& packet)
+{
+	SpscRing<Packet>& ring = *stage.input;
+	if (!ring.tryPop(packet)) {
+		const auto start = chrono::steady_clock::now();
+		for (unsigned int spins = 0; !ring.tryPop(packet); ++spins) {
+			if (aborting.load(memory_order_relaxed))
+				return false;
+			backOff(spins);
+		}
+		stage.inputStallNanos.fetch_add(nanosSince(start), memory_order_relaxed);
+	}
+
+	// Count the packet just taken as having been in the queue
+	const size_t depth = ring.size() + 1;
+	stage.taken.fetch_add(1, memory_order_relaxed);
+	stage.depthSum.fetch_add(depth, memory_order_relaxed);
+	if (depth > stage.maxDepth.load(memory_order_relaxed))
+		stage.maxDepth.store(depth, memory_order_relaxed);
+	return true;
+}
+
+bool Pipeline::pushPacket(Stage& from, Stage& to, Packet& packet)
+{
+	SpscRing<Packet>& ring = *to.input;
+	if (ring.tryPush(std::move(packet)))
+		return true;
+
+	const auto start = chrono::steady_clock::now();
+	for (unsigned int spins = 0; !ring.tryPush(std::move(packet)); ++spins) {
+		if (aborting.load(memory_order_relaxed))
+			return false;
+		backOff(spins);
+	}
+	from.outputStallNanos.fetch_add(nanosSince(start), memory_order_relaxed);
+	return true;
+}
+
+vector<Pipeline::StageStats> Pipeline::getStats() const
+{
+	vector<StageStats> stats;
+	stats.reserve(stages.size());
+	for (const unique_ptr<Stage>& s : stages) {
+		StageStats st;
+		st.name = s->name;
+		st.packets = s->packets.load(memory_order_relaxed);
+		st.dropped = s->dropped.load(memory_order_relaxed);
+		st.busySeconds = s->busyNanos.load(memory_order_relaxed) * 1e-9;
+		st.inputStallSeconds = s->inputStallNanos.load(memory_order_relaxed) * 1e-9;
+		st.outputStallSeconds = s->outputStallNanos.load(memory_order_relaxed) * 1e-9;
+		st.queueCapacity = s->input != nullptr ? s->input->capacity() : 0;
+		st.queueDepth = s->input != nullptr ? s->input->size() : 0;
+		st.maxQueueDepth = s->maxDepth.load(memory_order_relaxed);
+		const uint64_t taken = s->taken.load(memory_order_relaxed);
+		st.meanQueueDepth = taken > 0 ? (double)s->depthSum.load(memory_order_relaxed) / taken : 0;
+		stats.push_back(st);
+	}
+	return stats;
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MotionEvent.hpp"
+#include "SpscRing.hpp"
+#include "StreamVideoFrame.hpp"
+
+class MotionEventGenerator;
+class MotionExtractor;
+class VideoReader;
+
+/**
+ * \brief Runs a video reader's frames through a chain of stages, each optionally on its own thread
+ *
+ * A pipeline starts with its source (a VideoReader), followed by transforms and sinks in the order they're added.
+ * Consecutive stages on the same thread call each other directly. A stage that starts a thread of its own
+ * is fed by a bounded lock-free ring (SpscRing) of packets from the previous stage, so decoding, analysis,
+ * and output can overlap. Packets only hold handles, so frames are never copied between stages.
+ * When a ring is full, the stage feeding it waits, so a slow stage holds the source back rather than
+ * piling up frames. getStats reports how much time each stage spends working and waiting, and how full its
+ * queue is, which shows where the bottleneck is.
+ *
+ * \code
+ * Pipeline pipeline(reader);
+ * pipeline.addMotionStage(extractor, &events)
+ *         .addSink("alerts", [](const Pipeline::Packet& p) { for (const MotionEvent& e : p.events) ...; });
+ * pipeline.run();
+ * \endcode
+ */
+class Pipeline final {
+public:
+	/// What flows between stages: a frame, and whatever earlier stages learned about it
+	struct Packet {
+		std::shared_ptr<StreamVideoFrame> frame; ///< The frame (null only in the packet marking the end)
+		uint64_t sequence = 0; ///< The frame's position in the source's output, counting from 0
+		std::shared_ptr<const VideoFrame> mask; ///< The frame's motion mask, from a motion stage
+		std::vector<MotionEvent> events; ///< The frame's motion events, from a motion stage
+	};
+
+	/**
+	 * \brief A transform: changes or adds to a packet
+	 * \returns false to drop the packet, so later stages never see it
+	 *
+	 * Transforms mustn't change the packet's frame pointer, and should treat the frame's pixels as shared with
+	 * whoever else holds it (the reader, or other stages' packets).
+	 */
+	typedef std::function<bool(Packet&)> Transform;
+
+	/// A sink: consumes packets
+	typedef std::function<void(const Packet&)> Sink;
+
+	/// Where and how a stage runs
+	struct StageOptions {
+		/// true to run the stage on a thread of its own, fed by a queue. false to run it on the previous stage's
+		/// thread, right after it.
+		bool ownThread;
+
+		/// The number of packets the stage's queue holds (rounded up to a power of two). 0 for the pipeline's default.
+		size_t queueCapacity;
+
+		/// CPUs to pin the stage's thread to (see Affinity), or empty to leave it unpinned.
+		/// Ignored if the stage shares the previous stage's thread.
+		std::vector<int> cpus;
+
+		explicit StageOptions(bool own = true, size_t capacity = 0, const std::vector<int>& pinTo = {})
+			: ownThread(own), queueCapacity(capacity), cpus(pinTo)
+		{ }
+	};
+
+	/// How a stage has been doing (see getStats)
+	struct StageStats {
+		std::string name;
+		uint64_t packets; ///< The packets the stage has processed, including those it dropped
+		uint64_t dropped; ///< The packets the stage dropped
+		double busySeconds; ///< Time spent processing
+		/// Time the stage's thread spent waiting for the previous stage (0 if it shares the previous stage's thread)
+		double inputStallSeconds;
+		/// Time the stage's thread spent waiting for room in the next stage's queue
+		/// (0 if the next stage shares its thread, or it's the last stage)
+		double outputStallSeconds;
+		size_t queueCapacity; ///< The capacity of the stage's queue (0 if it has none)
+		size_t queueDepth; ///< The packets in the stage's queue right now
+		size_t maxQueueDepth; ///< The most packets that have been in the stage's queue
+		double meanQueueDepth; ///< The average number of packets in the stage's queue when it took one
+	};
+
+	/**
+	 * \brief Constructor
+	 * \param source Where frames come from. It's only read from the source's thread.
+	 * \param queueCapacity The default number of packets each queue holds
+	 */
+	explicit Pipeline(VideoReader& source, size_t queueCapacity = 4);
+
+	/// Stops the pipeline without rethrowing any stage's exception, if it's still running
+	~Pipeline();
+
+	/// Pins the source's thread to a set of CPUs (see Affinity)
+	Pipeline& setSourceCpus(const std::vector<int>& cpus);
+
+	/// Adds a transform after the current last stage
+	Pipeline& addTransform(const std::string& name, Transform transform, const StageOptions& options = StageOptions());
+
+	/**
+	 * \brief Adds a stage that generates each frame's motion mask, and optionally its events
+	 * \param extractor Generates the masks. It should only be used by this stage while the pipeline runs.
+	 * \param events If not null, generates events (including Blob events) for each mask, which are drained into
+	 *               the packet. It should only be used by this stage while the pipeline runs.
+	 *
+	 * The extractor downscales frames itself (see its downscaleRatio), so no separate downscaling stage is needed.
+	 * Each packet gets its own copy of the mask, since the extractor overwrites its mask with every frame.
+	 * Copies are reused once every stage has let go of them.
+	 */
+	Pipeline& addMotionStage(MotionExtractor& extractor, MotionEventGenerator* events = nullptr,
+	                         const StageOptions& options = StageOptions());
+
+	/// Adds a sink after the current last stage. Stages can still be added after it.
+	Pipeline& addSink(const std::string& name, Sink sink, const StageOptions& options = StageOptions());
+
+	/**
+	 * \brief Starts the pipeline's threads
+	 * \throws Exceptions::InvalidOperationException if the pipeline has already been started
+	 */
+	void start();
+
+	/// Asks the source to stop, so the pipeline finishes the frames already read and then ends
+	void stop() { stopRequested.store(true, std::memory_order_relaxed); }
+
+	/**
+	 * \brief Waits for the pipeline to finish
+	 * \throws The first exception a stage threw, after the other stages have been stopped
+	 */
+	void wait();
+
+	/// Starts the pipeline and waits for it to finish
+	void run()
+	{
+		start();
+		wait();
+	}
+
+	/// Returns each stage's stats, starting with the source. May be called from any thread while the pipeline runs.
+	std::vector<StageStats> getStats() const;
+
+	// No copying
+	Pipeline(const Pipeline&) = delete;
+	Pipeline& operator=(const Pipeline&) = delete;
+
+private:
+	/// A stage, and what it has measured
+	struct Stage {
+		std::string name;
+		Transform work;
+		std::vector<int> cpus;
+
+		/// The stage's queue, or null if it shares the previous stage's thread
+		std::unique_ptr<SpscRing<Packet>> input;
+
+		// Written only by the stage's thread
+		std::atomic<uint64_t> packets;
+		std::atomic<uint64_t> dropped;
+		std::atomic<uint64_t> busyNanos;
+		std::atomic<uint64_t> inputStallNanos;
+		std::atomic<uint64_t> outputStallNanos;
+		std::atomic<uint64_t> taken; ///< The packets taken from the queue
+		std::atomic<uint64_t> depthSum; ///< The sum of the queue's depth each time a packet was taken from it
+		std::atomic<size_t> maxDepth;
+
+		Stage(const std::string& n, Transform w, const StageOptions& options, size_t defaultCapacity, bool first);
+	};
+
+	/// Adds a stage after the current last one
+	void addStage(const std::string& name, Transform work, const StageOptions& options);
+
+	/// Runs the stages from first up to (but not including) last, which share a thread
+	void runThread(size_t first, size_t last);
+
+	/// Takes a packet from a stage's queue, waiting if it's empty. Returns false if the pipeline is aborting.
+	bool popPacket(Stage& stage, Packet& packet);
+
+	/// Puts a packet in a stage's queue, waiting if it's full. Returns false if the pipeline is aborting.
+	bool pushPacket(Stage& from, Stage& to, Packet& packet);
+
+	/// Stops every thread as soon as possible, such as after an exception
+	void abort() { aborting.store(true, std::memory_order_relaxed); }
+
+	/// Joins the threads
+	void join();
+
+	VideoReader& source;
+	size_t queueCapacity;
+	std::vector<std::unique_ptr<Stage>> stages;
+	std::vector<std::thread> threads;
+
+	std::atomic<bool> stopRequested; ///< \see stop
+	std::atomic<bool> aborting; ///< \see abort
+
+	std::mutex errorLock;
+	std::exception_ptr firstError; ///< The first exception a stage threw
+};
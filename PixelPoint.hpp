@@ -0,0 +1,11 @@
+#pragma once
+
+/// A point on an image, in pixels (which may lie outside the image)
+struct PixelPoint {
+	int x; ///< X coordinate
+	int y; ///< Y coordinate
+
+	PixelPoint() : x(0), y(0) { }
+
+	PixelPoint(int x, int y) : x(x), y(y) { }
+};
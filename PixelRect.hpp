@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+
+/// An axis-aligned rectangle of pixels
+struct PixelRect {
+	size_t x; ///< X coordinate of the left edge
+	size_t y; ///< Y coordinate of the top edge
+	size_t width; ///< Width, in pixels
+	size_t height; ///< Height, in pixels
+
+	PixelRect() : x(0), y(0), width(0), height(0) { }
+
+	PixelRect(size_t x, size_t y, size_t w, size_t h) : x(x), y(y), width(w), height(h) { }
+
+	/// Returns true if the rectangle contains no pixels
+	bool empty() const { return width == 0 || height == 0; }
+};
@@ -0,0 +1,293 @@
+#include "precomp.hpp"
+#include "SharedMaskRing.hpp"
+
+#include <cerrno>
+#include <csignal>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Exceptions.hpp"
+#include "MotionExtractor.hpp"
+
+using namespace std;
+
+namespace SharedMaskRingDetail {
+
+const uint64_t kMagic = 0x324d4853584f4d56; // "VMOXSHM2", little-endian
+
+/// Placed at the start of the shared memory
+struct Header {
+	/// Set last by the publisher, once everything else is initialized
+	atomic<uint64_t> magic;
+	/// The publisher's process ID, set before anything else, so a ring whose publisher died can be replaced
+	atomic<uint64_t> ownerPid;
+	uint64_t width;
+	uint64_t height;
+	uint64_t depth;
+	uint64_t slotCount;
+	uint64_t slotStride; ///< Bytes from the start of one slot to the next
+	uint64_t includeStatic; ///< Nonzero if slots contain static images
+
+	/// Frames published so far
+	alignas(64) atomic<uint64_t> published;
+};
+
+/// Placed at the start of each slot, followed by the mask and then (optionally) the static image
+struct Slot {
+	/// Sequence lock: 2n + 1 while frame n is being written, and 2n + 2 once it's done
+	atomic<uint64_t> sequence;
+	int64_t pts;
+	uint64_t frameNumber;
+	uint64_t hasMotion;
+};
+
+const size_t kAlignment = 64;
+
+static_assert(atomic<uint64_t>::is_always_lock_free,
+              "Shared memory rings need lock-free 64-bit atomics");
+
+size_t alignUp(size_t v) { return (v + kAlignment - 1) & ~(kAlignment - 1); }
+
+const size_t kHeaderSize = alignUp(sizeof(Header));
+const size_t kSlotDataOffset = alignUp(sizeof(Slot));
+
+} // end namespace SharedMaskRingDetail
+
+using namespace SharedMaskRingDetail;
+
+namespace {
+
+inline Slot* slotAt(void* mapping, size_t stride, size_t i)
+{
+	return (Slot*)((uint8_t*)mapping + kHeaderSize + i * stride);
+}
+
+/// Returns true if the named ring was left behind by a publisher that has since exited.
+/// A ring whose owner can't be determined (such as one still being created) isn't stale.
+bool isStale(const string& name)
+{
+	const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	void* mapping = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= kHeaderSize)
+		mapping = mmap(nullptr, kHeaderSize, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mapping == MAP_FAILED)
+		return false;
+
+	const uint64_t owner = ((const Header*)mapping)->ownerPid.load(memory_order_acquire);
+	munmap(mapping, kHeaderSize);
+	return owner != 0 && kill((pid_t)owner, 0) != 0 && errno == ESRCH;
+}
+
+} // end anonymous namespace
+
+SharedMaskPublisher::SharedMaskPublisher(const string& shmName, size_t width, size_t height, size_t depth,
+                                         size_t slotCount, bool includeStaticImage)
+	: name(shmName),
+	  mapping(nullptr),
+	  mappingSize(0),
+	  header(nullptr),
+	  published(0),
+	  inode(0)
+{
+	if (width == 0 || height == 0 || depth == 0)
+		throw Exceptions::ArgumentOutOfRangeException("Frame dimensions must be nonzero", __FUNCTION__);
+	if (slotCount < 2)
+		throw Exceptions::ArgumentOutOfRangeException("A shared mask ring needs at least two slots", __FUNCTION__);
+
+	const size_t frameSize = width * height * depth;
+	const size_t slotStride = alignUp(kSlotDataOffset + frameSize * (includeStaticImage ? 2 : 1));
+	mappingSize = kHeaderSize + slotStride * slotCount;
+
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0 && errno == EEXIST && isStale(name)) {
+		// Replace the ring left behind by a publisher that didn't shut down cleanly
+		shm_unlink(name.c_str());
+		fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+	}
+	if (fd < 0) {
+		if (errno == EEXIST)
+			throw Exceptions::IOException("Another publisher is using the shared memory ring", __FUNCTION__);
+		throw Exceptions::IOException("Could not create the shared memory ring", __FUNCTION__);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || ftruncate(fd, (off_t)mappingSize) != 0) {
+		::close(fd);
+		shm_unlink(name.c_str());
+		throw Exceptions::IOException("Could not size the shared memory ring", __FUNCTION__);
+	}
+
+	mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mapping == MAP_FAILED) {
+		shm_unlink(name.c_str());
+		throw Exceptions::IOException("Could not map the shared memory ring", __FUNCTION__);
+	}
+
+	// ftruncate zeroed everything, so all slots start with an even (idle) sequence number
+	inode = (uint64_t)st.st_ino;
+	header = new (mapping) Header();
+	header->ownerPid.store((uint64_t)getpid(), memory_order_release);
+	header->width = width;
+	header->height = height;
+	header->depth = depth;
+	header->slotCount = slotCount;
+	header->slotStride = slotStride;
+	header->includeStatic = includeStaticImage ? 1 : 0;
+	header->published.store(0, memory_order_relaxed);
+	for (size_t i = 0; i < slotCount; ++i)
+		new (slotAt(mapping, slotStride, i)) Slot();
+
+	header->magic.store(kMagic, memory_order_release);
+}
+
+SharedMaskPublisher::~SharedMaskPublisher()
+{
+	munmap(mapping, mappingSize);
+
+	// Only remove the name if it still refers to our ring, and not to one that replaced it
+	const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd >= 0) {
+		struct stat st;
+		const bool ours = fstat(fd, &st) == 0 && (uint64_t)st.st_ino == inode;
+		::close(fd);
+		if (ours)
+			shm_unlink(name.c_str());
+	}
+}
+
+void SharedMaskPublisher::publish(const VideoFrame& mask, const VideoFrame* staticImage, int64_t pts, bool hasMotion)
+{
+	const size_t frameSize = header->width * header->height * header->depth;
+	if (mask.getTotalSize() != frameSize || mask.getWidth() != header->width)
+		throw Exceptions::ArgumentException("The mask's dimensions don't match the ring's", __FUNCTION__);
+	if (header->includeStatic && (staticImage == nullptr || staticImage->getTotalSize() != frameSize))
+		throw Exceptions::ArgumentException("The static image's dimensions don't match the ring's", __FUNCTION__);
+
+	const uint64_t n = published;
+	Slot* slot = slotAt(mapping, header->slotStride, n % header->slotCount);
+	uint8_t* pixels = (uint8_t*)slot + kSlotDataOffset;
+
+	// Mark the slot as being written, then make sure that's visible before any of the data changes
+	slot->sequence.store(2 * n + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	slot->pts = pts;
+	slot->frameNumber = n;
+	slot->hasMotion = hasMotion ? 1 : 0;
+	memcpy(pixels, mask.getPixels(), frameSize);
+	if (header->includeStatic)
+		memcpy(pixels + frameSize, staticImage->getPixels(), frameSize);
+
+	slot->sequence.store(2 * n + 2, memory_order_release);
+	header->published.store(++published, memory_order_release);
+}
+
+void SharedMaskPublisher::publish(const MotionExtractor& extractor, int64_t pts)
+{
+	publish(extractor.getMotionMask(), &extractor.getStaticImage(), pts, extractor.hasMotion());
+}
+
+SharedMaskSubscriber::SharedMaskSubscriber(const string& name)
+	: mapping(nullptr),
+	  mappingSize(0),
+	  header(nullptr),
+	  maskViews(),
+	  staticViews()
+{
+	const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		throw Exceptions::IOException("Could not open the shared memory ring", __FUNCTION__);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < kHeaderSize) {
+		::close(fd);
+		throw Exceptions::IOException("The shared memory ring is not initialized", __FUNCTION__);
+	}
+	mappingSize = (size_t)st.st_size;
+
+	mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mapping == MAP_FAILED)
+		throw Exceptions::IOException("Could not map the shared memory ring", __FUNCTION__);
+
+	header = (const Header*)mapping;
+	const size_t frameSize = header->width * header->height * header->depth;
+	if (header->magic.load(memory_order_acquire) != kMagic ||
+	    header->slotStride < kSlotDataOffset + frameSize * (header->includeStatic ? 2 : 1) ||
+	    kHeaderSize + header->slotStride * header->slotCount > mappingSize) {
+		munmap(mapping, mappingSize);
+		throw Exceptions::IOException("The shared memory ring is not valid", __FUNCTION__);
+	}
+
+	// The views never write to their pixels, so the mapping can stay read-only.
+	for (size_t i = 0; i < header->slotCount; ++i) {
+		uint8_t* pixels = (uint8_t*)slotAt(mapping, header->slotStride, i) + kSlotDataOffset;
+		maskViews.emplace_back(new VideoFrame(pixels, header->width, header->height, header->depth, false));
+		if (header->includeStatic) {
+			staticViews.emplace_back(new VideoFrame(pixels + frameSize,
+			                                        header->width, header->height, header->depth, false));
+		}
+	}
+}
+
+SharedMaskSubscriber::~SharedMaskSubscriber()
+{
+	munmap(mapping, mappingSize);
+}
+
+bool SharedMaskSubscriber::acquireLatest(SharedMaskFrame& frame) const
+{
+	const uint64_t count = header->published.load(memory_order_acquire);
+	return count > 0 && acquire(count - 1, frame);
+}
+
+bool SharedMaskSubscriber::acquire(uint64_t frameNumber, SharedMaskFrame& frame) const
+{
+	const size_t i = frameNumber % header->slotCount;
+	const Slot* slot = slotAt(mapping, header->slotStride, i);
+	const uint64_t seq = slot->sequence.load(memory_order_acquire);
+	if (seq != 2 * frameNumber + 2)
+		return false;
+
+	frame.mask = maskViews[i].get();
+	frame.staticImage = header->includeStatic ? staticViews[i].get() : nullptr;
+	frame.pts = slot->pts;
+	frame.frameNumber = frameNumber;
+	frame.hasMotion = slot->hasMotion != 0;
+	frame.sequence = seq;
+	frame.slot = i;
+
+	// The metadata could have been torn if the publisher lapped us while we were copying it
+	return isValid(frame);
+}
+
+bool SharedMaskSubscriber::isValid(const SharedMaskFrame& frame) const
+{
+	atomic_thread_fence(memory_order_acquire);
+	const Slot* slot = slotAt(mapping, header->slotStride, frame.slot);
+	return slot->sequence.load(memory_order_relaxed) == frame.sequence;
+}
+
+uint64_t SharedMaskSubscriber::getPublishedCount() const
+{
+	return header->published.load(memory_order_acquire);
+}
+
+size_t SharedMaskSubscriber::getWidth() const
+{
+	return header->width;
+}
+
+size_t SharedMaskSubscriber::getHeight() const
+{
+	return header->height;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "VideoFrame.hpp"
+
+class MotionExtractor;
+
+namespace SharedMaskRingDetail {
+struct Header;
+struct Slot;
+}
+
+/**
+ * \brief Publishes motion masks (and optionally static images) to a POSIX shared memory ring
+ *
+ * Any number of SharedMaskSubscribers, in any process, can map the ring and read frames in place without copying.
+ * Each slot is guarded by a sequence lock: the publisher never waits for readers,
+ * and readers check afterwards whether a frame was overwritten while they were reading it.
+ * The ring is removed when the publisher is destroyed, though existing subscribers keep their mappings.
+ * Only one publisher can use a name at a time. A ring left behind by a publisher that exited without
+ * cleaning up is replaced.
+ */
+class SharedMaskPublisher final {
+public:
+	/**
+	 * \brief Creates the shared memory ring
+	 * \param name The name of the shared memory object (e.g. "/vmox-camera1")
+	 * \param width The width of the masks and static images
+	 * \param height The height of the masks and static images
+	 * \param depth The bytes per pixel of the masks and static images
+	 * \param slotCount The number of frames kept in the ring.
+	 *                  Readers have until this many more frames are published to finish with a frame.
+	 * \param includeStaticImage true to publish the static image along with each mask
+	 * \throws Exceptions::IOException if the ring can't be created, such as when another publisher is using the name
+	 */
+	SharedMaskPublisher(const std::string& name, size_t width, size_t height, size_t depth = 3,
+	                    size_t slotCount = 4, bool includeStaticImage = false);
+
+	~SharedMaskPublisher();
+
+	/**
+	 * \brief Publishes a frame
+	 * \param mask The motion mask
+	 * \param staticImage The static image, which is ignored unless the ring includes static images
+	 * \param pts The timestamp of the frame
+	 * \param hasMotion Whether any pixels in the mask are moving
+	 */
+	void publish(const VideoFrame& mask, const VideoFrame* staticImage, int64_t pts, bool hasMotion);
+
+	/// Publishes the extractor's last motion mask and static image
+	void publish(const MotionExtractor& extractor, int64_t pts);
+
+	// No copying
+	SharedMaskPublisher(const SharedMaskPublisher&) = delete;
+	SharedMaskPublisher& operator=(const SharedMaskPublisher&) = delete;
+
+private:
+	std::string name;
+	void* mapping;
+	size_t mappingSize;
+	SharedMaskRingDetail::Header* header;
+	uint64_t published; ///< Frames published so far
+	uint64_t inode; ///< Identifies our shared memory object, so we don't remove one that replaced it
+};
+
+/// A frame in a shared mask ring. The frames are views straight into shared memory.
+struct SharedMaskFrame {
+	const VideoFrame* mask; ///< The motion mask
+	const VideoFrame* staticImage; ///< The static image, or null if the ring doesn't include them
+	int64_t pts; ///< Timestamp of the frame
+	uint64_t frameNumber; ///< The number of frames published before this one
+	bool hasMotion; ///< Whether any pixels in the mask are moving
+
+	uint64_t sequence; ///< The slot's sequence number when it was acquired
+	size_t slot; ///< The slot holding the frame
+};
+
+/// Maps a ring created by a SharedMaskPublisher (possibly in another process) and reads frames from it
+class SharedMaskSubscriber final {
+public:
+	/// Maps the ring with the given name
+	/// \throws Exceptions::IOException if the ring doesn't exist or isn't valid
+	explicit SharedMaskSubscriber(const std::string& name);
+
+	~SharedMaskSubscriber();
+
+	/**
+	 * \brief Gets the most recently published frame
+	 * \param frame Receives the frame
+	 * \returns false if nothing has been published yet, or if the publisher is writing that slot
+	 *
+	 * \warning The frame's pixels can be overwritten by the publisher at any time after slotCount more frames
+	 *          are published. Call isValid() after using the frame to check that didn't happen.
+	 */
+	bool acquireLatest(SharedMaskFrame& frame) const;
+
+	/**
+	 * \brief Gets a specific frame, if it is still in the ring
+	 * \param frameNumber The frame to get (see SharedMaskFrame::frameNumber)
+	 * \param frame Receives the frame
+	 * \returns false if the frame hasn't been published yet or has been overwritten
+	 */
+	bool acquire(uint64_t frameNumber, SharedMaskFrame& frame) const;
+
+	/// Returns true if the given frame hasn't been overwritten since it was acquired
+	bool isValid(const SharedMaskFrame& frame) const;
+
+	/// Returns the number of frames published so far
+	uint64_t getPublishedCount() const;
+
+	size_t getWidth() const;
+
+	size_t getHeight() const;
+
+	// No copying
+	SharedMaskSubscriber(const SharedMaskSubscriber&) = delete;
+	SharedMaskSubscriber& operator=(const SharedMaskSubscriber&) = delete;
+
+private:
+	void* mapping;
+	size_t mappingSize;
+	const SharedMaskRingDetail::Header* header;
+
+	/// Views of each slot's mask and static image (which don't own their pixels)
+	std::vector<std::unique_ptr<VideoFrame>> maskViews;
+	std::vector<std::unique_ptr<VideoFrame>> staticViews;
+};
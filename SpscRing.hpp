@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "Exceptions.hpp"
+
+/**
+ * \brief A bounded, lock-free ring buffer for one producer thread and one consumer thread
+ *
+ * Neither side ever blocks: tryPush fails when the ring is full and tryPop fails when it is empty.
+ * The capacity is rounded up to a power of two.
+ */
+template <typename T>
+class SpscRing final {
+public:
+	/// \param minCapacity The minimum number of items the ring can hold
+	explicit SpscRing(size_t minCapacity)
+		: slots(), mask(0), head(0), tail(0)
+	{
+		if (minCapacity == 0)
+			throw Exceptions::ArgumentOutOfRangeException("A ring must be able to hold at least one item", __FUNCTION__);
+
+		size_t cap = 1;
+		while (cap < minCapacity)
+			cap <<= 1;
+		slots.resize(cap);
+		mask = cap - 1;
+	}
+
+	/// Adds an item to the ring. Returns false (and leaves the ring unchanged) if it is full.
+	/// \warning Only call from the producer thread
+	template <typename U>
+	bool tryPush(U&& item)
+	{
+		const size_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) > mask)
+			return false;
+
+		slots[h & mask] = std::forward<U>(item);
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// Removes the oldest item from the ring. Returns false (and leaves out unchanged) if it is empty.
+	/// \warning Only call from the consumer thread
+	bool tryPop(T& out)
+	{
+		const size_t t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire))
+			return false;
+
+		out = std::move(slots[t & mask]);
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// Returns the number of items in the ring. This is only a snapshot if the other thread is active.
+	/// Safe to call from any thread: the result is always between 0 and capacity().
+	size_t size() const
+	{
+		// Load tail first: it never passes head, so a head loaded after it is at least as far along.
+		// A third thread can still see head race ahead by more than the capacity in between, so clamp.
+		const size_t t = tail.load(std::memory_order_acquire);
+		const size_t h = head.load(std::memory_order_acquire);
+		return std::min(h - t, mask + 1);
+	}
+
+	bool empty() const { return size() == 0; }
+
+	size_t capacity() const { return mask + 1; }
+
+	// No copying
+	SpscRing(const SpscRing&) = delete;
+	SpscRing& operator=(const SpscRing&) = delete;
+
+private:
+	std::vector<T> slots;
+
+	size_t mask; ///< capacity - 1, used to wrap indexes
+
+	/// Count of items ever pushed (written only by the producer).
+	/// Kept on its own cache line so the two threads don't contend over it.
+	alignas(64) std::atomic<size_t> head;
+
+	/// Count of items ever popped (written only by the consumer)
+	alignas(64) std::atomic<size_t> tail;
+};
@@ -1,4 +1,7 @@
 #pragma once
+
+#include <chrono>
+
 #include "VideoFrame.hpp"
 
 /// A video frame from a stream that contains additional information besides dimensions and pixel data.
@@ -10,13 +13,38 @@ public:
 	 * \param h Height of the frame
 	 * \param d Byte depth of each pixel
 	 * \param presTS presentation timestamp
+	 * \param resource Where the pixels are allocated from
 	 */
-	StreamVideoFrame(size_t w, size_t h, size_t d, int64_t presTS)
-		: VideoFrame(w, h, d, false), pts(presTS)
+	StreamVideoFrame(size_t w, size_t h, size_t d, int64_t presTS,
+	                 std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+		: VideoFrame(w, h, d, false, resource), pts(presTS), arrival()
+	{ }
+
+	/**
+	 * \brief Makes a frame that views pixels it doesn't own, such as those of a memory-mapped file
+	 * \param pix The pixels, which must outlive the frame
+	 * \param w Width of the frame
+	 * \param h Height of the frame
+	 * \param d Byte depth of each pixel
+	 * \param presTS presentation timestamp
+	 */
+	StreamVideoFrame(uint8_t* pix, size_t w, size_t h, size_t d, int64_t presTS)
+		: VideoFrame(pix, w, h, d, false), pts(presTS), arrival()
 	{ }
 
 	int64_t getPTS() const { return pts; }
 
+	/// Sets the presentation timestamp, for readers that reuse frames
+	void setPTS(int64_t presTS) { pts = presTS; }
+
+	/// Gets when the frame's data arrived from the source (or when it was due, if that was later),
+	/// for measuring latency. Readers stamp it when they pull the data from their input, so time it spent queued
+	/// before that isn't included. This is only set by readers in live mode, and is the clock's epoch otherwise.
+	std::chrono::steady_clock::time_point getArrivalTime() const { return arrival; }
+
+	void setArrivalTime(std::chrono::steady_clock::time_point t) { arrival = t; }
+
 private:
 	int64_t pts; /// Presentation timestamp (when this frame should be shown)
+	std::chrono::steady_clock::time_point arrival; ///< \see getArrivalTime
 };
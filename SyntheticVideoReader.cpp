@@ -0,0 +1,370 @@
+#include "precomp.hpp"
+#include "SyntheticVideoReader.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <random>
+
+#include "Exceptions.hpp"
+#include "MKMath.hpp"
+
+using namespace std;
+
+namespace {
+
+/// Noise is read from a random offset into this many samples (plus a row's worth, so a row never wraps)
+const size_t kNoiseTableSize = 1 << 16;
+
+/// The spacing of the random values the texture is interpolated between, in pixels
+const size_t kTextureCell = 16;
+
+/// How far each texture pixel strays from the interpolated values, so edges show up at every scale
+const int kTextureDetail = 12;
+
+/// Mixes a value into a well-distributed 64-bit hash (SplitMix64's finalizer)
+uint64_t mix(uint64_t v)
+{
+	v += 0x9e3779b97f4a7c15ull;
+	v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ull;
+	v = (v ^ (v >> 27)) * 0x94d049bb133111ebull;
+	return v ^ (v >> 31);
+}
+
+/// Returns where something starting at start and moving velocity each frame is after some frames,
+/// bouncing back and forth between 0 and range
+double bounce(double start, double velocity, int64_t frames, double range)
+{
+	if (range <= 0)
+		return 0;
+
+	double p = fmod(start + velocity * (double)frames, 2 * range);
+	if (p < 0)
+		p += 2 * range;
+	return p > range ? 2 * range - p : p;
+}
+
+/// Shades a row of three-byte source pixels into the destination: scaling them by the 8.8 fixed-point gain
+/// (rounding down), then adding noise. Any bytes past the third of each destination pixel are set to 255.
+/// A source step of 0 repeats the first source pixel across the row.
+template <size_t Depth>
+void shadeRow(const uint8_t* src, size_t srcStep, const int8_t* noise, unsigned int gain, uint8_t* dst, size_t pixels)
+{
+	// Rows of the background are contiguous bytes
+	if (Depth == 3 && srcStep == 3) {
+		const size_t bytes = pixels * 3;
+		size_t i = 0;
+#ifdef __SSE2__
+		// Shifting each byte into the high half of a 16-bit lane makes mulhi compute (byte * gain) >> 8
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i g = _mm_set1_epi16((short)gain);
+		for (; i + 16 <= bytes; i += 16) {
+			const __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+			const __m128i n = _mm_loadu_si128((const __m128i*)(noise + i));
+			const __m128i lo = _mm_add_epi16(_mm_mulhi_epu16(_mm_unpacklo_epi8(zero, s), g),
+			                                 _mm_srai_epi16(_mm_unpacklo_epi8(n, n), 8));
+			const __m128i hi = _mm_add_epi16(_mm_mulhi_epu16(_mm_unpackhi_epi8(zero, s), g),
+			                                 _mm_srai_epi16(_mm_unpackhi_epi8(n, n), 8));
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+		}
+#endif
+		for (; i < bytes; ++i)
+			dst[i] = (uint8_t)Math::clamp((int)((src[i] * gain) >> 8) + noise[i], 0, 255);
+		return;
+	}
+
+	for (size_t x = 0; x < pixels; ++x, src += srcStep, noise += 3, dst += Depth) {
+		for (size_t c = 0; c < 3; ++c)
+			dst[c] = (uint8_t)Math::clamp((int)((src[c] * gain) >> 8) + noise[c], 0, 255);
+		for (size_t c = 3; c < Depth; ++c)
+			dst[c] = 255;
+	}
+}
+
+} // end anonymous namespace
+
+constexpr int64_t SyntheticVideoReader::kTimeBase;
+constexpr int SyntheticVideoReader::kMaxJitter;
+
+SyntheticVideoReader::SyntheticVideoReader(size_t w, size_t h, double framesPerSecond, int64_t frames,
+                                           size_t d, uint32_t s)
+	: width(w),
+	  height(h),
+	  depth(d),
+	  fps(framesPerSecond),
+	  frameCount(frames),
+	  seed(s),
+	  background(),
+	  noise(),
+	  rects(),
+	  ramps(),
+	  maxJitter(0),
+	  nextIndex(0),
+	  currentFrame(),
+	  groundTruth(w, h, 1),
+	  truthRects(),
+	  cameraOffset(),
+	  lightingGain(1)
+{
+	if (width == 0 || height == 0)
+		throw Exceptions::ArgumentOutOfRangeException("Frames must be at least a pixel wide and high", __FUNCTION__);
+	if (depth != 3 && depth != 4)
+		throw Exceptions::ArgumentException("Frames must have 3 or 4 bytes per pixel", __FUNCTION__);
+	if (fps <= 0)
+		throw Exceptions::ArgumentOutOfRangeException("The frame rate must be positive", __FUNCTION__);
+	if (frameCount < 0)
+		throw Exceptions::ArgumentOutOfRangeException("The frame count can't be negative", __FUNCTION__);
+
+	// Interpolate between random values on a coarse grid, then add some fine detail
+	mt19937 rng(seed);
+	const size_t paddedWidth = width + 2 * kMaxJitter;
+	const size_t paddedHeight = height + 2 * kMaxJitter;
+	const size_t gridWidth = paddedWidth / kTextureCell + 2;
+	const size_t gridHeight = paddedHeight / kTextureCell + 2;
+	vector<uint8_t> grid(gridWidth * gridHeight * 3);
+	uniform_int_distribution<int> level(40, 200);
+	for (size_t i = 0; i < grid.size(); i += 3) {
+		const int gray = level(rng);
+		for (size_t c = 0; c < 3; ++c)
+			grid[i + c] = (uint8_t)Math::clamp(gray + (int)(rng() % 31) - 15, 0, 255);
+	}
+
+	uniform_int_distribution<int> detail(-kTextureDetail, kTextureDetail);
+	background.resize(paddedWidth * paddedHeight * 3);
+	uint8_t* bp = background.data();
+	for (size_t y = 0; y < paddedHeight; ++y) {
+		const size_t gy = y / kTextureCell;
+		const double fy = (double)(y % kTextureCell) / kTextureCell;
+		for (size_t x = 0; x < paddedWidth; ++x, bp += 3) {
+			const size_t gx = x / kTextureCell;
+			const double fx = (double)(x % kTextureCell) / kTextureCell;
+			const uint8_t* g00 = &grid[(gy * gridWidth + gx) * 3];
+			const uint8_t* g10 = g00 + 3;
+			const uint8_t* g01 = g00 + gridWidth * 3;
+			const uint8_t* g11 = g01 + 3;
+			for (size_t c = 0; c < 3; ++c) {
+				const double v = (g00[c] * (1 - fx) + g10[c] * fx) * (1 - fy) + (g01[c] * (1 - fx) + g11[c] * fx) * fy;
+				bp[c] = (uint8_t)Math::clamp((int)lround(v) + detail(rng), 0, 255);
+			}
+		}
+	}
+
+	setNoise(0);
+}
+
+uint32_t SyntheticVideoReader::addRect(const MovingRect& r)
+{
+	if (r.rect.empty() || r.rect.x + r.rect.width > width || r.rect.y + r.rect.height > height)
+		throw Exceptions::ArgumentOutOfRangeException("Rectangles must start within the frame", __FUNCTION__);
+
+	rects.push_back(r);
+	return (uint32_t)(rects.size() - 1);
+}
+
+void SyntheticVideoReader::setNoise(double sigma)
+{
+	if (sigma < 0 || sigma > 32)
+		throw Exceptions::ArgumentOutOfRangeException("Noise must be between 0 and 32", __FUNCTION__);
+
+	// Each row reads its noise from somewhere in the table, so tables are unique per seed, not per frame
+	noise.resize(kNoiseTableSize + width * 3);
+	mt19937 rng(seed ^ 0x5eedu);
+	normal_distribution<double> gaussian(0, sigma > 0 ? sigma : 1);
+	for (int8_t& n : noise)
+		n = sigma > 0 ? (int8_t)Math::clamp((int)lround(gaussian(rng)), -127, 127) : 0;
+}
+
+void SyntheticVideoReader::addLightingRamp(int64_t startFrame, int64_t frames, double gain)
+{
+	if (startFrame < 0 || frames < 0)
+		throw Exceptions::ArgumentOutOfRangeException("Lighting ramps can't start or last a negative number of frames",
+		                                              __FUNCTION__);
+	if (gain < 0 || gain > 4)
+		throw Exceptions::ArgumentOutOfRangeException("Lighting gain must be between 0 and 4", __FUNCTION__);
+	if (!ramps.empty() && startFrame < ramps.back().startFrame + ramps.back().frames)
+		throw Exceptions::ArgumentException("Lighting ramps must be added in order and not overlap", __FUNCTION__);
+
+	ramps.push_back(LightingRamp{ startFrame, frames, gain });
+}
+
+void SyntheticVideoReader::setJitter(int maxPixels)
+{
+	if (maxPixels < 0 || maxPixels > kMaxJitter)
+		throw Exceptions::ArgumentOutOfRangeException("Jitter must be between 0 and 16 pixels", __FUNCTION__);
+
+	maxJitter = maxPixels;
+}
+
+const shared_ptr<StreamVideoFrame>& SyntheticVideoReader::getNextFrame()
+{
+	if (nextIndex >= frameCount) {
+		currentFrame = nullptr;
+		return currentFrame;
+	}
+
+	const int64_t index = nextIndex++;
+	const int64_t pts = frameToTimestamp(index);
+	if (currentFrame != nullptr && currentFrame.use_count() == 1) {
+		// Don't overwrite the frame before the last thread to hold it (e.g. a Pipeline stage) is done reading it
+		atomic_thread_fence(memory_order_acquire);
+		currentFrame->setPTS(pts);
+	}
+	else
+		currentFrame = make_shared<StreamVideoFrame>(width, height, depth, pts);
+
+	if (depth == 3)
+		render<3>(index, *currentFrame);
+	else
+		render<4>(index, *currentFrame);
+	drawGroundTruth();
+
+	frameWidth = width;
+	frameHeight = height;
+	frameDepth = depth;
+	aspectRatio = (float)width / height;
+	return currentFrame;
+}
+
+template <size_t Depth>
+void SyntheticVideoReader::render(int64_t index, StreamVideoFrame& frame)
+{
+	const uint64_t frameHash = mix(((uint64_t)seed << 32) ^ (uint64_t)index);
+
+	// The camera looks at the scene from a random offset each frame
+	const uint64_t span = 2 * (uint64_t)maxJitter + 1;
+	cameraOffset = PixelPoint((int)(frameHash % span) - maxJitter, (int)((frameHash >> 32) % span) - maxJitter);
+
+	lightingGain = gainAt(index);
+	const unsigned int gain = (unsigned int)lround(lightingGain * 256);
+
+	// Each row of the frame gets its own stretch of the noise table
+	const auto rowNoise = [&](size_t y) {
+		return noise.data() + mix(frameHash + y) % kNoiseTableSize;
+	};
+
+	const size_t paddedWidth = width + 2 * kMaxJitter;
+	for (size_t y = 0; y < height; ++y) {
+		const uint8_t* src = background.data()
+			+ ((y + kMaxJitter + cameraOffset.y) * paddedWidth + kMaxJitter + cameraOffset.x) * 3;
+		shadeRow<Depth>(src, 3, rowNoise(y), gain, frame.getPixel(0, y), width);
+	}
+
+	// Rectangles are in the scene, so the camera's offset moves them too
+	truthRects.clear();
+	for (const MovingRect& r : rects) {
+		const double x = bounce((double)r.rect.x, r.dx, index, (double)(width - r.rect.width));
+		const double y = bounce((double)r.rect.y, r.dy, index, (double)(height - r.rect.height));
+		const int left = max((int)lround(x) - cameraOffset.x, 0);
+		const int top = max((int)lround(y) - cameraOffset.y, 0);
+		const int right = min((int)lround(x) - cameraOffset.x + (int)r.rect.width, (int)width);
+		const int bottom = min((int)lround(y) - cameraOffset.y + (int)r.rect.height, (int)height);
+		const PixelRect onScreen(left, top, max(right - left, 0), max(bottom - top, 0));
+		if (r.dx != 0 || r.dy != 0)
+			truthRects.push_back(onScreen);
+		if (onScreen.empty())
+			continue;
+
+		const uint8_t color[3] = { r.red, r.green, r.blue };
+		for (size_t row = onScreen.y; row < onScreen.y + onScreen.height; ++row) {
+			shadeRow<Depth>(color, 0, rowNoise(row) + onScreen.x * 3, gain, frame.getPixel(onScreen.x, row),
+			                onScreen.width);
+		}
+	}
+}
+
+void SyntheticVideoReader::drawGroundTruth()
+{
+	groundTruth.wipe();
+	for (const PixelRect& r : truthRects) {
+		for (size_t y = r.y; y < r.y + r.height; ++y)
+			memset(groundTruth.getPixel(r.x, y), 255, r.width);
+	}
+}
+
+double SyntheticVideoReader::gainAt(int64_t index) const
+{
+	double gain = 1;
+	for (const LightingRamp& ramp : ramps) {
+		if (index < ramp.startFrame)
+			break;
+		if (index >= ramp.startFrame + ramp.frames) {
+			gain = ramp.gain;
+			continue;
+		}
+		// Partway through the ramp
+		const double progress = (double)(index - ramp.startFrame) / ramp.frames;
+		return gain + (ramp.gain - gain) * progress;
+	}
+	return gain;
+}
+
+SyntheticVideoReader::MaskScore SyntheticVideoReader::scoreMask(const VideoFrame& mask) const
+{
+	if (mask.getWidth() == 0 || mask.getHeight() == 0)
+		throw Exceptions::ArgumentException("The mask is empty", __FUNCTION__);
+
+	const size_t ratio = width / mask.getWidth();
+	if (ratio == 0 || height / mask.getHeight() != ratio)
+		throw Exceptions::ArgumentException("The mask must be the frame's size, or downscaled from it", __FUNCTION__);
+
+	MaskScore score = { 0, 0, 0 };
+	const size_t depthOfMask = mask.getBytesPerPixel();
+	for (size_t y = 0; y < mask.getHeight(); ++y) {
+		const uint8_t* mp = mask.getPixel(0, y);
+		const uint8_t* tp = groundTruth.getPixel(ratio / 2, y * ratio + ratio / 2);
+		for (size_t x = 0; x < mask.getWidth(); ++x, mp += depthOfMask, tp += ratio) {
+			const bool moving = mp[0] != 0;
+			const bool truth = *tp != 0;
+			score.hits += moving && truth;
+			score.misses += !moving && truth;
+			score.falseAlarms += moving && !truth;
+		}
+	}
+	return score;
+}
+
+int64_t SyntheticVideoReader::frameToTimestamp(int64_t index) const
+{
+	return llround((double)index * kTimeBase / fps);
+}
+
+int64_t SyntheticVideoReader::getVideoLength() const
+{
+	return frameToTimestamp(frameCount);
+}
+
+void SyntheticVideoReader::seek(int64_t ts)
+{
+	// Start from the estimate, then correct for rounding
+	int64_t index = Math::clamp((int64_t)ceil((double)ts * fps / kTimeBase), (int64_t)0, frameCount);
+	while (index > 0 && frameToTimestamp(index - 1) >= ts)
+		--index;
+	while (index < frameCount && frameToTimestamp(index) < ts)
+		++index;
+	nextIndex = index;
+}
+
+int64_t SyntheticVideoReader::clocksToTimestamp(clock_t c) const
+{
+	return llround((double)c * kTimeBase / CLOCKS_PER_SEC);
+}
+
+int64_t SyntheticVideoReader::durationToTimestamp(const std::chrono::milliseconds& d) const
+{
+	return llround((double)d.count() * kTimeBase / 1000);
+}
+
+clock_t SyntheticVideoReader::timestampToClocks(int64_t ts) const
+{
+	return (clock_t)llround((double)ts * CLOCKS_PER_SEC / kTimeBase);
+}
+
+std::chrono::milliseconds SyntheticVideoReader::timestampToDuration(int64_t ts) const
+{
+	return std::chrono::milliseconds(llround((double)ts * 1000 / kTimeBase));
+}
+
+int64_t SyntheticVideoReader::timestampToSeconds(int64_t ts) const
+{
+	return llround((double)ts / kTimeBase);
+}
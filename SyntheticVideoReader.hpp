@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "PixelPoint.hpp"
+#include "PixelRect.hpp"
+#include "StreamVideoFrame.hpp"
+#include "VideoReader.hpp"
+
+/**
+ * \brief Generates video procedurally, with known ground truth, for benchmarks and accuracy checks
+ *
+ * Frames show a fixed random texture with rectangles bouncing around on it, optionally with Gaussian noise,
+ * lighting ramps, and camera jitter. Everything about a frame is a function of the seed and the frame's index,
+ * so the same settings always generate the same video, and seeking is instant.
+ * Frames are generated at memory speed, so timing a MotionExtractor against this reader doesn't measure decoding.
+ *
+ * Alongside each frame, the reader keeps a ground-truth mask of the pixels covered by moving rectangles.
+ * Camera jitter and lighting changes aren't motion, so they never show up in it.
+ *
+ * Settings should be changed before reading frames; changes only affect frames generated afterwards.
+ */
+class SyntheticVideoReader final : public VideoReader {
+public:
+	/// Time stamps are in ticks of this many per second
+	static constexpr int64_t kTimeBase = 90000;
+
+	/// The largest camera jitter, in pixels
+	static constexpr int kMaxJitter = 16;
+
+	/// A rectangle of solid color moving at a constant velocity, bouncing off the edges of the frame
+	struct MovingRect {
+		PixelRect rect; ///< Where the rectangle is in the first frame (which must be within the frame)
+		double dx; ///< How far the rectangle moves right each frame, in pixels
+		double dy; ///< How far the rectangle moves down each frame, in pixels
+		uint8_t red;
+		uint8_t green;
+		uint8_t blue;
+	};
+
+	/// How a motion mask compares to the ground truth (see scoreMask)
+	struct MaskScore {
+		uint64_t hits; ///< Pixels moving in both the mask and the ground truth
+		uint64_t misses; ///< Pixels only moving in the ground truth
+		uint64_t falseAlarms; ///< Pixels only moving in the mask
+	};
+
+	/**
+	 * \brief Constructor
+	 * \param width The width of the frames
+	 * \param height The height of the frames
+	 * \param fps The frame rate, in frames per second
+	 * \param frameCount The number of frames in the video
+	 * \param depth The bytes per pixel of the frames: 3 for RGB, or 4 for RGB with a padding byte
+	 * \param seed Seeds the texture, noise, and jitter
+	 */
+	SyntheticVideoReader(size_t width, size_t height, double fps = 30, int64_t frameCount = 300,
+	                     size_t depth = 3, uint32_t seed = 1);
+
+	/**
+	 * \brief Adds a moving rectangle, drawn over those added before it
+	 * \returns The index of the rectangle
+	 *
+	 * Rectangles that don't move are drawn, but aren't part of the ground truth.
+	 */
+	uint32_t addRect(const MovingRect& r);
+
+	/// Sets the standard deviation (0 to 32) of the Gaussian noise added to each channel of each pixel
+	void setNoise(double sigma);
+
+	/**
+	 * \brief Adds a lighting ramp
+	 * \param startFrame The frame the ramp starts on
+	 * \param frames The number of frames the ramp lasts (0 for an instant change)
+	 * \param gain The brightness at the end of the ramp, relative to the unlit scene (0 to 4)
+	 *
+	 * The brightness changes linearly from where the previous ramp left it (or from 1) to the gain.
+	 * Ramps must be added in order, and not overlap.
+	 */
+	void addLightingRamp(int64_t startFrame, int64_t frames, double gain);
+
+	/// Sets how far (0 to kMaxJitter pixels) the camera randomly shifts in each direction from frame to frame
+	void setJitter(int maxPixels);
+
+	const std::shared_ptr<StreamVideoFrame>& getCurrentFrame() const override { return currentFrame; }
+
+	/**
+	 * \brief Generates the next frame
+	 *
+	 * If the caller has let go of the previous frame, the next one reuses its pixels.
+	 */
+	const std::shared_ptr<StreamVideoFrame>& getNextFrame() override;
+
+	double getFPS() const override { return fps; }
+
+	int64_t getVideoLength() const override;
+
+	/// Seeks so that the next frame is the first at or after the time stamp
+	void seek(int64_t ts) override;
+
+	int64_t clocksToTimestamp(clock_t c) const override;
+
+	int64_t durationToTimestamp(const std::chrono::milliseconds& d) const override;
+
+	clock_t timestampToClocks(int64_t ts) const override;
+
+	std::chrono::milliseconds timestampToDuration(int64_t ts) const override;
+
+	int64_t timestampToSeconds(int64_t ts) const override;
+
+	/// Gets the current frame's ground truth: a byte per pixel, 255 where a moving rectangle is and 0 elsewhere
+	const VideoFrame& getGroundTruth() const { return groundTruth; }
+
+	/// Gets where the moving rectangles are in the current frame (clipped to the frame), in the order they were added
+	const std::vector<PixelRect>& getGroundTruthRects() const { return truthRects; }
+
+	/// Gets how far the camera was shifted for the current frame
+	const PixelPoint& getCameraOffset() const { return cameraOffset; }
+
+	/// Gets the current frame's brightness relative to the unlit scene
+	double getLightingGain() const { return lightingGain; }
+
+	/**
+	 * \brief Compares a motion mask of the current frame with the ground truth
+	 * \param mask The mask, whose motion is in its first channel. It may be downscaled from the frame
+	 *             by a whole ratio, like MotionExtractor's, in which case each of its pixels is compared with
+	 *             the ground truth at the center of the block of frame pixels it covers.
+	 */
+	MaskScore scoreMask(const VideoFrame& mask) const;
+
+	// No copying
+	SyntheticVideoReader(const SyntheticVideoReader&) = delete;
+	SyntheticVideoReader& operator=(const SyntheticVideoReader&) = delete;
+
+private:
+	/// Returns the time stamp of a frame
+	int64_t frameToTimestamp(int64_t index) const;
+
+	/// Returns the lighting gain of a frame
+	double gainAt(int64_t index) const;
+
+	/// Draws the frame with the given index
+	template <size_t Depth>
+	void render(int64_t index, StreamVideoFrame& frame);
+
+	/// Draws the ground truth for the rectangles' current positions
+	void drawGroundTruth();
+
+	/// A lighting ramp (see addLightingRamp)
+	struct LightingRamp {
+		int64_t startFrame;
+		int64_t frames;
+		double gain;
+	};
+
+	size_t width;
+	size_t height;
+	size_t depth;
+	double fps;
+	int64_t frameCount;
+	uint32_t seed;
+
+	/// The scene's texture, three bytes per pixel, with kMaxJitter pixels of margin on every side for jitter
+	std::vector<uint8_t> background;
+
+	/// Gaussian noise samples, which each row of each frame reads from a random offset
+	std::vector<int8_t> noise;
+
+	std::vector<MovingRect> rects; ///< \see addRect
+	std::vector<LightingRamp> ramps; ///< \see addLightingRamp
+	int maxJitter; ///< \see setJitter
+
+	int64_t nextIndex; ///< The index of the next frame to generate
+	std::shared_ptr<StreamVideoFrame> currentFrame;
+	VideoFrame groundTruth;
+	std::vector<PixelRect> truthRects; ///< \see getGroundTruthRects
+	PixelPoint cameraOffset; ///< \see getCameraOffset
+	double lightingGain; ///< \see getLightingGain
+};
@@ -0,0 +1,140 @@
+#include "precomp.hpp"
+#include "Tripwire.hpp"
+
+#include <cmath>
+#include <cstdlib>
+
+#include "Exceptions.hpp"
+
+using namespace std;
+
+namespace {
+
+/// Appends the mask offset of each pixel on the line from a to b that lies within the mask
+void traceLine(PixelPoint a, const PixelPoint& b, size_t width, size_t height, size_t depth, vector<size_t>& offsets)
+{
+	const int dx = abs(b.x - a.x);
+	const int dy = -abs(b.y - a.y);
+	const int sx = a.x < b.x ? 1 : -1;
+	const int sy = a.y < b.y ? 1 : -1;
+	int err = dx + dy;
+	while (true) {
+		if (a.x >= 0 && a.y >= 0 && (size_t)a.x < width && (size_t)a.y < height)
+			offsets.push_back(((size_t)a.y * width + (size_t)a.x) * depth);
+		if (a.x == b.x && a.y == b.y)
+			break;
+
+		const int e2 = 2 * err;
+		if (e2 >= dy) {
+			err += dy;
+			a.x += sx;
+		}
+		if (e2 <= dx) {
+			err += dx;
+			a.y += sy;
+		}
+	}
+}
+
+} // end anonymous namespace
+
+Tripwire::Tripwire(const PixelPoint& f, const PixelPoint& t,
+                   size_t maskWidth, size_t maskHeight, size_t bytesPerPixel,
+                   int g, uint32_t minPix)
+	: from(f),
+	  to(t),
+	  gap(g),
+	  minPixels(minPix),
+	  leftOffsets(),
+	  rightOffsets(),
+	  state(State::Clear),
+	  lastCrossing(0),
+	  forwardCount(0),
+	  backwardCount(0)
+{
+	if (from.x == to.x && from.y == to.y)
+		throw Exceptions::ArgumentException("A tripwire's ends must be different points", __FUNCTION__);
+	if (gap < 2 || gap > 64)
+		throw Exceptions::ArgumentOutOfRangeException("Tripwire gap must be between 2 and 64 pixels", __FUNCTION__);
+	if (minPixels == 0)
+		throw Exceptions::ArgumentOutOfRangeException("A tripwire needs at least one moving pixel to trip",
+		                                              __FUNCTION__);
+
+	// Looking along the wire with y pointing down, the left side is along (dy, -dx)
+	const double dx = to.x - from.x;
+	const double dy = to.y - from.y;
+	const double length = hypot(dx, dy);
+	const int ox = (int)lround(dy / length * gap / 2);
+	const int oy = (int)lround(-dx / length * gap / 2);
+	traceLine(PixelPoint(from.x + ox, from.y + oy), PixelPoint(to.x + ox, to.y + oy),
+	          maskWidth, maskHeight, bytesPerPixel, leftOffsets);
+	traceLine(PixelPoint(from.x - ox, from.y - oy), PixelPoint(to.x - ox, to.y - oy),
+	          maskWidth, maskHeight, bytesPerPixel, rightOffsets);
+
+	if (leftOffsets.size() < minPixels || rightOffsets.size() < minPixels)
+		throw Exceptions::ArgumentOutOfRangeException("Not enough of the tripwire is inside the motion mask",
+		                                              __FUNCTION__);
+}
+
+bool Tripwire::occupied(const uint8_t* mask, const vector<size_t>& offsets) const
+{
+	uint32_t moving = 0;
+	for (size_t offset : offsets) {
+		moving += mask[offset] != 0;
+	}
+	return moving >= minPixels;
+}
+
+int Tripwire::update(const uint8_t* mask)
+{
+	const bool left = occupied(mask, leftOffsets);
+	const bool right = occupied(mask, rightOffsets);
+
+	lastCrossing = 0;
+	switch (state) {
+		case State::Clear:
+			// Something showing up on both sides at once has no direction, so wait for it to leave
+			if (left && right)
+				state = State::Crossed;
+			else if (left)
+				state = State::LeftFirst;
+			else if (right)
+				state = State::RightFirst;
+			break;
+
+		case State::LeftFirst:
+			if (right) {
+				lastCrossing = 1;
+				++forwardCount;
+				state = State::Crossed;
+			}
+			else if (!left) {
+				// It backed off without crossing
+				state = State::Clear;
+			}
+			break;
+
+		case State::RightFirst:
+			if (left) {
+				lastCrossing = -1;
+				++backwardCount;
+				state = State::Crossed;
+			}
+			else if (!right) {
+				state = State::Clear;
+			}
+			break;
+
+		case State::Crossed:
+			if (!left && !right)
+				state = State::Clear;
+			break;
+	}
+	return lastCrossing;
+}
+
+void Tripwire::reset()
+{
+	state = State::Clear;
+	lastCrossing = 0;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "PixelPoint.hpp"
+
+/**
+ * \brief A virtual tripwire that counts objects crossing a line of the motion mask
+ *
+ * Like a pair of loop detectors in a road, the tripwire watches two lines running alongside it,
+ * one on each side. Something that shows up on one of them and then on the other has crossed the wire.
+ * Both lines are traced with Bresenham's algorithm when the tripwire is created, so each frame only reads
+ * the mask pixels along them (a few hundred at most) rather than the whole mask.
+ *
+ * The sides are named as seen looking along the wire, from `from` toward `to`, in the image
+ * (so for a wire drawn left to right, the left side is above it).
+ * The wire tracks one crossing at a time, so objects crossing side by side are counted once.
+ */
+class Tripwire final {
+public:
+	/**
+	 * \brief Constructor
+	 * \param from One end of the wire, in motion mask coordinates
+	 * \param to The other end of the wire
+	 * \param maskWidth The width of the motion mask, in pixels
+	 * \param maskHeight The height of the motion mask, in pixels
+	 * \param bytesPerPixel The motion mask's bytes per pixel (the motion channel is the first)
+	 * \param gap The distance between the two lines that are watched, in pixels
+	 * \param minPixels The number of moving pixels on one of those lines that counts as something being on it
+	 */
+	Tripwire(const PixelPoint& from, const PixelPoint& to,
+	         size_t maskWidth, size_t maskHeight, size_t bytesPerPixel,
+	         int gap = 4, uint32_t minPixels = 3);
+
+	/**
+	 * \brief Samples the motion mask along the wire
+	 * \param mask The motion mask's pixels
+	 * \returns 1 if something that showed up on the left side just reached the right side,
+	 *          -1 if something crossed from the right side to the left, or 0
+	 */
+	int update(const uint8_t* mask);
+
+	/// Forgets about anything on the wire (but keeps the counts)
+	void reset();
+
+	/// Returns the result of the last update
+	int getLastCrossing() const { return lastCrossing; }
+
+	/// Returns the number of crossings from the left side to the right
+	uint64_t getForwardCount() const { return forwardCount; }
+
+	/// Returns the number of crossings from the right side to the left
+	uint64_t getBackwardCount() const { return backwardCount; }
+
+	const PixelPoint& getFrom() const { return from; }
+
+	const PixelPoint& getTo() const { return to; }
+
+	int getGap() const { return gap; }
+
+	uint32_t getMinPixels() const { return minPixels; }
+
+private:
+	/// Where the wire is in its crossing
+	enum class State {
+		Clear, ///< Neither side has anything on it
+		LeftFirst, ///< Something showed up on the left side first
+		RightFirst, ///< Something showed up on the right side first
+		Crossed ///< A crossing was counted, waiting for both sides to clear
+	};
+
+	/// Returns true if at least minPixels of the given pixels are moving
+	bool occupied(const uint8_t* mask, const std::vector<size_t>& offsets) const;
+
+	PixelPoint from;
+	PixelPoint to;
+	int gap;
+	uint32_t minPixels;
+
+	std::vector<size_t> leftOffsets; ///< Byte offsets into the mask of the pixels of the line on the left side
+	std::vector<size_t> rightOffsets; ///< Byte offsets into the mask of the pixels of the line on the right side
+
+	State state;
+	int lastCrossing; ///< \see getLastCrossing
+	uint64_t forwardCount; ///< \see getForwardCount
+	uint64_t backwardCount; ///< \see getBackwardCount
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstring>
+#include <memory_resource>
 
 #include "Exceptions.hpp"
 
@@ -8,6 +9,9 @@
 class VideoFrame {
 public:
 
+	/// The alignment of the pixels of frames that allocate their own
+	static constexpr size_t kAlignment = 64;
+
 	/**
 	 * \brief Creates a frame from existing pixel data.
 	 * \param pix The pixel data on which to base the frame
@@ -16,17 +20,20 @@ public:
 	 * \param d Byte depth of each pixel
 	 * \param makeCopy true to make a copy of the data. If this is false, the frame is not responsible for managing
 	 *                 the pixel memory
+	 * \param resource Where the copy is allocated from
 	 */
-	VideoFrame(uint8_t* pix, size_t w, size_t h, size_t d, bool makeCopy)
+	VideoFrame(uint8_t* pix, size_t w, size_t h, size_t d, bool makeCopy,
+	           std::pmr::memory_resource* resource = std::pmr::get_default_resource())
 		: pixels(pix),
 		  width(w),
 		  height(h),
 		  depth(d),
 		  totalSize(w * h * d),
-		  ownsPixels(makeCopy)
+		  ownsPixels(makeCopy),
+		  memory(resource)
 	{
 		if (makeCopy) {
-			pixels = new uint8_t[width * height * depth];
+			pixels = allocate();
 			memcpy(pixels, pix, totalSize);
 		}
 	}
@@ -37,34 +44,39 @@ public:
 	 * \param h Height of the frame
 	 * \param d Byte depth of each pixel
 	 * \param zero True to zero the frame, otherwise leave it uninitialized.
+	 * \param resource Where the pixels are allocated from (e.g. a per-thread pool, or a HugePageResource)
 	 */
-	VideoFrame(size_t w, size_t h, size_t d, bool zero = true)
+	VideoFrame(size_t w, size_t h, size_t d, bool zero = true,
+	           std::pmr::memory_resource* resource = std::pmr::get_default_resource())
 		: pixels(nullptr),
 		  width(w),
 		  height(h),
 		  depth(d),
 		  totalSize(w * h * d),
-		  ownsPixels(true)
+		  ownsPixels(true),
+		  memory(resource)
 	{
-		pixels = new uint8_t[totalSize];
+		pixels = allocate();
 		if (zero)
 			memset(pixels, 0, totalSize);
 	}
 
-	/// Constructs a video frame from another frame
+	/// Constructs a video frame from another frame.
+	/// Like the standard library's polymorphic allocators, the copy uses the default memory resource.
 	VideoFrame(const VideoFrame& other)
 		: pixels(nullptr),
 		  width(other.width),
 		  height(other.height),
 		  depth(other.depth),
 		  totalSize(other.totalSize),
-		  ownsPixels(true)
+		  ownsPixels(true),
+		  memory(std::pmr::get_default_resource())
 	{
-		pixels = new uint8_t[totalSize];
+		pixels = allocate();
 		memcpy(pixels, other.pixels, totalSize);
 	}
 
-	virtual ~VideoFrame() { if(ownsPixels) delete[] pixels; }
+	virtual ~VideoFrame() { if(ownsPixels) memory->deallocate(pixels, totalSize, kAlignment); }
 
 	/// Memsets the frame to a given value (or a default of 0)
 	void wipe(int memsetTo = 0)
@@ -95,6 +107,9 @@ public:
 
 	size_t getBytesPerPixel() const { return depth; }
 
+	/// Returns the memory resource the frame allocates its pixels from
+	std::pmr::memory_resource* getMemoryResource() const { return memory; }
+
 	VideoFrame& operator= (const VideoFrame& other)
 	{
 		if (width != other.width || height != other.height || depth != other.depth)
@@ -108,11 +123,19 @@ public:
 
 private:
 
+	uint8_t* allocate()
+	{
+		if (memory == nullptr)
+			throw Exceptions::ArgumentNullException("The memory resource cannot be null", __FUNCTION__);
+		return static_cast<uint8_t*>(memory->allocate(totalSize, kAlignment));
+	}
+
 	uint8_t* pixels;
 	size_t width;
 	size_t height;
 	size_t depth;
 	size_t totalSize;
 	bool ownsPixels;
+	std::pmr::memory_resource* memory;
 
 };
@@ -0,0 +1,201 @@
+#include "precomp.hpp" // Precompiled headers (all extrenal library headers)
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "MotionExtractor.hpp"
+#include "SyntheticVideoReader.hpp"
+#include "VideoFrame.hpp"
+
+using namespace std;
+
+namespace {
+
+const size_t kWidth = 1280;
+const size_t kHeight = 720;
+const double kFPS = 30.0;
+const int kFrames = 120;
+
+/// Timed passes over the frames for each configuration (after one untimed pass to warm up)
+const int kPasses = 10;
+
+/// Frames per second over the timed passes
+struct Rate {
+	double mean;
+	double deviation; ///< Standard deviation between passes
+};
+
+/// Sets up a reader that generates noisy frames with a box moving across them
+void addScene(SyntheticVideoReader& reader)
+{
+	reader.setNoise(6);
+	reader.addRect(SyntheticVideoReader::MovingRect{ PixelRect(0, 300, 100, 100), 8, 0, 220, 220, 220 });
+}
+
+/// Generates the frames up front, so that only the motion extractor is measured (not even frame generation)
+vector<VideoFrame> makeFrames(int count, size_t depth)
+{
+	SyntheticVideoReader reader(kWidth, kHeight, kFPS, count, depth, 42);
+	addScene(reader);
+
+	vector<VideoFrame> frames;
+	frames.reserve(count);
+	while (const shared_ptr<StreamVideoFrame>& frame = reader.getNextFrame())
+		frames.emplace_back(*frame);
+	return frames;
+}
+
+/// Runs the extractor against the reader's ground truth, printing how much of the truth it found
+/// and how much motion it reported where there was none
+template <typename ConfigureReader, typename ConfigureExtractor>
+void score(size_t ratio, const char* scene, ConfigureReader configureReader, const char* setup,
+           ConfigureExtractor configureExtractor)
+{
+	SyntheticVideoReader reader(kWidth, kHeight, kFPS, kFrames, 3, 42);
+	addScene(reader);
+	configureReader(reader);
+	MotionExtractor extractor(kWidth, kHeight, kFPS, false, ratio);
+	configureExtractor(extractor);
+
+	SyntheticVideoReader::MaskScore total = { 0, 0, 0 };
+	while (const shared_ptr<StreamVideoFrame>& frame = reader.getNextFrame()) {
+		const SyntheticVideoReader::MaskScore s = reader.scoreMask(extractor.generateMotionMask(*frame));
+		total.hits += s.hits;
+		total.misses += s.misses;
+		total.falseAlarms += s.falseAlarms;
+	}
+	const double truth = (double)(total.hits + total.misses);
+	printf("%-6zu %-10s %-14s %9.1f%% %11.2f%%\n", ratio, scene, setup, 100 * total.hits / truth,
+	       100 * total.falseAlarms / truth);
+}
+
+/// Runs an extractor for each configuration over the frames kPasses times, and returns the frame rate of each.
+/// The extractors take turns a pass at a time, so that anything else running on the machine disturbs them alike.
+vector<Rate> measure(const vector<VideoFrame>& frames, size_t ratio,
+                     const vector<function<void(MotionExtractor&)>>& configurations)
+{
+	vector<unique_ptr<MotionExtractor>> extractors;
+	for (const auto& configure : configurations) {
+		extractors.emplace_back(new MotionExtractor(kWidth, kHeight, kFPS, false, ratio));
+		configure(*extractors.back());
+	}
+
+	vector<vector<double>> rates(extractors.size());
+	for (int pass = 0; pass <= kPasses; ++pass) {
+		for (size_t i = 0; i < extractors.size(); ++i) {
+			const auto start = chrono::steady_clock::now();
+			for (const auto& frame : frames)
+				extractors[i]->generateMotionMask(frame);
+			const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+			if (pass > 0)
+				rates[i].push_back(frames.size() / elapsed.count());
+		}
+	}
+
+	vector<Rate> results;
+	for (const vector<double>& r : rates) {
+		double mean = 0, variance = 0;
+		for (double x : r)
+			mean += x / r.size();
+		for (double x : r)
+			variance += (x - mean) * (x - mean) / (r.size() - 1);
+		results.push_back(Rate{ mean, sqrt(variance) });
+	}
+	return results;
+}
+
+} // end anonymous namespace
+
+int main()
+{
+	const vector<VideoFrame> rgbFrames = makeFrames(kFrames, 3);
+	const vector<VideoFrame> rgbaFrames = makeFrames(kFrames, 4);
+
+	printf("%zux%zu, %d frames, fps as mean +- standard deviation of %d passes\n", kWidth, kHeight, kFrames, kPasses);
+	for (size_t ratio : {1, 2, 4}) {
+		const MotionExtractor normal(kWidth, kHeight, kFPS, false, ratio);
+		const MotionExtractor lowMemory(kWidth, kHeight, kFPS, false, ratio, true);
+		printf("ratio %zu memory: %zu bytes (%zu in low-memory mode)\n", ratio,
+		       normal.memoryUsage(), lowMemory.memoryUsage());
+	}
+	// Kernels specialized for each configuration, next to the generic ones that check the settings as they go.
+	// The generic kernels are there to check the specialized ones against, so a difference only means something
+	// where it's well outside both spreads.
+	printf("%-6s %-6s %-10s %-10s %18s %18s\n", "depth", "ratio", "erosion", "threshold", "specialized", "generic");
+	for (size_t depth = 3; depth <= 4; ++depth) {
+		const vector<VideoFrame>& frames = depth == 3 ? rgbFrames : rgbaFrames;
+		for (size_t ratio : {1, 2, 4}) {
+			for (int erosion : {5, 0}) {
+				for (bool adaptive : {false, true}) {
+					vector<function<void(MotionExtractor&)>> configurations;
+					for (bool generic : {false, true}) {
+						configurations.push_back([=](MotionExtractor& e) {
+							e.setErosion(erosion);
+							e.setNoiseAdaptive(adaptive);
+							e.setGenericKernels(generic);
+						});
+					}
+					const vector<Rate> fps = measure(frames, ratio, configurations);
+					printf("%-6zu %-6zu %-10s %-10s %9.1f +- %5.1f %9.1f +- %5.1f\n", depth, ratio,
+					       erosion > 0 ? "on" : "off", adaptive ? "adaptive" : "fixed",
+					       fps[0].mean, fps[0].deviation, fps[1].mean, fps[1].deviation);
+				}
+			}
+		}
+	}
+
+	// Only the tiles around the box are refined, so the saving grows with the frame's share of static pixels
+	printf("\ncoarse-to-fine, depth 3\n%-6s %-8s %18s\n", "ratio", "factor", "fps");
+	for (size_t ratio : {1, 2}) {
+		const size_t factors[] = { 0, 4, 8 };
+		vector<function<void(MotionExtractor&)>> configurations;
+		for (size_t factor : factors)
+			configurations.push_back([=](MotionExtractor& e) { e.setCoarseToFine(factor); });
+		const vector<Rate> fps = measure(rgbFrames, ratio, configurations);
+		for (size_t i = 0; i < fps.size(); ++i) {
+			printf("%-6zu %-8s %9.1f +- %5.1f\n", ratio, factors[i] > 0 ? to_string(factors[i]).c_str() : "off",
+			       fps[i].mean, fps[i].deviation);
+		}
+	}
+
+	// Shake compensation is scored both ways, since at coarse ratios a shake can be under a pixel
+	const auto compensated = [](MotionExtractor& e) {
+		e.setShakeCompensation(true);
+		e.setIlluminationCompensation(true);
+	};
+	const auto uncompensated = [](MotionExtractor&) { };
+	const auto coarseToFine = [&](MotionExtractor& e) {
+		compensated(e);
+		e.setCoarseToFine(4);
+	};
+	const auto jitter = [](SyntheticVideoReader& r) { r.setJitter(2); };
+	// A lane of traffic that keeps most of its pixels moving, which must not teach adaptive thresholds
+	// that motion is noise
+	const auto busy = [](SyntheticVideoReader& r) {
+		for (int i = 0; i < 50; ++i) {
+			const uint8_t shade = i % 2 == 0 ? 30 : 230;
+			r.addRect(SyntheticVideoReader::MovingRect{ PixelRect(6 + i * 12, 150, 6, 60), 6, 0, shade, shade, shade });
+		}
+	};
+	const auto adaptive = [](MotionExtractor& e) { e.setNoiseAdaptive(true); };
+	printf("\naccuracy\n%-6s %-10s %-14s %10s %12s\n", "ratio", "scene", "extractor", "found", "false alarm");
+	for (size_t ratio : {1, 2, 4}) {
+		score(ratio, "plain", [](SyntheticVideoReader&) { }, "compensated", compensated);
+		score(ratio, "plain", [](SyntheticVideoReader&) { }, "coarse 4", coarseToFine);
+		score(ratio, "jitter", jitter, "compensated", compensated);
+		score(ratio, "jitter", jitter, "uncompensated", uncompensated);
+		score(ratio, "lights on", [](SyntheticVideoReader& r) { r.addLightingRamp(kFrames / 2, 0, 1.4); },
+		      "compensated", compensated);
+		score(ratio, "brighten", [](SyntheticVideoReader& r) { r.addLightingRamp(30, 30, 1.4); },
+		      "compensated", compensated);
+		score(ratio, "busy", busy, "fixed", uncompensated);
+		score(ratio, "busy", busy, "adaptive", adaptive);
+	}
+
+	return 0;
+}
@@ -2,8 +2,16 @@
 
 #include <jsoncpp/json/value.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libswscale/swscale.h>
+// Newer FFmpeg versions include less of libavutil from the headers above
+#include <libavutil/error.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/mem.h>
 }